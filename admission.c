@@ -0,0 +1,120 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "conn_pool.h"
+
+/*
+ * Admission control. Load is judged by the number of connections in
+ * service against the configured limit, by the connections queued for the
+ * thread pool and, optionally, by the recent request latency against a
+ * target. Going up, load is shed in this order:
+ *
+ *   90% of limit, 1/8 of the queue or latency above target:
+ *                                        idle keep-alives are closed
+ *   limit reached, half the queue or latency twice target:
+ *                                        new TLS connections are reset
+ *
+ * Event workers have no queue to speak of: connections handed over wait in
+ * a worker's pending list only until its next wakeup, and anything slower
+ * shows in the latency.
+ *
+ * Plain HTTP is always let in; a pool thread or event worker answers it
+ * in less than the handshake of a TLS client would take. Independent of
+ * load, TLS and plain HTTP connections each have a quota of the limit, so
+ * a storm of TLS clients which never get past the handshake cannot take
+ * away the threads or workers that plain HTTP needs, and vice versa.
+ *
+ * The connections in service are counted by whichever thread opens or
+ * closes one, through stats_conn_open() and stats_conn_close(). The
+ * latency is a moving average the thread serving a request adds to as it
+ * accounts for it, or main() from the stats pipe without thread support;
+ * it fades once no requests come in, so refusing TLS does not keep itself
+ * going.
+ */
+
+#define LATENCY_WEIGHT 16       /* samples making up the moving average */
+#define SOFT_LIMIT(n)  ((n) - (n) / 10)
+#define TLS_QUOTA(n)   ((n) - (n) / 4)
+#define QUEUE_SOFT     (CONN_POOL_QUEUE / 8)
+#define QUEUE_HARD     (CONN_POOL_QUEUE / 2)
+#define REFUSE_DRAIN   4096     /* bytes of a refused request read at most */
+
+static const char http503[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static int limit = 0;
+static int target = 0;
+static volatile float latency = 0.0;
+static volatile time_t sampled = 0;
+static volatile int draining = 0;
+
+static time_t now_sec(void) {
+  struct timespec ts;
+  get_time(&ts);
+  return ts.tv_sec;
+}
+
+void admission_init(int max_conns, int max_tls, int latency_target) {
+  limit = max_conns;
+  target = latency_target;
+  tcq = (max_tls) ? max_tls : TLS_QUOTA(limit);
+  hcq = (limit > tcq) ? limit - tcq : 1;
+}
+
+int admission_over_quota(int tls) {
+  return (tls) ? tcc >= tcq : hcc >= hcq;
+}
+
+void admission_sample(double run_time) {
+  latency += (run_time - latency) / LATENCY_WEIGHT;
+  sampled = now_sec();
+}
+
+adm_level_enum admission_level(void) {
+  int n = kcc, q = 0;
+  float lat = 0.0;
+
+  if (draining)
+    return ADM_SHED_IDLE;
+  if (!limit)
+    return ADM_OK;
+#ifdef USE_PTHREAD
+  q = conn_pool_queued();
+#endif
+  if (target) {
+    time_t age = now_sec() - sampled;
+    /* halve per second without samples */
+    lat = (age < 16) ? latency / (1 << age) : 0.0;
+  }
+  if (n >= limit || q >= QUEUE_HARD || (target && lat > 2 * target))
+    return ADM_SHED_TLS;
+  if (n >= SOFT_LIMIT(limit) || q >= QUEUE_SOFT || (target && lat > target))
+    return ADM_SHED_IDLE;
+  return ADM_OK;
+}
+
+void admission_drain(void) {
+  draining = 1;
+}
+
+void admission_refuse(int fd, int tls) {
+  struct linger lin = {1, 0};
+  char drain[1024];
+  int n = 0, rv;
+
+  if (!tls && send(fd, http503, sizeof(http503) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+    /* unread request data would turn the close into a reset. bounded, as
+       this is the accept thread and a client may keep sending */
+    while (n < REFUSE_DRAIN && (rv = recv(fd, drain, sizeof(drain), MSG_DONTWAIT)) > 0)
+      n += rv;
+    shutdown(fd, SHUT_WR);
+  } else
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+  close(fd);
+}
@@ -0,0 +1,37 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#define SHED_IDLE_BATCH     16       /* idle connections an event worker sheds per pass */
+
+typedef enum {
+  ADM_OK,
+  ADM_SHED_IDLE,                /* close idle keep-alive connections */
+  ADM_SHED_TLS                  /* also refuse new TLS connections */
+} adm_level_enum;
+
+// limit is the number of connections served at once, of which at most
+// tls_limit over TLS and the rest over plain HTTP (tls_limit 0: three
+// quarters). target is the request latency in msec above which load is
+// shed (0: connection count only)
+void admission_init(int limit, int tls_limit, int target);
+
+// whether a new connection would take its class, TLS or plain HTTP, beyond
+// its quota. such connections are refused with admission_refuse()
+int admission_over_quota(int tls);
+
+// feed the processing time of a request in msec. called by whichever thread
+// served it; racing updates may drop a sample, which the average rides out
+void admission_sample(double run_time);
+
+// how much load to shed right now. plain HTTP is never refused for load;
+// it costs less to answer than to turn away. safe from any thread
+adm_level_enum admission_level(void);
+
+// from now on close every keep-alive connection once idle, as the
+// instance is about to go away
+void admission_drain(void);
+
+// turn away a connection: a 503 for plain HTTP, a reset for TLS. closes fd
+void admission_refuse(int fd, int tls);
+
+#endif // ADMISSION_H
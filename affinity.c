@@ -0,0 +1,106 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+#include "logger.h"
+
+/*
+ * CPU placement of the different kinds of threads. Without any list given
+ * everything is left to the scheduler. Once one role is restricted, every
+ * thread applies its role on start, so that threads created by a restricted
+ * one (e.g. pool threads started from the accept loop) do not inherit the
+ * wrong set. Memory of a thread bound to a single CPU is preferably taken
+ * from that CPU's node; buffers a worker allocates and touches itself, like
+ * its spare request states, thereby stay node local.
+ */
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static cpu_set_t cpus[CPU_ROLES];
+static int restricted[CPU_ROLES];
+static cpu_set_t allowed;       /* what we were started with */
+static int any_restricted = 0;
+
+int affinity_set(cpu_role_enum role, const char *list) {
+  const char *p = list;
+  char *end;
+  long first, last;
+
+  if (!any_restricted && sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+  CPU_ZERO(&cpus[role]);
+  do {
+    errno = 0;
+    first = last = strtol(p, &end, 10);
+    if (errno || end == p || first < 0)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (errno || end == p || last < first)
+        return -1;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, &cpus[role]);
+    p = end + 1;
+  } while (*end == ',');
+  if (*end != '\0')
+    return -1;
+
+  CPU_AND(&cpus[role], &cpus[role], &allowed);
+  if (CPU_COUNT(&cpus[role]) == 0)
+    return -1;
+  restricted[role] = 1;
+  any_restricted = 1;
+  return 0;
+}
+
+/* prefer memory from the NUMA node the calling thread runs on */
+static void numa_prefer_local(void) {
+#if defined(SYS_set_mempolicy) && defined(SYS_getcpu)
+  unsigned long nodes[4] = {0};
+  const int bits = 8 * sizeof(long);
+  unsigned cpu, node;
+
+  /* nothing to choose from on a single node */
+  if (access("/sys/devices/system/node/node1", F_OK) < 0)
+    return;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= sizeof(nodes) * 8)
+    return;
+  nodes[node / bits] |= 1UL << (node % bits);
+  /* the kernel takes maxnode as one more than the bits in the mask */
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, sizeof(nodes) * 8 + 1) < 0)
+    log_msg(LGG_DEBUG, "set_mempolicy: %m");
+#endif
+}
+
+void affinity_apply(cpu_role_enum role, int n) {
+  cpu_set_t one, *set;
+  int cpu, i;
+
+  if (!any_restricted)
+    return;
+  set = (restricted[role]) ? &cpus[role] : &allowed;
+  if (n >= 0 && restricted[role]) {
+    n %= CPU_COUNT(set);
+    for (cpu = 0, i = -1; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, set) && ++i == n)
+        break;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    set = &one;
+  }
+  // the calling thread moves right away, so it knows its node afterwards
+  if (sched_setaffinity(0, sizeof(cpu_set_t), set) < 0) {
+    log_msg(LGG_WARNING, "sched_setaffinity: %m");
+    return;
+  }
+  if (set == &one)
+    numa_prefer_local();
+}
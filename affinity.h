@@ -0,0 +1,21 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+typedef enum {
+  CPU_ACCEPT,                   /* main(): accept loop and statistics */
+  CPU_SERVE,                    /* event workers, pool threads, worker processes */
+  CPU_CERTGEN,                  /* certificate generator */
+  CPU_ROLES
+} cpu_role_enum;
+
+// restrict threads of role to the CPUs in list, e.g. "0-3,6". returns 0 on
+// success, -1 if list is malformed or names no CPU we may run on
+int affinity_set(cpu_role_enum role, const char *list);
+
+// move the calling thread (or process) onto the CPUs of role, with n >= 0
+// onto the n-th of them only, counting round robin. a thread bound to one
+// CPU also gets its memory from that CPU's NUMA node. roles without a list
+// may use any CPU; nothing happens unless some role has one
+void affinity_apply(cpu_role_enum role, int n);
+
+#endif // AFFINITY_H
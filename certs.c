@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -19,8 +20,11 @@
 #endif
 
 #include "certs.h"
+#include "affinity.h"
 #include "logger.h"
 #include "util.h"
+#include "hitters.h"
+#include "probes.h"
 
 #ifdef USE_PTHREAD
 
@@ -167,24 +171,32 @@ static int pem_passwd_cb(char *buf, int size, int rwflag, void *u) {
     return --rv; // trim \n at the end
 } 
 
-void *cert_generator(void *ptr) {
-
-#ifdef DEBUG
-    printf("%s: thread up and running\n", __FUNCTION__);
-#endif
-    cert_tlstor_t *cert_tlstor = (cert_tlstor_t *) ptr;
+static X509_NAME *read_ca_issuer(const char *pem_dir) {
     char *fname = malloc(PIXELSERV_MAX_PATH);
-    strcpy(fname, cert_tlstor->pem_dir);
+    strcpy(fname, pem_dir);
     strcat(fname, "/ca.crt");
     FILE *fp = fopen(fname, "r");
     X509 *x509 = X509_new();
     if(fp == NULL || PEM_read_X509(fp, &x509, NULL, NULL) == NULL)
        log_msg(LGG_ERR, "Failed to read ca.crt");
-    fclose(fp);
+    if (fp)
+        fclose(fp);
     free(fname);
 
     X509_NAME *issuer = X509_NAME_dup(X509_get_subject_name(x509));
     X509_free(x509);
+    return issuer;
+}
+
+void *cert_generator(void *ptr) {
+
+#ifdef DEBUG
+    printf("%s: thread up and running\n", __FUNCTION__);
+#endif
+    cert_tlstor_t *cert_tlstor = (cert_tlstor_t *) ptr;
+    affinity_apply(CPU_CERTGEN, -1);
+    char *fname;
+    X509_NAME *issuer = NULL;
 
     char *buf = malloc(PIXELSERV_MAX_SERVER_NAME * 4 + 1);
     buf[PIXELSERV_MAX_SERVER_NAME * 4] = '\0';
@@ -233,6 +245,10 @@ void *cert_generator(void *ptr) {
         }
         fclose(fp);
 
+        /* re-read with ca.key so a reloaded CA signs with a matching issuer */
+        X509_NAME_free(issuer);
+        issuer = read_ca_issuer(cert_tlstor->pem_dir);
+
         key = EVP_PKEY_new();
         EVP_PKEY_assign_RSA(key, rsa);
         md_ctx = EVP_MD_CTX_create();
@@ -248,8 +264,11 @@ void *cert_generator(void *ptr) {
                 // we don't check disk for cert. Simply re-gen and let it overwrite if exists on disk.
                 if(EVP_DigestSignInit(md_ctx, NULL, EVP_sha256(), NULL, key) != 1)
                     log_msg(LGG_ERR, "Failed to init signing context");
-                else
+                else {
+                    PROBE1(cert_gen_start, p_buf);
                     generate_cert(p_buf, cert_tlstor->pem_dir, issuer, md_ctx);
+                    PROBE1(cert_gen_done, p_buf);
+                }
             }
             p_buf = strtok_r(NULL, ":", &p_buf_sav);
         }
@@ -263,13 +282,203 @@ void *cert_generator(void *ptr) {
     return NULL;
 }
 
+int cachain_load(const char *pem_dir, STACK_OF(X509_INFO) **chain) {
+    char *fname = malloc(PIXELSERV_MAX_PATH);
+    strcpy(fname, pem_dir);
+    strcat(fname, "/ca.crt");
+    FILE *fp = fopen(fname, "r");
+    free(fname);
+    X509 *cacert = X509_new();
+    *chain = NULL;
+    if(fp == NULL || PEM_read_X509(fp, &cacert, NULL, NULL) == NULL) {
+      log_msg(LGG_ERR, "Failed to open/read ca.crt");
+      if (fp)
+        fclose(fp);
+      X509_free(cacert);
+      return -1;
+    }
+    EVP_PKEY * pubkey = X509_get_pubkey(cacert);
+    if (X509_verify(cacert, pubkey) <= 0)
+    {
+      BIO *bioin; int fsz; char *cafile;
+
+      if (fseek(fp, 0L, SEEK_END) < 0)
+        log_msg(LGG_ERR, "Failed to seek ca.crt");
+      fsz = ftell(fp);
+      cafile = malloc(fsz);
+      fseek(fp, 0L, SEEK_SET);
+      fread(cafile, 1, fsz, fp);
+
+      bioin = BIO_new_mem_buf(cafile, fsz);
+      if (!bioin)
+        log_msg(LGG_ERR, "Failed to create new BIO mem buffer");
+
+      *chain = PEM_X509_INFO_read_bio(bioin, NULL, NULL, NULL);
+      if (!*chain)
+        log_msg(LGG_ERR, "Failed to read CA chain from ca.crt");
+      BIO_free(bioin);
+      free(cafile);
+    }
+    fclose(fp);
+    EVP_PKEY_free(pubkey);
+    X509_free(cacert);
+    return 0;
+}
+
+static int tlsext_cb_arg_idx = -1;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+
+/* heap held by OpenSSL is charged to whatever the calling thread tracks */
+static __thread int *ssl_mem_acct = NULL;
+static int ssl_mem_on = 0;
+
+static void *ssl_mem_malloc(size_t num, const char *file, int line) {
+    void *p = malloc(num);
+    if (p && ssl_mem_acct)
+        *ssl_mem_acct += malloc_usable_size(p);
+    return p;
+}
+
+static void *ssl_mem_realloc(void *p, size_t num, const char *file, int line) {
+    size_t old = (p && ssl_mem_acct) ? malloc_usable_size(p) : 0;
+    void *n = realloc(p, num);
+    if (ssl_mem_acct && (n || !num))
+        *ssl_mem_acct += ((n) ? (int)malloc_usable_size(n) : 0) - (int)old;
+    return n;
+}
+
+static void ssl_mem_free(void *p, const char *file, int line) {
+    if (p && ssl_mem_acct)
+        *ssl_mem_acct -= malloc_usable_size(p);
+    free(p);
+}
+
+int ssl_mem_init(void) {
+    if (!CRYPTO_set_mem_functions(ssl_mem_malloc, ssl_mem_realloc, ssl_mem_free))
+        return -1;
+    ssl_mem_on = 1;
+    return 0;
+}
+
+int *ssl_mem_track(int *acct) {
+    int *prev = ssl_mem_acct;
+    if (ssl_mem_on)
+        ssl_mem_acct = acct;
+    return prev;
+}
+
+/*
+ * Contexts of loaded certificates, shared by all connections for the same
+ * name instead of one being loaded per connection. Direct mapped on a hash
+ * of the PEM path; a slot is replaced when another name hashes to it or the
+ * file changes. The cache holds one reference, each user takes its own.
+ */
+#define SSLCTX_CACHE_SLOTS 256
+
+static struct {
+    char *path;
+    time_t mtime;
+    SSL_CTX *sslctx;
+} sslctx_cache[SSLCTX_CACHE_SLOTS];
+#ifdef USE_PTHREAD
+static pthread_mutex_t sslctx_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int sslctx_slot(const char *path) {
+    unsigned int h = 5381;
+    while (*path)
+        h = h * 33 + (unsigned char)*path++;
+    return h % SSLCTX_CACHE_SLOTS;
+}
+
+/* referenced context for path if still current, otherwise NULL */
+static SSL_CTX *sslctx_cache_get(const char *path, time_t mtime) {
+    unsigned int i = sslctx_slot(path);
+    SSL_CTX *sslctx = NULL;
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&sslctx_cache_lock);
+#endif
+    if (sslctx_cache[i].sslctx && sslctx_cache[i].mtime == mtime
+            && !strcmp(sslctx_cache[i].path, path)) {
+        sslctx = sslctx_cache[i].sslctx;
+        SSL_CTX_up_ref(sslctx);
+    }
+#ifdef USE_PTHREAD
+    pthread_mutex_unlock(&sslctx_cache_lock);
+#endif
+    return sslctx;
+}
+
+static void sslctx_cache_put(const char *path, time_t mtime, SSL_CTX *sslctx) {
+    unsigned int i = sslctx_slot(path);
+    char *p = strdup(path);
+    if (!p)
+        return;
+    SSL_CTX_up_ref(sslctx);
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&sslctx_cache_lock);
+#endif
+    /* connections still using the old one hold their own reference */
+    SSL_CTX_free(sslctx_cache[i].sslctx);
+    free(sslctx_cache[i].path);
+    sslctx_cache[i].path = p;
+    sslctx_cache[i].mtime = mtime;
+    sslctx_cache[i].sslctx = sslctx;
+#ifdef USE_PTHREAD
+    pthread_mutex_unlock(&sslctx_cache_lock);
+#endif
+}
+
+/* drop every cached context, e.g. after the CA was replaced on reload */
+void sslctx_cache_flush(void) {
+    int i;
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&sslctx_cache_lock);
+#endif
+    for (i = 0; i < SSLCTX_CACHE_SLOTS; i++) {
+        SSL_CTX_free(sslctx_cache[i].sslctx);
+        free(sslctx_cache[i].path);
+        sslctx_cache[i].sslctx = NULL;
+        sslctx_cache[i].path = NULL;
+    }
+#ifdef USE_PTHREAD
+    pthread_mutex_unlock(&sslctx_cache_lock);
+#endif
+}
+
+int sslctx_cache_entries(int *slots) {
+    int i, n = 0;
+    /* no lock: a slot changing meanwhile only makes the count stale */
+    for (i = 0; i < SSLCTX_CACHE_SLOTS; i++)
+        if (sslctx_cache[i].sslctx)
+            n++;
+    *slots = SSLCTX_CACHE_SLOTS;
+    return n;
+}
+
+#else
+
+int ssl_mem_init(void) { return -1; }
+int *ssl_mem_track(int *acct) { return NULL; }
+void sslctx_cache_flush(void) {}
+int sslctx_cache_entries(int *slots) { *slots = 0; return 0; }
+#define sslctx_cache_get(path, mtime) NULL
+#define sslctx_cache_put(path, mtime, sslctx)
+
+#endif // OPENSSL_VERSION_NUMBER
+
 static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
 
     int rv = SSL_TLSEXT_ERR_OK;
-    tlsext_cb_arg_struct *cbarg = (tlsext_cb_arg_struct *)arg;
+    tlsext_cb_arg_struct *cbarg = SSL_get_ex_data(ssl, tlsext_cb_arg_idx);
     char full_pem_path[PIXELSERV_MAX_PATH + 1 + 1]; /* worst case ':\0' */
     int len;
 
+    /* argument already dropped by an event worker; keep the context */
+    if (!cbarg)
+        return SSL_TLSEXT_ERR_OK;
+
     full_pem_path[PIXELSERV_MAX_PATH] = '\0';
     strncpy(full_pem_path, cbarg->tls_pem, PIXELSERV_MAX_PATH);
     len = strlen(cbarg->tls_pem);
@@ -278,9 +487,10 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
 
     char *srv_name = NULL;
     cbarg->servername = (char*)SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
-    if (cbarg->servername)
+    if (cbarg->servername) {
         srv_name = (char *)cbarg->servername;
-    else if (cbarg->server_ip)
+        hitters_count(HIT_SNI, srv_name, strlen(srv_name));
+    } else if (cbarg->server_ip)
         srv_name = cbarg->server_ip;
     else {
         log_msg(LGG_WARNING, "SNI failed. server name and server ip empty.");
@@ -322,10 +532,12 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
     if(stat(full_pem_path, &st) != 0){
         int fd;
         cbarg->status = SSL_MISS;
+        PROBE1(sni_miss, srv_name);
         log_msg(LGG_WARNING, "%s %s missing", srv_name, pem_file);
         if((fd = open(PIXEL_CERT_PIPE, O_WRONLY)) < 0)
             log_msg(LGG_ERR, "Failed to open %s: %s", PIXEL_CERT_PIPE, strerror(errno));
         else {
+            PROBE1(cert_enqueue, pem_file);
             strcat(pem_file, ":");
             write(fd, pem_file, strlen(pem_file));
             close(fd);
@@ -334,14 +546,18 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
         goto quit_cb;
     }
 
-    SSL_CTX *sslctx = NULL;
+    SSL_CTX *sslctx = sslctx_cache_get(full_pem_path, st.st_mtime);
+    if (sslctx)
+        goto use_ctx;
+    /* a shared context is not charged to the connection loading it */
+    int *acct = ssl_mem_track(NULL);
     sslctx = SSL_CTX_new(TLSv1_2_server_method());
     SSL_CTX_set_ecdh_auto(sslctx, 1);
     SSL_CTX_set_options(sslctx,
           SSL_OP_SINGLE_DH_USE |
-          SSL_MODE_RELEASE_BUFFERS |
           SSL_OP_NO_COMPRESSION |
           SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(sslctx, SSL_MODE_RELEASE_BUFFERS);
     SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
     if (SSL_CTX_set_cipher_list(sslctx, PIXELSERV_CIPHER_LIST) <= 0)
         log_msg(LGG_DEBUG, "Failed to set cipher list");
@@ -349,6 +565,7 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
        || SSL_CTX_use_PrivateKey_file(sslctx, full_pem_path, SSL_FILETYPE_PEM) <= 0)
     {
         SSL_CTX_free(sslctx);
+        ssl_mem_track(acct);
         cbarg->status = SSL_ERR;
         log_msg(LGG_ERR, "Cannot use %s\n",full_pem_path);
         rv = SSL_TLSEXT_ERR_ALERT_FATAL;
@@ -360,15 +577,20 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
             if ((inf = sk_X509_INFO_value(cbarg->cachain, i)) && inf->x509 &&
                     !SSL_CTX_add_extra_chain_cert(sslctx, X509_dup(inf->x509))) {
                 SSL_CTX_free(sslctx);
+                ssl_mem_track(acct);
                 log_msg(LGG_ERR, "Cannot add CA cert %d\n", i);  /* X509_ref_up requires >= v1.1 */
                 rv = SSL_TLSEXT_ERR_ALERT_FATAL;
                 goto quit_cb;
             }
         }
     }
+    sslctx_cache_put(full_pem_path, st.st_mtime, sslctx);
+    ssl_mem_track(acct);
+use_ctx:
     SSL_set_SSL_CTX(ssl, sslctx);
     cbarg->status = SSL_HIT;
     cbarg->sslctx = (void*)sslctx;
+    PROBE1(sni_hit, srv_name);
 
 quit_cb:
 
@@ -383,13 +605,17 @@ SSL_CTX * create_default_sslctx(const char *pem_dir) {
     SSL_CTX *sslctx = NULL;
     sslctx = SSL_CTX_new(TLSv1_2_server_method());
     SSL_CTX_set_options(sslctx,
-          SSL_MODE_RELEASE_BUFFERS |
           SSL_OP_NO_COMPRESSION |
           SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(sslctx, SSL_MODE_RELEASE_BUFFERS);
     SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
     if (SSL_CTX_set_cipher_list(sslctx, PIXELSERV_CIPHER_LIST) <= 0)
         log_msg(LGG_DEBUG, "cipher_list cannot be set");
     SSL_CTX_set_tlsext_servername_callback(sslctx, tls_servername_cb);
+    // per connection callback argument lives in SSL ex_data so that the
+    // context can be shared by all threads
+    if (tlsext_cb_arg_idx < 0)
+        tlsext_cb_arg_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 
     return sslctx;
 }
@@ -423,4 +649,110 @@ int is_ssl_conn(int fd, char *srv_ip, int srv_ip_len, const int *ssl_ports, int
 #endif
 
     return rv;
-}
\ No newline at end of file
+}
+
+/*
+ * Bounded reading of a ClientHello as far as the server_name extension,
+ * walking the buffer with explicit length checks only. Anything unexpected,
+ * including a hello not yet complete in what was peeked, ends the walk.
+ */
+#define SNI_PEEK_MAX 4096
+#define GET16(p) (((p)[0] << 8) | (p)[1])
+
+int tls_peek_sni(int fd, char *name, int size) {
+
+    unsigned char buf[SNI_PEEK_MAX];
+    int len, end, pos, ext_type, ext_len;
+
+    len = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    /* handshake record carrying a ClientHello */
+    if (len < 5 + 4 || buf[0] != 0x16 || buf[5] != 0x01)
+        return -1;
+    end = 5 + GET16(buf + 3);
+    if (end > len)
+        end = len;
+    /* hello version and random, then session id */
+    pos = 5 + 4 + 2 + 32;
+    if (pos + 1 > end || (pos += 1 + buf[pos]) + 2 > end)
+        return -1;
+    /* cipher suites, then compression methods */
+    if ((pos += 2 + GET16(buf + pos)) + 1 > end || (pos += 1 + buf[pos]) + 2 > end)
+        return -1;
+    if (pos + 2 + GET16(buf + pos) < end)
+        end = pos + 2 + GET16(buf + pos);
+    for (pos += 2; pos + 4 <= end; pos += 4 + ext_len) {
+        ext_type = GET16(buf + pos);
+        ext_len = GET16(buf + pos + 2);
+        if (ext_type != 0x0000)
+            continue;
+        /* server_name_list with the host_name first */
+        if (ext_len < 5 || pos + 4 + ext_len > end || buf[pos + 6] != 0)
+            return -1;
+        len = GET16(buf + pos + 7);
+        if (len <= 0 || len >= size || pos + 9 + len > end)
+            return -1;
+        memcpy(name, buf + pos + 9, len);
+        name[len] = '\0';
+        return len;
+    }
+    return -1;
+}
+
+int ssl_conn_init(SSL_CTX *sslctx, conn_tlstor_struct *conn_tlstor, const char *tls_pem,
+                  const STACK_OF(X509_INFO) *cachain) {
+
+    SSL *ssl = NULL;
+    tlsext_cb_arg_struct *t = malloc(sizeof(tlsext_cb_arg_struct));
+    if (!t)
+        return -1;
+    t->tls_pem = tls_pem;
+    t->cachain = cachain;
+    t->servername = NULL;
+    strncpy(t->server_ip, conn_tlstor->server_ip, INET6_ADDRSTRLEN);
+    t->status = SSL_UNKNOWN;
+    t->sslctx = NULL;
+
+    if (!(ssl = SSL_new(sslctx))
+        || !SSL_set_fd(ssl, conn_tlstor->new_fd)
+        || !SSL_set_ex_data(ssl, tlsext_cb_arg_idx, t)) {
+        log_msg(LGG_ERR, "Failed to set up TLS on socket:%d", conn_tlstor->new_fd);
+        SSL_free(ssl);
+        free(t);
+        return -1;
+    }
+    conn_tlstor->ssl = ssl;
+    conn_tlstor->tlsext_cb_arg = t;
+    return 0;
+}
+
+void ssl_conn_drop_cb_arg(SSL *ssl, tlsext_cb_arg_struct *t) {
+
+    SSL_set_ex_data(ssl, tlsext_cb_arg_idx, NULL);
+    SSL_CTX_free((SSL_CTX*)t->sslctx);
+    free(t);
+}
+
+int ssl_handshake(SSL_CTX *sslctx, conn_tlstor_struct *conn_tlstor, const char *tls_pem,
+                  const STACK_OF(X509_INFO) *cachain, ssl_enum *status) {
+
+    tlsext_cb_arg_struct *t;
+    if (ssl_conn_init(sslctx, conn_tlstor, tls_pem, cachain) < 0) {
+        *status = SSL_UNKNOWN;
+        return 0;
+    }
+    t = conn_tlstor->tlsext_cb_arg;
+    int ssl_err = SSL_accept(conn_tlstor->ssl);
+    if (ssl_err != 1) {
+        log_msg(LGG_DEBUG, "SSL_accept error:%d status:%d\n", ssl_err, t->status);
+        *status = t->status;
+        SSL_free(conn_tlstor->ssl);
+        SSL_CTX_free((SSL_CTX*)t->sslctx);
+        free(t);
+        conn_tlstor->ssl = NULL;
+        conn_tlstor->tlsext_cb_arg = NULL;
+        return 0;
+    }
+    TESTPRINT("ssl new_fd:%d\n", conn_tlstor->new_fd);
+    *status = SSL_HIT;
+    return 1;
+}
@@ -49,7 +49,11 @@ typedef struct {
     int new_fd;
     SSL *ssl;
     double init_time;
+    struct timespec accept_time;        /* for the trace of the first request */
     tlsext_cb_arg_struct * tlsext_cb_arg;
+    int tls;                            /* handshake still to be done */
+    int client;                         /* ratelimit_conn() handle, 0 if untracked */
+    char server_ip[INET6_ADDRSTRLEN];
 } conn_tlstor_struct;
 
 #define CONN_TLSTOR(p, e) ((conn_tlstor_struct*)p)->e
@@ -57,7 +61,36 @@ typedef struct {
 void ssl_init_locks();
 void ssl_free_locks();
 void *cert_generator(void *ptr);
+// charge heap held by OpenSSL to counters of the calling thread. must come
+// before any other OpenSSL call. returns 0 on success
+int ssl_mem_init(void);
+// from now on count the calling thread's OpenSSL allocations in *acct (not
+// at all if NULL). returns the previous counter
+int *ssl_mem_track(int *acct);
 SSL_CTX * create_default_sslctx(const char *pem_dir);
+// read pem_dir/ca.crt. *chain is set to the certificates to send along with
+// generated ones, NULL if the CA is self-signed. returns -1 if unreadable
+int cachain_load(const char *pem_dir, STACK_OF(X509_INFO) **chain);
+// forget all cached certificate contexts
+void sslctx_cache_flush(void);
+// number of certificate contexts cached, out of *slots
+int sslctx_cache_entries(int *slots);
 int is_ssl_conn(int fd, char *srv_ip, int srv_ip_len, const int *ssl_ports, int num_ssl_ports);
+// copy the SNI host name of the ClientHello waiting on fd into name,
+// without consuming any of it. returns the length of the name, or -1 if
+// none is found in what has arrived so far or it does not fit size
+int tls_peek_sni(int fd, char *name, int size);
+// attach a new SSL object for conn_tlstor->new_fd to conn_tlstor along with
+// the SNI callback argument. returns 0 on success, -1 on error
+int ssl_conn_init(SSL_CTX *sslctx, conn_tlstor_struct *conn_tlstor, const char *tls_pem,
+                  const STACK_OF(X509_INFO) *cachain);
+// free the SNI callback argument of an established connection ahead of the
+// connection itself. the SSL object keeps the context it was switched to
+void ssl_conn_drop_cb_arg(SSL *ssl, tlsext_cb_arg_struct *t);
+// blocking server side TLS handshake on conn_tlstor->new_fd. on success fills
+// in ssl and tlsext_cb_arg of conn_tlstor and returns 1. otherwise cleans up,
+// returns 0 and reports in status what the SNI callback saw
+int ssl_handshake(SSL_CTX *sslctx, conn_tlstor_struct *conn_tlstor, const char *tls_pem,
+                  const STACK_OF(X509_INFO) *cachain, ssl_enum *status);
 
 #endif
@@ -0,0 +1,199 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "conn_pool.h"
+#include "affinity.h"
+#include "socket_handler.h"
+#include "logger.h"
+
+#ifdef USE_PTHREAD
+
+/*
+ * Pool of conn_handler threads. The accept loop pushes connections onto a
+ * bounded lock-free queue (Vyukov's array based MPMC queue) and posts a
+ * semaphore; idle threads sleep on the semaphore and pick them up. A thread
+ * is added whenever more connections are queued than threads are idle, up
+ * to max_threads. Threads above
+ * min_threads go away again after idle_timeout secs without work.
+ */
+
+typedef struct {
+  size_t seq;
+  conn_tlstor_struct *data;
+} pool_cell_struct;
+
+static struct {
+  pool_cell_struct cells[CONN_POOL_QUEUE];
+  char pad0[CACHE_LINE];
+  size_t head;                  /* next cell to push */
+  char pad1[CACHE_LINE - sizeof(size_t)];
+  size_t tail;                  /* next cell to pop */
+  char pad2[CACHE_LINE - sizeof(size_t)];
+} queue;
+
+static sem_t queued;
+static int idle = 0;
+static int min_threads = 0;
+static int max_threads = 0;
+static int idle_timeout = DEFAULT_POOL_IDLE;
+static pthread_attr_t attr;
+
+static int queue_push(conn_tlstor_struct *c) {
+  size_t pos = __atomic_load_n(&queue.head, __ATOMIC_RELAXED);
+  pool_cell_struct *cell;
+
+  for (;;) {
+    long diff;
+
+    cell = &queue.cells[pos & (CONN_POOL_QUEUE - 1)];
+    diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue.head, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0)
+      return -1; /* full */
+    else
+      pos = __atomic_load_n(&queue.head, __ATOMIC_RELAXED);
+  }
+  cell->data = c;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static conn_tlstor_struct *queue_pop(void) {
+  size_t pos = __atomic_load_n(&queue.tail, __ATOMIC_RELAXED);
+  pool_cell_struct *cell;
+  conn_tlstor_struct *c;
+
+  for (;;) {
+    long diff;
+
+    cell = &queue.cells[pos & (CONN_POOL_QUEUE - 1)];
+    diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue.tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0)
+      return NULL; /* empty */
+    else
+      pos = __atomic_load_n(&queue.tail, __ATOMIC_RELAXED);
+  }
+  c = cell->data;
+  __atomic_store_n(&cell->seq, pos + CONN_POOL_QUEUE, __ATOMIC_RELEASE);
+  return c;
+}
+
+static int queue_depth(void) {
+  return __atomic_load_n(&queue.head, __ATOMIC_RELAXED)
+       - __atomic_load_n(&queue.tail, __ATOMIC_RELAXED);
+}
+
+int conn_pool_queued(void) {
+  int n = queue_depth();
+
+  /* head and tail are read apart, so the difference may be off briefly */
+  return (n > 0) ? n : 0;
+}
+
+/* give up a thread slot unless it would take the pool below min_threads */
+static int pool_shrink(void) {
+  int n = __atomic_load_n(&pln, __ATOMIC_RELAXED);
+
+  while (n > min_threads)
+    if (__atomic_compare_exchange_n(&pln, &n, n - 1, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+static void *pool_worker(void *arg) {
+  conn_tlstor_struct *c;
+  struct timespec ts;
+  int rv;
+
+  affinity_apply(CPU_SERVE, -1);
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += idle_timeout;
+    __atomic_add_fetch(&idle, 1, __ATOMIC_RELAXED);
+    while ((rv = sem_timedwait(&queued, &ts)) < 0 && errno == EINTR)
+      ;
+    __atomic_sub_fetch(&idle, 1, __ATOMIC_RELAXED);
+    if (rv < 0) {
+      if (errno == ETIMEDOUT && pool_shrink()) {
+        log_msg(LGG_DEBUG, "conn pool thread exits after %d secs idle", idle_timeout);
+        return NULL;
+      }
+      continue;
+    }
+    if ((c = queue_pop()) == NULL)
+      continue;
+    __atomic_add_fetch(&plb, 1, __ATOMIC_RELAXED);
+    conn_handler((void*)c);
+    __atomic_sub_fetch(&plb, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* start one more thread if below max_threads. returns 0 if a thread was
+   started, 1 if the pool is already at max_threads, -1 on error */
+static int pool_grow(void) {
+  pthread_t thread;
+  int n = __atomic_load_n(&pln, __ATOMIC_RELAXED);
+  int err;
+
+  do {
+    if (n >= max_threads)
+      return 1;
+  } while (!__atomic_compare_exchange_n(&pln, &n, n + 1, 0,
+             __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if ((err = pthread_create(&thread, &attr, pool_worker, NULL))) {
+    __atomic_sub_fetch(&pln, 1, __ATOMIC_RELAXED);
+    log_msg(LGG_ERR, "Failed to create conn pool thread. err: %d", err);
+    return -1;
+  }
+  if (n + 1 > plx)
+    plx = n + 1;
+  return 0;
+}
+
+int conn_pool_init(int min, int max, int timeout, size_t stack_size) {
+  size_t i;
+
+  if (max < 1)
+    return -1;
+  max_threads = max;
+  min_threads = (min < max) ? min : max;
+  idle_timeout = timeout;
+  for (i = 0; i < CONN_POOL_QUEUE; i++)
+    queue.cells[i].seq = i;
+  if (sem_init(&queued, 0, 0) < 0)
+    return -1;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, stack_size);
+
+  for (i = 0; i < (size_t)min_threads; i++)
+    if (pool_grow() < 0)
+      return -1;
+  log_msg(LGG_NOTICE, "Started conn pool with %d of max %d threads", min_threads, max_threads);
+  return 0;
+}
+
+int conn_pool_submit(conn_tlstor_struct *conn_tlstor) {
+  if (queue_push(conn_tlstor) < 0)
+    return -1;
+  sem_post(&queued);
+  // pool threads sit in conn_handler for as long as the client keeps the
+  // connection alive, so don't wait for one to come back if none is idle
+  if (queue_depth() > __atomic_load_n(&idle, __ATOMIC_RELAXED))
+    pool_grow();
+  return 0;
+}
+
+#endif // USE_PTHREAD
@@ -0,0 +1,23 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include "certs.h"
+
+#define DEFAULT_POOL_MIN    4        /* threads kept alive in the pool */
+#define DEFAULT_POOL_IDLE   60       /* secs before a spare thread exits */
+#define CONN_POOL_QUEUE     256      /* queued connections; power of 2 */
+
+// start min_threads conn_handler threads, growing on demand up to
+// max_threads. threads above min_threads exit after idle_timeout secs
+// without work. returns 0 on success
+int conn_pool_init(int min_threads, int max_threads, int idle_timeout, size_t stack_size);
+
+// queue an accepted connection for a pool thread, which owns conn_tlstor
+// on success. returns 0 on success, -1 if the queue is full or no thread
+// could be started
+int conn_pool_submit(conn_tlstor_struct *conn_tlstor);
+
+// connections queued for a pool thread right now. safe from any thread
+int conn_pool_queued(void);
+
+#endif // CONN_POOL_H
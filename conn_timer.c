@@ -0,0 +1,221 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "conn_timer.h"
+#include "logger.h"
+
+#ifdef USE_PTHREAD
+
+/*
+ * Hashed timer wheel holding the deadlines of all connections served by
+ * conn_handler threads. A timer is linked into slot (expires % SLOTS); one
+ * thread wakes every tick while any timer is armed and fires the expired
+ * ones in the slots passed since, so arming, cancelling and expiring are
+ * O(1) and idle clients cost nothing until their deadline. Timers further
+ * out than one turn of the wheel are simply skipped until their turn comes.
+ */
+
+static conn_timer_struct wheel[CONN_TIMER_SLOTS];   /* list heads */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static unsigned long next_tick = 0;                 /* next slot to expire */
+static int armed = 0;
+static struct timespec epoch = {0, 0};
+
+static unsigned long now_tick(void) {
+  struct timespec now;
+
+  get_time(&now);
+  return ((now.tv_sec - epoch.tv_sec) * 1000
+          + (now.tv_nsec - epoch.tv_nsec) / 1000000) / CONN_TIMER_TICK;
+}
+
+static void unlink_timer(conn_timer_struct *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+  --armed;
+}
+
+static void expire_slot(conn_timer_struct *head, unsigned long now) {
+  conn_timer_struct *t, *next;
+
+  for (t = head->next; t != head; t = next) {
+    next = t->next;
+    if (t->expires > now)
+      continue;
+    unlink_timer(t);
+    t->fired = 1;
+    shutdown(t->fd, SHUT_RD);
+  }
+}
+
+static void *timer_thread(void *arg) {
+  const struct timespec tick = {0, CONN_TIMER_TICK * 1000000L};
+  unsigned long now;
+  int n;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    while (!armed)
+      pthread_cond_wait(&wakeup, &lock);
+    pthread_mutex_unlock(&lock);
+
+    nanosleep(&tick, NULL);
+
+    pthread_mutex_lock(&lock);
+    now = now_tick();
+    // after a long sleep every slot is due, but no slot more than once
+    for (n = 0; next_tick <= now && n < CONN_TIMER_SLOTS; n++, next_tick++)
+      expire_slot(&wheel[next_tick & (CONN_TIMER_SLOTS - 1)], now);
+    next_tick = now + 1;
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+int conn_timer_init(size_t stack_size) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i, err;
+
+  for (i = 0; i < CONN_TIMER_SLOTS; i++)
+    wheel[i].next = wheel[i].prev = &wheel[i];
+  get_time(&epoch);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, stack_size);
+  if ((err = pthread_create(&thread, &attr, timer_thread, NULL))) {
+    log_msg(LGG_ERR, "Failed to create timer thread. err: %d", err);
+    return -1;
+  }
+  return 0;
+}
+
+static void arm_timer(conn_timer_struct *t, int fd, int secs, int idle) {
+  unsigned long ticks = (secs * 1000 + CONN_TIMER_TICK - 1) / CONN_TIMER_TICK;
+
+  pthread_mutex_lock(&lock);
+  if (t->next)
+    unlink_timer(t);
+  t->fd = fd;
+  t->idle = idle;
+  t->fired = 0;
+  t->expires = now_tick() + ((ticks) ? ticks : 1);
+  if (t->expires < next_tick)
+    t->expires = next_tick;
+  t->next = &wheel[t->expires & (CONN_TIMER_SLOTS - 1)];
+  t->prev = t->next->prev;
+  t->prev->next = t;
+  t->next->prev = t;
+  if (armed++ == 0)
+    pthread_cond_signal(&wakeup);
+  pthread_mutex_unlock(&lock);
+}
+
+void conn_timer_arm(conn_timer_struct *t, int fd, int secs) {
+  arm_timer(t, fd, secs, 0);
+}
+
+void conn_timer_arm_idle(conn_timer_struct *t, int fd, int secs) {
+  arm_timer(t, fd, secs, 1);
+}
+
+int conn_timer_disarm(conn_timer_struct *t) {
+  int fired;
+
+  pthread_mutex_lock(&lock);
+  if (t->next)
+    unlink_timer(t);
+  fired = t->fired;
+  pthread_mutex_unlock(&lock);
+  return fired;
+}
+
+int conn_timer_shed_idle(int n) {
+  conn_timer_struct *t, *next, *head;
+  unsigned long i;
+  int shed = 0;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < CONN_TIMER_SLOTS && shed < n && armed; i++) {
+    head = &wheel[(next_tick + i) & (CONN_TIMER_SLOTS - 1)];
+    for (t = head->next; t != head && shed < n; t = next) {
+      next = t->next;
+      if (!t->idle)
+        continue;
+      unlink_timer(t);
+      t->fired = CONN_TIMER_SHED;
+      shutdown(t->fd, SHUT_RD);
+      shed++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return shed;
+}
+
+#else
+
+/*
+ * Each process serves a single connection at a time, so a plain interval
+ * timer does the job.
+ */
+
+static conn_timer_struct *volatile pending = NULL;
+
+static void timer_alarm(int sig) {
+  conn_timer_struct *t = pending;
+
+  if (t) {
+    t->fired = 1;
+    shutdown(t->fd, SHUT_RD);
+  }
+}
+
+int conn_timer_init(size_t stack_size) {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = timer_alarm;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGALRM, &sa, NULL)) {
+    log_msg(LGG_ERR, "SIGALRM %m");
+    return -1;
+  }
+  return 0;
+}
+
+void conn_timer_arm(conn_timer_struct *t, int fd, int secs) {
+  struct itimerval it = { {0, 0}, {secs, 0} };
+
+  t->fd = fd;
+  t->fired = 0;
+  pending = t;
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+void conn_timer_arm_idle(conn_timer_struct *t, int fd, int secs) {
+  conn_timer_arm(t, fd, secs);
+}
+
+int conn_timer_disarm(conn_timer_struct *t) {
+  struct itimerval it = { {0, 0}, {0, 0} };
+
+  setitimer(ITIMER_REAL, &it, NULL);
+  pending = NULL;
+  return t->fired;
+}
+
+/* idle workers are the pool's business */
+int conn_timer_shed_idle(int n) {
+  return 0;
+}
+
+#endif // USE_PTHREAD
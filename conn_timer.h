@@ -0,0 +1,39 @@
+#ifndef CONN_TIMER_H
+#define CONN_TIMER_H
+
+#include <stddef.h>
+
+#define CONN_TIMER_TICK     250      /* wheel resolution in msec */
+#define CONN_TIMER_SLOTS    512      /* power of 2; one turn is 128 secs */
+#define CONN_TIMER_SHED     2        /* fired value of a timer cut short */
+
+// deadline of a connection served by conn_handler. when it passes, the read
+// side of fd is shut down so that whatever the handler blocks in returns
+typedef struct conn_timer_struct {
+  struct conn_timer_struct *next, *prev;
+  unsigned long expires;        /* in ticks */
+  int fd;
+  int idle;                     /* waiting for the next request */
+  volatile int fired;           /* 1, or CONN_TIMER_SHED */
+} conn_timer_struct;
+
+// start the timer thread (or, without USE_PTHREAD, install the SIGALRM
+// handler). returns 0 on success
+int conn_timer_init(size_t stack_size);
+
+// (re)arm t to fire on fd after secs
+void conn_timer_arm(conn_timer_struct *t, int fd, int secs);
+
+// as conn_timer_arm() for a keep-alive connection waiting for its next
+// request, which conn_timer_shed_idle() may cut short
+void conn_timer_arm_idle(conn_timer_struct *t, int fd, int secs);
+
+// cancel t. returns its fired value if it fired before it could be
+// cancelled, 0 otherwise
+int conn_timer_disarm(conn_timer_struct *t);
+
+// fire up to n idle timers early, those closest to expiry first. returns
+// how many fired
+int conn_timer_shed_idle(int n);
+
+#endif // CONN_TIMER_H
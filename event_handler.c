@@ -0,0 +1,1479 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "event_handler.h"
+#include "affinity.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "uring.h"
+#include "socket_handler.h"
+#include "stats.h"
+#include "feed.h"
+#include "hitters.h"
+#include "trace.h"
+#include "probes.h"
+#include "certs.h"
+#include "logger.h"
+
+#ifdef USE_PTHREAD
+
+/*
+ * Event-driven connection handling. Each worker thread owns an epoll set and
+ * drives its connections through a small state machine with non-blocking
+ * sockets, instead of parking one thread per keep-alive connection.
+ *
+ *   [HANDSHAKE ->] READING -> WRITING -> IDLE -> READING ...
+ *
+ * TLS handshakes are non-blocking too, so a slow client or a certificate
+ * being loaded in the SNI callback only holds up its own worker.
+ *
+ * Timeouts are kept in FIFO lists per worker, one for select_timeout
+ * (handshake / request headers / response write), one for POST content
+ * and one for http_keepalive (idle). All entries in a list share the same
+ * timeout so appending on (re)arm keeps each list ordered by expiry. A
+ * fourth list holds stats feed connections, which the feed owns once their
+ * request is answered, until the next event is due for all of them.
+ * Handshake, headers and content each get one absolute deadline: data
+ * trickling in does not re-arm it, so a slow client cannot hold on to a
+ * connection for longer than that.
+ *
+ * Connections either arrive from the main accept loop through a pending list
+ * or, with SO_REUSEPORT sharding, are accepted by the worker itself from its
+ * own set of listening sockets, one per port. The kernel then spreads new
+ * connections across workers and the main thread only collects statistics.
+ *
+ * A connection only carries what it needs between requests. Receive buffer
+ * and request state are attached from a per-worker spare list when a request
+ * starts and handed back once the response is out, and OpenSSL is told to
+ * release its buffers, so an idle keep-alive client costs little more than
+ * its socket. The stats page shows what idle connections actually hold.
+ *
+ * With the io_uring backend a worker waits on its ring instead of epoll.
+ * Listeners use multishot accept, plain HTTP connections receive into a
+ * pool of provided buffers and each response is sent linked to the recv
+ * for the next request, so a keep-alive request costs no syscall of its
+ * own. TLS connections and the hand-over eventfd stay in the epoll set,
+ * which is itself polled through the ring.
+ */
+
+typedef enum {
+  CONN_HANDSHAKE,
+  CONN_READING,
+  CONN_WRITING,
+  CONN_IDLE,
+  CONN_FEED                     /* waiting for the next stats feed event */
+} conn_state_enum;
+
+typedef enum {
+  TLIST_NONE = -1,
+  TLIST_IO,
+  TLIST_BODY,
+  TLIST_IDLE,
+  TLIST_FEED,
+  TLIST_NUM
+} tlist_enum;
+
+/* state of the request being served */
+typedef struct event_req {
+  struct event_req *next;       /* in the worker's spare list */
+  char *buf;                    /* receive buffer, NUL terminated */
+  int buf_len;
+  int buf_size;
+  int hdr_len;                  /* length of headers incl. blank line once seen */
+  int body_want;                /* POST Content-Length */
+  int body_recv;                /* POST content received, kept or discarded */
+  int wr_off;
+  struct timespec wr_start;     /* response began to go out */
+  strbuf_struct feed;           /* stats feed event being sent */
+  http_req_struct req;
+  response_struct pipedata;
+  char chunk[CHAR_BUF_SIZE + 1];  /* buf until a request outgrows it */
+} event_req_struct;
+
+typedef struct event_conn {
+  struct event_conn *prev, *next;
+  SSL *ssl;
+  tlsext_cb_arg_struct *tlsext_cb_arg;  /* until the handshake is done */
+  event_req_struct *r;          /* none while idle */
+  time_t expire;
+  struct timespec start_time;
+  struct timespec accept_time;  /* trace of the first request counts from it */
+  unsigned int trace[TRACE_MARKS];  /* marks before the first request */
+  float run_time;               /* accept and handshake, not yet reported */
+  int fd;
+  int client;                   /* ratelimit_conn() handle */
+  int num_req;
+  unsigned int total_bytes;
+  int ssl_mem;                  /* heap held by OpenSSL for ssl */
+  uint32_t events;              /* events currently registered with epoll */
+  unsigned char state;          /* conn_state_enum */
+  signed char tlist;            /* tlist_enum */
+  unsigned char eof;            /* client shut down its sending side */
+  unsigned char feed;           /* serving the stats feed */
+#ifdef HAVE_IO_URING
+  unsigned char uring;          /* I/O goes through the worker's ring */
+  unsigned char inflight;       /* submitted, not yet completed */
+  unsigned char recv_armed;
+  unsigned char closing;        /* release once nothing is inflight */
+#endif
+} event_conn_struct;
+
+typedef struct {
+  event_conn_struct *head, *tail;
+} tlist_struct;
+
+typedef struct {
+  pthread_t thread;
+  int epfd;
+  int evfd;                     /* wakes the worker for new connections */
+  pthread_mutex_t lock;
+  event_conn_struct *pending;   /* handed over, not yet registered */
+  tlist_struct tlists[TLIST_NUM];
+  int *lfds;                    /* own SO_REUSEPORT listeners, one per port */
+  int num_lfds;
+  event_req_struct *spare;      /* request states not in use */
+  int num_spare;
+#ifdef HAVE_IO_URING
+  uring_struct ring;
+  char *bufs;                   /* provided recv buffers */
+  int accepted;                 /* accepted in this wakeup */
+#endif
+} __attribute__((aligned(CACHE_LINE))) event_worker_struct;
+
+extern struct Global *g;
+extern SSL_CTX *sslctx;
+extern const char *tls_pem;
+extern int tls_ports[];
+extern int num_tls_ports;
+extern STACK_OF(X509_INFO) *cachain;
+
+static event_worker_struct *workers = NULL;
+static int num_workers = 0;
+static int next_worker = 0;
+static volatile int draining = 0;
+static int listening = 0;       /* own listeners still accepted on */
+#ifdef HAVE_IO_URING
+static int use_uring = 0;
+
+#define UR_ENTRIES   256                /* submission queue entries */
+#define UR_NBUFS     64                 /* provided recv buffers per worker */
+#define UR_BUF_SIZE  CHAR_BUF_SIZE
+#define UR_BGID      0                  /* provided buffer group */
+
+/* user_data: connection pointer or listener index, tagged in the low bits */
+enum { UD_EPOLL, UD_ACCEPT, UD_RECV, UD_SEND, UD_IGNORE };
+#define UD_TAG(ud)   ((ud) & 7)
+#define UD_PTR(ud)   ((event_conn_struct *)(uintptr_t)((ud) & ~7ULL))
+#define UD_IDX(ud)   ((int)((ud) >> 3))
+
+static struct io_uring_sqe *uring_sqe(event_worker_struct *w);
+static int uring_recv(event_worker_struct *w, event_conn_struct *c);
+static void uring_send(event_worker_struct *w, event_conn_struct *c);
+static void uring_cancel(event_worker_struct *w, event_conn_struct *c);
+#endif
+
+static time_t now_sec(void) {
+  struct timespec ts;
+  get_time(&ts);
+  return ts.tv_sec;
+}
+
+/* the trace of the first request counts from the accept */
+static const struct timespec *trace_base(const event_conn_struct *c) {
+  return (c->num_req) ? &c->start_time : &c->accept_time;
+}
+
+/* attach request state to a connection, preferably a spare one */
+static int req_attach(event_worker_struct *w, event_conn_struct *c) {
+  event_req_struct *r = w->spare;
+
+  if (r) {
+    w->spare = r->next;
+    w->num_spare--;
+  } else if (!(r = malloc(sizeof(event_req_struct)))) {
+    log_msg(LGG_ERR, "Out of memory. Cannot allocate request in event worker");
+    return -1;
+  }
+  memset(r, 0, offsetof(event_req_struct, chunk));
+  r->buf = r->chunk;
+  r->buf_size = sizeof(r->chunk);
+  r->buf[0] = '\0';
+  if (c->ssl)
+    r->pipedata.phase_time[PHASE_HANDSHAKE] = c->run_time;
+  c->run_time = 0.0;
+  if ((r->pipedata.trace_accept = !c->num_req))
+    memcpy(r->pipedata.trace, c->trace, sizeof(c->trace));
+  c->r = r;
+  return 0;
+}
+
+static void req_detach(event_worker_struct *w, event_conn_struct *c) {
+  event_req_struct *r = c->r;
+
+  if (!r)
+    return;
+  c->r = NULL;
+  if (r->buf != r->chunk)
+    free(r->buf);
+  free(r->req.req_url);
+  free(r->feed.buf);
+  response_done(&r->req);
+  if (w->num_spare < EVENT_REQ_SPARE) {
+    r->next = w->spare;
+    w->spare = r;
+    w->num_spare++;
+  } else
+    free(r);
+}
+
+/* add (idle > 0) or remove a connection from the idle figures */
+static void idle_account(event_conn_struct *c, int idle) {
+  int bytes = sizeof(event_conn_struct) + ((c->ssl_mem > 0) ? c->ssl_mem : 0);
+
+  if (c->ssl) {
+    __atomic_add_fetch(&itc, idle, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&itm, idle * bytes, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&ihc, idle, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ihm, idle * bytes, __ATOMIC_RELAXED);
+  }
+}
+
+static void tlist_unlink(event_worker_struct *w, event_conn_struct *c) {
+  tlist_struct *l;
+
+  if (c->tlist == TLIST_NONE)
+    return;
+  l = &w->tlists[c->tlist];
+  if (c->prev) c->prev->next = c->next; else l->head = c->next;
+  if (c->next) c->next->prev = c->prev; else l->tail = c->prev;
+  c->prev = c->next = NULL;
+  c->tlist = TLIST_NONE;
+}
+
+/* (re)arm the deadline of a connection by moving it to the tail of a list */
+static void tlist_arm(event_worker_struct *w, event_conn_struct *c, tlist_enum which) {
+  tlist_struct *l = &w->tlists[which];
+
+  tlist_unlink(w, c);
+  if (which == TLIST_FEED)
+    c->expire = feed_due();
+  else
+    c->expire = now_sec() + ((which == TLIST_IDLE) ? GLOBAL(g, http_keepalive) :
+        (which == TLIST_BODY) ? MAX_HTTP_POST_WAIT : GLOBAL(g, select_timeout));
+  c->tlist = which;
+  c->prev = l->tail;
+  if (l->tail) l->tail->next = c; else l->head = c;
+  l->tail = c;
+}
+
+/* epoll_wait() timeout in msec until the earliest deadline */
+static int next_timeout(event_worker_struct *w) {
+  time_t earliest = 0, now;
+  int i;
+
+  for (i = 0; i < TLIST_NUM; i++)
+    if (w->tlists[i].head && (!earliest || w->tlists[i].head->expire < earliest))
+      earliest = w->tlists[i].head->expire;
+  if (!earliest)
+    return -1;
+  now = now_sec();
+  return (earliest > now) ? (earliest - now) * 1000 : 0;
+}
+
+static void conn_set_events(event_worker_struct *w, event_conn_struct *c, uint32_t events) {
+  struct epoll_event ev = { .events = events, .data.ptr = c };
+
+  if (c->events == events)
+    return;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    log_msg(LGG_DEBUG, "epoll_ctl(MOD) socket:%d reported error: %m", c->fd);
+  c->events = events;
+}
+
+/* non-blocking read. returns > 0 on data, 0 on EOF, -1 with errno set
+   (EAGAIN when no data is available yet) */
+static int conn_recv(event_conn_struct *c, char *dst, int len) {
+  int rv;
+
+  if (!c->ssl)
+    return recv(c->fd, dst, len, 0);
+
+  ERR_clear_error();
+  ssl_mem_track(&c->ssl_mem);
+  rv = SSL_read(c->ssl, dst, len);
+  ssl_mem_track(NULL);
+  if (rv > 0)
+    return rv;
+  switch (SSL_get_error(c->ssl, rv)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      if (rv == 0 || errno == 0)
+        return 0;
+      return -1;
+    default:
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+/* non-blocking write. same return convention as conn_recv() */
+static int conn_send(event_conn_struct *c, const char *msg, int len) {
+  int rv;
+
+  if (!c->ssl)
+    return send(c->fd, msg, len, MSG_NOSIGNAL);
+
+  ERR_clear_error();
+  ssl_mem_track(&c->ssl_mem);
+  rv = SSL_write(c->ssl, msg, len);
+  ssl_mem_track(NULL);
+  if (rv > 0)
+    return rv;
+  switch (SSL_get_error(c->ssl, rv)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_SYSCALL:
+      if (errno)
+        return -1;
+      /* fall through */
+    default:
+      errno = EPIPE;
+      return -1;
+  }
+}
+
+static void conn_release(event_worker_struct *w, event_conn_struct *c) {
+  response_struct pipedata = {0};
+
+  // decrement number of active connections by one
+  if (c->state == CONN_HANDSHAKE) {
+    pipedata.status = ACTION_SSL_FAIL;
+    pipedata.ssl = c->tlsext_cb_arg->status;
+  } else {
+    pipedata.status = ACTION_DEC_KCC;
+    pipedata.krq = c->num_req;
+  }
+  pipedata.tls = (c->ssl != NULL);
+  if (c->state == CONN_IDLE)
+    idle_account(c, -1);
+
+  // signal the socket connection that we're done read-write
+  if (c->ssl) {
+    SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(c->ssl);
+  }
+  if (c->tlsext_cb_arg) {
+    SSL_CTX_free((SSL_CTX*)c->tlsext_cb_arg->sslctx);
+    free(c->tlsext_cb_arg);
+  }
+  /* close() also removes the descriptor from the epoll set */
+  if (shutdown(c->fd, SHUT_RDWR) < 0)
+    log_msg(LGG_DEBUG, "shutdown() socket in event worker reported error: %m");
+  if (close(c->fd) < 0)
+    log_msg(LGG_DEBUG, "close() socket in event worker reported error: %m");
+  stats_report(&pipedata);
+  ratelimit_close(c->client);
+
+  req_detach(w, c);
+  free(c);
+}
+
+static void conn_close(event_worker_struct *w, event_conn_struct *c) {
+  log_msg(LGG_DEBUG, "Exit event loop socket:%d num_req:%d", c->fd, c->num_req);
+  tlist_unlink(w, c);
+#ifdef HAVE_IO_URING
+  /* the ring still refers to the connection; finish once it lets go */
+  if (c->uring && c->inflight) {
+    c->closing = 1;
+    uring_cancel(w, c);
+    return;
+  }
+#endif
+  conn_release(w, c);
+}
+
+/* report a connection which ended before any request was received */
+static void conn_fail(event_worker_struct *w, event_conn_struct *c, response_enum status) {
+  response_struct pipedata = { .status = status, .rx_total = 0 };
+
+  if (c->r) {
+    pipedata.phase_time[PHASE_HANDSHAKE] = c->r->pipedata.phase_time[PHASE_HANDSHAKE];
+    memcpy(pipedata.trace, c->r->pipedata.trace, sizeof(pipedata.trace));
+    pipedata.trace_accept = c->r->pipedata.trace_accept;
+  }
+  if (c->ssl)
+    pipedata.ssl = SSL_HIT_CLS; /* ssl client disconnects without sending any data */
+  stats_report(&pipedata);
+  c->num_req++;
+  conn_close(w, c);
+}
+
+/* wait for the next stats feed event. a feed client has nothing to say, so
+   anything from it, even EOF, ends the feed */
+static void conn_feed_wait(event_worker_struct *w, event_conn_struct *c) {
+  c->state = CONN_FEED;
+#ifdef HAVE_IO_URING
+  if (c->uring) {
+    if (!c->recv_armed && uring_recv(w, c) < 0) {
+      conn_close(w, c);
+      return;
+    }
+  } else
+#endif
+  conn_set_events(w, c, EPOLLIN);
+  tlist_arm(w, c, TLIST_FEED);
+}
+
+/* response sent (or failed); account for it and wait for the next request */
+static void conn_finish(event_worker_struct *w, event_conn_struct *c) {
+  event_req_struct *r = c->r;
+
+  /* feed events are not requests of their own */
+  if (c->feed) {
+    if (c->eof || r->pipedata.status != SEND_FEED)
+      conn_close(w, c);
+    else
+      conn_feed_wait(w, c);
+    return;
+  }
+
+  if (r->pipedata.status != FAIL_GENERAL) {
+    log_request(c->fd, &r->req, (c->ssl != NULL));
+  }
+
+  // store time delta in milliseconds
+  if (c->state == CONN_WRITING) {
+    r->pipedata.phase_time[PHASE_WRITE] = elapsed_time_msec(r->wr_start);
+    trace_mark(r->pipedata.trace, TRACE_WRITTEN, trace_base(c));
+    PROBE2(response_sent, c->fd, (r->wr_off < r->req.rsize) ? -1 : r->wr_off);
+  }
+  r->pipedata.run_time += elapsed_time_msec(c->start_time);
+  stats_report(&r->pipedata);
+  c->num_req++;
+
+  if (c->eof || r->pipedata.status == FAIL_REPLY) {
+    conn_close(w, c);
+    return;
+  }
+
+  /* the stats feed keeps the connection, and its request state */
+  if (r->pipedata.status == SEND_FEED) {
+    c->feed = 1;
+    response_done(&r->req);
+    conn_feed_wait(w, c);
+    return;
+  }
+
+  /* an idle connection keeps no request state */
+  req_detach(w, c);
+  c->state = CONN_IDLE;
+  idle_account(c, 1);
+#ifdef HAVE_IO_URING
+  if (c->uring) {
+    /* normally the recv went out linked to the response */
+    if (!c->recv_armed && uring_recv(w, c) < 0) {
+      conn_close(w, c);
+      return;
+    }
+  } else
+#endif
+  conn_set_events(w, c, EPOLLIN);
+  tlist_arm(w, c, TLIST_IDLE);
+}
+
+static void conn_write(event_worker_struct *w, event_conn_struct *c) {
+  int rv;
+
+#ifdef HAVE_IO_URING
+  if (c->uring) {
+    uring_send(w, c);
+    return;
+  }
+#endif
+
+  while (c->r->wr_off < c->r->req.rsize) {
+    errno = 0;
+    rv = conn_send(c, c->r->req.response + c->r->wr_off, c->r->req.rsize - c->r->wr_off);
+    if (rv > 0) {
+      c->r->wr_off += rv;
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      conn_set_events(w, c, EPOLLOUT);
+      tlist_arm(w, c, TLIST_IO);
+      return;
+    }
+    if (errno == EPIPE || errno == ECONNRESET) {
+      // client closed socket sometime after initial check
+      log_msg(LGG_DEBUG, "attempt to send response for status=%d resulted in send() error: %m", c->r->pipedata.status);
+      c->r->pipedata.status = FAIL_REPLY;
+    } else {
+      // some other error
+      log_msg(LGG_ERR, "attempt to send response for status=%d resulted in send() error: %m", c->r->pipedata.status);
+      c->r->pipedata.status = FAIL_GENERAL;
+    }
+    break;
+  }
+  conn_finish(w, c);
+}
+
+/* send the stats feed event that is due, if not sent yet */
+static void conn_feed_send(event_worker_struct *w, event_conn_struct *c) {
+  event_req_struct *r = c->r;
+  int rv = feed_event(&r->feed, &r->req.feed_seq);
+
+  if (rv < 0) {
+    conn_close(w, c);
+    return;
+  }
+  if (rv == 0) {
+    tlist_arm(w, c, TLIST_FEED);
+    return;
+  }
+  r->req.response = r->feed.buf;
+  r->req.rsize = rv;
+  r->wr_off = 0;
+  c->state = CONN_WRITING;
+  conn_write(w, c);
+}
+
+/* a complete request (or as much as we will wait for) has been received */
+static void conn_request(event_worker_struct *w, event_conn_struct *c) {
+  event_req_struct *r = c->r;
+
+  r->pipedata.status = FAIL_GENERAL;
+  r->pipedata.ssl = (c->ssl) ? SSL_HIT : SSL_NOT_TLS;
+  PROBE2(request_read, c->fd, r->buf_len);
+  TESTPRINT("\nreceived %d bytes\n'%s'\n", r->buf_len, r->buf);
+
+  if (ratelimit_request(c->client) != RATE_OK) {
+    process_refused(&r->req, &r->pipedata);
+    c->eof = 1;
+  } else
+    process_request(&r->req, r->buf, r->buf_len, &r->pipedata, c->fd);
+  trace_mark(r->pipedata.trace, TRACE_PARSED, trace_base(c));
+  PROBE2(response, c->fd, r->pipedata.status);
+
+  if (r->pipedata.status == FAIL_GENERAL) {
+    log_msg(LGG_DEBUG, "Client request processing completed with FAIL_GENERAL status");
+    conn_finish(w, c);
+    return;
+  }
+  c->state = CONN_WRITING;
+  r->wr_off = 0;
+  get_time(&r->wr_start);
+  conn_write(w, c);
+}
+
+/* returns 1 once headers and any POST content have been received */
+static int conn_complete(event_req_struct *r) {
+  if (!r->hdr_len) {
+    if (!(r->hdr_len = http_header_end(r->buf, r->buf_len)))
+      return 0;
+    r->body_want = http_post_length(r->buf);
+    r->body_recv = r->buf_len - r->hdr_len;
+  }
+  return r->body_recv >= r->body_want;
+}
+
+/* make room in r->buf for the next chunk of a request. returns how many
+   bytes to take next or -1 if out of memory. *discard is set for POST
+   content beyond MAX_HTTP_POST_LEN, which is received and dropped again */
+static int conn_room(event_req_struct *r, int *discard) {
+  int limit, want;
+  char *tmp;
+
+  /* headers are capped like read_socket(); POST content beyond
+     MAX_HTTP_POST_LEN is received into a scratch chunk and discarded */
+  *discard = 0;
+  if (!r->hdr_len)
+    limit = CHAR_BUF_SIZE * MAX_CHAR_BUF_LOTS;
+  else
+    limit = r->hdr_len + ((r->body_want < MAX_HTTP_POST_LEN) ? r->body_want : MAX_HTTP_POST_LEN);
+  if (r->buf_len >= limit) {
+    *discard = 1;
+    want = r->body_want - r->body_recv;
+    if (want > CHAR_BUF_SIZE) want = CHAR_BUF_SIZE;
+  } else {
+    want = limit - r->buf_len;
+    if (want > CHAR_BUF_SIZE) want = CHAR_BUF_SIZE;
+  }
+  if (r->buf_len + want + 1 > r->buf_size) {
+    int size = r->buf_len + CHAR_BUF_SIZE + 1;
+    /* the first chunk lives in r itself */
+    tmp = (r->buf == r->chunk) ? malloc(size) : realloc(r->buf, size);
+    if (!tmp) {
+      log_msg(LGG_ERR, "Out of memory. Cannot realloc receiver buffer. Size: %d", size);
+      return -1;
+    }
+    if (r->buf == r->chunk)
+      memcpy(tmp, r->chunk, r->buf_len + 1);
+    r->buf = tmp;
+    r->buf_size = size;
+  }
+  return want;
+}
+
+/* account for len bytes received at r->buf + r->buf_len. returns 1 once the
+   request is complete, or as large as we are willing to take */
+static int conn_got(event_conn_struct *c, int len, int discard) {
+  event_req_struct *r = c->r;
+  int complete, hdr_len = r->hdr_len;
+
+  if (!r->pipedata.rx_total)
+    trace_mark(r->pipedata.trace, TRACE_FIRST_BYTE, trace_base(c));
+  c->total_bytes += len;
+  r->pipedata.rx_total += len;
+  if (r->hdr_len)
+    r->body_recv += len;
+  if (!discard)
+    r->buf_len += len;
+  r->buf[r->buf_len] = '\0';
+  complete = conn_complete(r);
+  if (!hdr_len && r->hdr_len)
+    r->pipedata.phase_time[PHASE_HEADER] = elapsed_time_msec(c->start_time);
+  return complete || (!r->hdr_len && r->buf_len >= CHAR_BUF_SIZE * MAX_CHAR_BUF_LOTS);
+}
+
+/* receiving stopped on EOF (rv == 0) or an error in errno */
+static void conn_read_end(event_worker_struct *w, event_conn_struct *c, int rv) {
+  if (rv == 0 || errno == ECONNRESET) {
+    log_msg(LGG_DEBUG, "recv() ECONNRESET: %m");
+    if (c->r && c->r->buf_len > 0 && rv == 0) {
+      /* client is done sending. answer what we have, then close */
+      c->eof = 1;
+      conn_request(w, c);
+    } else if (c->total_bytes == 0)
+      conn_fail(w, c, FAIL_CLOSED);
+    else
+      conn_close(w, c);
+  } else {
+    log_msg(LGG_DEBUG, "recv() error: %m");
+    if (c->total_bytes == 0)
+      conn_fail(w, c, FAIL_GENERAL);
+    else
+      conn_close(w, c);
+  }
+}
+
+/* once the headers are in, POST content gets a deadline of its own */
+static void conn_arm_body(event_worker_struct *w, event_conn_struct *c) {
+  if (c->r->hdr_len && c->tlist != TLIST_BODY)
+    tlist_arm(w, c, TLIST_BODY);
+}
+
+static void conn_read(event_worker_struct *w, event_conn_struct *c) {
+  int rv, want, discard;
+
+#ifdef HAVE_IO_URING
+  if (c->uring) {
+    if (!c->recv_armed && uring_recv(w, c) < 0)
+      conn_close(w, c);
+    return;
+  }
+#endif
+  for (;;) {
+    if ((want = conn_room(c->r, &discard)) < 0) {
+      conn_close(w, c);
+      return;
+    }
+    errno = 0;
+    rv = conn_recv(c, c->r->buf + c->r->buf_len, want);
+    if (rv > 0) {
+      if (conn_got(c, rv, discard)) {
+        conn_request(w, c);
+        return;
+      }
+      conn_arm_body(w, c);
+      continue;
+    }
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* wait for more, within the deadline armed already */
+      return;
+    }
+    conn_read_end(w, c, rv);
+    return;
+  }
+}
+
+/* a request is about to arrive. returns -1 if out of memory */
+static int conn_wake(event_worker_struct *w, event_conn_struct *c) {
+  if (c->state == CONN_IDLE)
+    idle_account(c, -1);
+  c->state = CONN_READING;
+  get_time(&c->start_time);
+  return (c->r) ? 0 : req_attach(w, c);
+}
+
+static void conn_start_read(event_worker_struct *w, event_conn_struct *c) {
+  if (conn_wake(w, c) < 0) {
+    conn_close(w, c);
+    return;
+  }
+  tlist_arm(w, c, TLIST_IO);
+  conn_read(w, c);
+}
+
+static void conn_handshake(event_worker_struct *w, event_conn_struct *c) {
+  int rv;
+
+  ERR_clear_error();
+  ssl_mem_track(&c->ssl_mem);
+  rv = SSL_accept(c->ssl);
+  ssl_mem_track(NULL);
+  if (rv == 1) {
+    c->run_time += elapsed_time_msec(c->start_time);
+    trace_mark(c->trace, TRACE_HANDSHAKEN, &c->accept_time);
+    PROBE3(handshake, c->fd, 1, c->tlsext_cb_arg->status);
+    ssl_conn_drop_cb_arg(c->ssl, c->tlsext_cb_arg);
+    c->tlsext_cb_arg = NULL;
+    conn_set_events(w, c, EPOLLIN);
+    /* application data may have arrived along with the handshake */
+    conn_start_read(w, c);
+    return;
+  }
+  switch (SSL_get_error(c->ssl, rv)) {
+    case SSL_ERROR_WANT_READ:
+      conn_set_events(w, c, EPOLLIN);
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      conn_set_events(w, c, EPOLLOUT);
+      break;
+    default:
+      log_msg(LGG_DEBUG, "SSL_accept error:%d status:%d", rv, c->tlsext_cb_arg->status);
+      PROBE3(handshake, c->fd, 0, c->tlsext_cb_arg->status);
+      conn_close(w, c);
+  }
+}
+
+static void conn_event(event_worker_struct *w, event_conn_struct *c, uint32_t events) {
+  switch (c->state) {
+    case CONN_HANDSHAKE:
+      conn_handshake(w, c);
+      break;
+    case CONN_IDLE:
+      conn_start_read(w, c);
+      break;
+    case CONN_READING:
+      conn_read(w, c);
+      break;
+    case CONN_WRITING:
+      conn_write(w, c);
+      break;
+    case CONN_FEED:
+      conn_close(w, c);
+      break;
+  }
+}
+
+static void conn_open(event_worker_struct *w, event_conn_struct *c) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+
+  if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+    goto err;
+#ifdef HAVE_IO_URING
+  /* TLS stays on epoll; OpenSSL wants to do its own reads and writes */
+  if (use_uring && !c->ssl) {
+    c->uring = 1;
+    conn_start_read(w, c);
+    return;
+  }
+#endif
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+err:
+    log_msg(LGG_ERR, "Failed to register socket:%d with event worker: %m", c->fd);
+    if (c->state == CONN_HANDSHAKE)
+      conn_close(w, c);
+    else
+      conn_fail(w, c, FAIL_GENERAL);
+    return;
+  }
+  c->events = EPOLLIN;
+  if (c->state == CONN_HANDSHAKE) {
+    /* the whole handshake has to complete within select_timeout */
+    get_time(&c->start_time);
+    trace_mark(c->trace, TRACE_HANDSHAKE, &c->accept_time);
+    tlist_arm(w, c, TLIST_IO);
+    conn_handshake(w, c);
+  } else
+    conn_start_read(w, c);
+}
+
+/* set up a connection from an accepted socket. returns NULL on error */
+static event_conn_struct *conn_new(conn_tlstor_struct *conn_tlstor) {
+  event_conn_struct *c;
+  int rv;
+
+  if (!(c = calloc(1, sizeof(event_conn_struct)))) {
+    log_msg(LGG_ERR, "Failed to allocate connection in event worker");
+    return NULL;
+  }
+  if (conn_tlstor->tls) {
+    ssl_mem_track(&c->ssl_mem);
+    rv = ssl_conn_init(sslctx, conn_tlstor, tls_pem, cachain);
+    ssl_mem_track(NULL);
+    if (rv < 0) {
+      free(c);
+      return NULL;
+    }
+    c->state = CONN_HANDSHAKE;
+  } else
+    c->state = CONN_READING;
+  c->fd = conn_tlstor->new_fd;
+  c->client = conn_tlstor->client;
+  c->ssl = conn_tlstor->ssl;
+  c->tlsext_cb_arg = conn_tlstor->tlsext_cb_arg;
+  c->run_time = conn_tlstor->init_time;
+  c->accept_time = conn_tlstor->accept_time;
+  c->tlist = TLIST_NONE;
+  return c;
+}
+
+/* set up and start serving a freshly accepted socket */
+static void conn_accepted(event_worker_struct *w, int fd, struct timespec init_time) {
+  response_struct pipedata = {0};
+  conn_tlstor_struct conn_tlstor = { .ssl = NULL, .tlsext_cb_arg = NULL };
+  event_conn_struct *c;
+
+  conn_tlstor.new_fd = fd;
+  conn_tlstor.tls = is_ssl_conn(fd, conn_tlstor.server_ip, INET6_ADDRSTRLEN, tls_ports, num_tls_ports);
+  PROBE2(accept, fd, conn_tlstor.tls);
+  pipedata.tls = conn_tlstor.tls;
+  if ((pipedata.rate = ratelimit_conn(fd, &conn_tlstor.client)) != RATE_OK) {
+    pipedata.status = ACTION_RATE;
+    stats_report(&pipedata);
+    admission_refuse(fd, conn_tlstor.tls);
+    return;
+  }
+  if (admission_over_quota(conn_tlstor.tls)) {
+    pipedata.status = ACTION_QUOTA;
+    goto refuse;
+  }
+  if (conn_tlstor.tls && admission_level() == ADM_SHED_TLS) {
+    pipedata.status = ACTION_SHED_TLS;
+    goto refuse;
+  }
+  conn_tlstor.init_time = elapsed_time_msec(init_time);
+  conn_tlstor.accept_time = init_time;
+  if (!(c = conn_new(&conn_tlstor))) {
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    ratelimit_close(conn_tlstor.client);
+    return;
+  }
+
+  pipedata.status = ACTION_INC_KCC;
+  stats_report(&pipedata);
+  conn_open(w, c);
+  return;
+
+refuse:
+  stats_report(&pipedata);
+  admission_refuse(fd, conn_tlstor.tls);
+  ratelimit_close(conn_tlstor.client);
+}
+
+/* accept a connection on one of the worker's own listeners.
+   returns -1 once nothing more is pending, 0 otherwise */
+static int conn_accept(event_worker_struct *w, int lfd) {
+  struct timespec init_time = {0, 0};
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  int fd;
+
+  get_time(&init_time);
+  if ((fd = accept4(lfd, (struct sockaddr *)&sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      log_msg(LGG_DEBUG, "accept: %m");
+    return -1;
+  }
+  hitters_count_addr((struct sockaddr *)&sa);
+  conn_accepted(w, fd, init_time);
+  return 0;
+}
+
+/* drain a ready listener, up to a per-wakeup budget */
+static void conn_accept_batch(event_worker_struct *w, int lfd) {
+  response_struct pipedata = {0};
+  int n;
+
+  for (n = 0; n < ACCEPT_BUDGET; n++)
+    if (conn_accept(w, lfd) < 0)
+      break;
+  if (n) {
+    pipedata.status = ACTION_ACC_BATCH;
+    pipedata.krq = n;
+    stats_report(&pipedata);
+  }
+}
+
+static void expire_conns(event_worker_struct *w) {
+  response_struct pipedata = {0};
+  time_t now = now_sec();
+  event_conn_struct *c;
+  int n;
+
+  while ((c = w->tlists[TLIST_IDLE].head) && (c->expire <= now || draining))
+    conn_close(w, c);
+
+  /* under load, the longest idle connections go first */
+  if (w->tlists[TLIST_IDLE].head && admission_level() >= ADM_SHED_IDLE) {
+    for (n = 0; n < SHED_IDLE_BATCH && (c = w->tlists[TLIST_IDLE].head); n++)
+      conn_close(w, c);
+    pipedata.status = ACTION_SHED_IDLE;
+    pipedata.krq = n;
+    stats_report(&pipedata);
+  }
+
+  /* feeds end with the instance, unlike requests */
+  while ((c = w->tlists[TLIST_FEED].head) && (c->expire <= now || draining)) {
+    tlist_unlink(w, c);
+    if (draining)
+      conn_close(w, c);
+    else
+      conn_feed_send(w, c);
+  }
+
+  while ((c = w->tlists[TLIST_BODY].head) && c->expire <= now) {
+    log_msg(LGG_DEBUG, "POST content not complete in time socket:%d", c->fd);
+    stats_deadline(DEADLINE_BODY);
+    conn_close(w, c);
+  }
+
+  while ((c = w->tlists[TLIST_IO].head) && c->expire <= now) {
+    tlist_unlink(w, c);
+    if (c->state == CONN_HANDSHAKE) {
+      stats_deadline(DEADLINE_HANDSHAKE);
+      conn_close(w, c);
+    } else if (c->state == CONN_READING && c->r && c->r->buf_len > 0) {
+      log_msg(LGG_DEBUG, "request headers not complete in time socket:%d", c->fd);
+      stats_deadline(DEADLINE_HEADER);
+      conn_close(w, c);
+    } else if (c->state == CONN_READING && c->num_req == 0) {
+      log_msg(LGG_DEBUG, "recv() timeout socket:%d", c->fd);
+      conn_fail(w, c, FAIL_TIMEOUT);
+    } else
+      conn_close(w, c);
+  }
+}
+
+/* stop accepting on own listeners; the new instance has them too */
+static void drop_listeners(event_worker_struct *w) {
+  int i;
+
+  for (i = 0; i < w->num_lfds; i++) {
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+      /* by user_data, the descriptor is gone by the time it is submitted */
+      struct io_uring_sqe *sqe = uring_sqe(w);
+      if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ((__u64)i << 3) | UD_ACCEPT;
+        sqe->user_data = UD_IGNORE;
+      }
+    } else
+#endif
+    {
+      epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->lfds[i], NULL);
+      __atomic_sub_fetch(&listening, 1, __ATOMIC_RELEASE);
+    }
+    close(w->lfds[i]);
+  }
+  w->num_lfds = 0;
+}
+
+static void take_pending(event_worker_struct *w) {
+  event_conn_struct *c, *next;
+  uint64_t cnt;
+
+  if (read(w->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+    log_msg(LGG_DEBUG, "eventfd read() reported error: %m");
+
+  pthread_mutex_lock(&w->lock);
+  c = w->pending;
+  w->pending = NULL;
+  pthread_mutex_unlock(&w->lock);
+
+  for (; c; c = next) {
+    next = c->next;
+    c->next = NULL;
+    conn_open(w, c);
+  }
+}
+
+/* wait up to timeout msec for epoll events and handle them */
+static void epoll_run(event_worker_struct *w, int timeout) {
+  struct epoll_event events[EVENT_MAX_EVENTS];
+  int i, n;
+
+  n = epoll_wait(w->epfd, events, EVENT_MAX_EVENTS, timeout);
+  if (n < 0) {
+    if (errno != EINTR)
+      log_msg(LGG_ERR, "epoll_wait() error: %m");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    int *lfd = (int *)events[i].data.ptr;
+
+    if (lfd == NULL)
+      take_pending(w);
+    else if (lfd >= w->lfds && lfd < w->lfds + w->num_lfds)
+      conn_accept_batch(w, *lfd);
+    else
+      conn_event(w, (event_conn_struct *)events[i].data.ptr, events[i].events);
+  }
+}
+
+static void *event_worker(void *arg) {
+  event_worker_struct *w = (event_worker_struct *)arg;
+
+  affinity_apply(CPU_SERVE, w - workers);
+  for (;;) {
+    if (draining && w->num_lfds)
+      drop_listeners(w);
+    epoll_run(w, next_timeout(w));
+    expire_conns(w);
+  }
+  return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+static struct io_uring_sqe *uring_sqe(event_worker_struct *w) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+
+  if (!sqe)
+    log_msg(LGG_ERR, "io_uring submission queue full");
+  return sqe;
+}
+
+/* hand nr buffers starting at bid (back) to the kernel */
+static void uring_provide(event_worker_struct *w, int bid, int nr) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = nr;
+  sqe->addr = (uintptr_t)(w->bufs + bid * UR_BUF_SIZE);
+  sqe->len = UR_BUF_SIZE;
+  sqe->off = bid;
+  sqe->buf_group = UR_BGID;
+  sqe->user_data = UD_IGNORE;
+}
+
+static void uring_poll_epoll(event_worker_struct *w) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = w->epfd;
+  sqe->poll32_events = EPOLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = UD_EPOLL;
+}
+
+static void uring_accept(event_worker_struct *w, int idx) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->lfds[idx];
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = ((__u64)idx << 3) | UD_ACCEPT;
+}
+
+static int uring_recv(event_worker_struct *w, event_conn_struct *c) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->len = UR_BUF_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UR_BGID;
+  sqe->user_data = (uintptr_t)c | UD_RECV;
+  c->inflight++;
+  c->recv_armed = 1;
+  return 0;
+}
+
+/* send the response, with the recv for the next request linked to it */
+static void uring_send(event_worker_struct *w, event_conn_struct *c) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe) {
+    conn_close(w, c);
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t)(c->r->req.response + c->r->wr_off);
+  sqe->len = c->r->req.rsize - c->r->wr_off;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = (uintptr_t)c | UD_SEND;
+  c->inflight++;
+  if (!c->eof && !c->recv_armed) {
+    sqe->flags = IOSQE_IO_LINK;
+    uring_recv(w, c); /* without room the link is simply dropped */
+  }
+  tlist_arm(w, c, TLIST_IO);
+}
+
+static void uring_cancel(event_worker_struct *w, event_conn_struct *c) {
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (!sqe) {
+    /* pending recv completes once the socket is shut down */
+    shutdown(c->fd, SHUT_RDWR);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = c->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = UD_IGNORE;
+}
+
+/* copy received data into the request buffer. returns 1 once the request
+   is complete, 0 if more is needed, -1 if out of memory */
+static int uring_feed(event_conn_struct *c, const char *data, int len) {
+  int want, discard;
+
+  while (len > 0) {
+    if ((want = conn_room(c->r, &discard)) < 0)
+      return -1;
+    if (want > len)
+      want = len;
+    memcpy(c->r->buf + c->r->buf_len, data, want);
+    if (conn_got(c, want, discard))
+      return 1;
+    data += want;
+    len -= want;
+  }
+  return 0;
+}
+
+static void uring_recv_done(event_worker_struct *w, event_conn_struct *c, struct io_uring_cqe *cqe) {
+  int bid = -1, rv;
+
+  c->inflight--;
+  c->recv_armed = 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  if (c->closing) {
+    if (bid >= 0)
+      uring_provide(w, bid, 1);
+    if (!c->inflight)
+      conn_release(w, c);
+    return;
+  }
+  if (cqe->res == -ENOBUFS) {
+    /* every buffer in use; they come back as soon as completions are seen */
+    if (uring_recv(w, c) < 0)
+      conn_close(w, c);
+    return;
+  }
+  if (cqe->res == -ECANCELED && c->state == CONN_WRITING)
+    return; /* linked to a send that failed; conn_finish() handles it */
+  if (c->feed) {
+    if (bid >= 0)
+      uring_provide(w, bid, 1);
+    conn_close(w, c);
+    return;
+  }
+  if (cqe->res <= 0) {
+    errno = -cqe->res;
+    conn_read_end(w, c, cqe->res);
+    return;
+  }
+
+  if (c->state == CONN_IDLE) {
+    if (conn_wake(w, c) < 0) {
+      uring_provide(w, bid, 1);
+      conn_close(w, c);
+      return;
+    }
+    tlist_arm(w, c, TLIST_IO);
+  }
+  rv = uring_feed(c, w->bufs + bid * UR_BUF_SIZE, cqe->res);
+  uring_provide(w, bid, 1);
+  if (rv < 0)
+    conn_close(w, c);
+  else if (rv > 0)
+    conn_request(w, c);
+  else {
+    conn_arm_body(w, c);
+    if (uring_recv(w, c) < 0)
+      conn_close(w, c);
+  }
+}
+
+static void uring_send_done(event_worker_struct *w, event_conn_struct *c, struct io_uring_cqe *cqe) {
+  c->inflight--;
+  if (c->closing) {
+    if (!c->inflight)
+      conn_release(w, c);
+    return;
+  }
+  if (cqe->res >= 0)
+    c->r->wr_off += cqe->res;
+  if (c->r->wr_off < c->r->req.rsize) {
+    /* MSG_WAITALL only comes back short on error */
+    errno = (cqe->res < 0) ? -cqe->res : EPIPE;
+    if (errno == EPIPE || errno == ECONNRESET) {
+      log_msg(LGG_DEBUG, "attempt to send response for status=%d resulted in send() error: %m", c->r->pipedata.status);
+      c->r->pipedata.status = FAIL_REPLY;
+    } else {
+      log_msg(LGG_ERR, "attempt to send response for status=%d resulted in send() error: %m", c->r->pipedata.status);
+      c->r->pipedata.status = FAIL_GENERAL;
+    }
+    c->eof = 1;
+  }
+  conn_finish(w, c);
+}
+
+static void *uring_worker(void *arg) {
+  event_worker_struct *w = (event_worker_struct *)arg;
+  struct io_uring_cqe *cqe, e;
+  response_struct pipedata = {0};
+  struct timespec now;
+  int i;
+
+  affinity_apply(CPU_SERVE, w - workers);
+  uring_provide(w, 0, UR_NBUFS);
+  uring_poll_epoll(w);
+  for (i = 0; i < w->num_lfds; i++)
+    uring_accept(w, i);
+
+  for (;;) {
+    if (draining && w->num_lfds)
+      drop_listeners(w);
+    if (uring_submit_and_wait(&w->ring, next_timeout(w)) < 0
+        && errno != ETIME && errno != EINTR && errno != EBUSY)
+      log_msg(LGG_ERR, "io_uring_enter() error: %m");
+
+    get_time(&now);
+    while ((cqe = uring_peek_cqe(&w->ring))) {
+      e = *cqe;
+      uring_cqe_seen(&w->ring);
+      switch (UD_TAG(e.user_data)) {
+        case UD_EPOLL:
+          epoll_run(w, 0);
+          if (!(e.flags & IORING_CQE_F_MORE))
+            uring_poll_epoll(w);
+          break;
+        case UD_ACCEPT:
+          if (e.res >= 0) {
+            struct sockaddr_storage sa;
+            socklen_t len = sizeof(sa);
+            // multishot accepts come without the client's address
+            if (getpeername(e.res, (struct sockaddr *)&sa, &len) == 0)
+              hitters_count_addr((struct sockaddr *)&sa);
+            w->accepted++;
+            conn_accepted(w, e.res, now);
+          } else if (e.res != -EAGAIN)
+            log_msg(LGG_DEBUG, "accept: %s", strerror(-e.res));
+          if (e.flags & IORING_CQE_F_MORE)
+            break;
+          if (UD_IDX(e.user_data) < w->num_lfds)
+            uring_accept(w, UD_IDX(e.user_data));
+          else  /* cancelled by drop_listeners() */
+            __atomic_sub_fetch(&listening, 1, __ATOMIC_RELEASE);
+          break;
+        case UD_RECV:
+          uring_recv_done(w, UD_PTR(e.user_data), &e);
+          break;
+        case UD_SEND:
+          uring_send_done(w, UD_PTR(e.user_data), &e);
+          break;
+        default:
+          break;
+      }
+    }
+    if (w->accepted) {
+      pipedata.status = ACTION_ACC_BATCH;
+      pipedata.krq = w->accepted;
+      stats_report(&pipedata);
+      w->accepted = 0;
+    }
+    expire_conns(w);
+  }
+  return NULL;
+}
+
+/* set up rings for all workers, or none if any of them fails */
+static int uring_setup(int num) {
+  int i;
+
+  if (!uring_supported()) {
+    log_msg(LGG_WARNING, "io_uring not supported by kernel, using epoll");
+    return -1;
+  }
+  for (i = 0; i < num; i++) {
+    if (uring_init(&workers[i].ring, UR_ENTRIES) < 0
+        || !(workers[i].bufs = malloc(UR_NBUFS * UR_BUF_SIZE))) {
+      log_msg(LGG_WARNING, "io_uring setup failed, using epoll: %m");
+      while (i >= 0) {
+        if (workers[i].ring.fd > 0)
+          uring_exit(&workers[i].ring);
+        free(workers[i].bufs);
+        workers[i].bufs = NULL;
+        i--;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+#endif // HAVE_IO_URING
+
+int reuseport_steer_cpu(int fd, int num) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  /* A = cpu % num; the kernel falls back to hashing if A is out of range */
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, num },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+int event_init(int num, int *shard_fds, int num_ports, int uring) {
+  int i, j;
+  void *(*worker)(void *) = event_worker;
+
+  if (num < 1 || num > MAX_EVENT_WORKERS)
+    return -1;
+  /* no two workers share a cache line */
+  if (posix_memalign((void **)&workers, CACHE_LINE, num * sizeof(event_worker_struct)))
+    return -1;
+  memset(workers, 0, num * sizeof(event_worker_struct));
+#ifdef HAVE_IO_URING
+  if (uring && uring_setup(num) == 0) {
+    use_uring = 1;
+    worker = uring_worker;
+  }
+#else
+  if (uring)
+    log_msg(LGG_WARNING, "io_uring support not compiled in, using epoll");
+#endif
+
+  for (i = 0; i < num; i++) {
+    event_worker_struct *w = &workers[i];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    pthread_attr_t attr;
+
+    pthread_mutex_init(&w->lock, NULL);
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+        || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0) {
+      log_msg(LGG_ERR, "Failed to set up event worker %d: %m", i);
+      return -1;
+    }
+    if (shard_fds) {
+      w->lfds = &shard_fds[i * num_ports];
+      w->num_lfds = num_ports;
+      listening += num_ports;
+      for (j = 0; j < num_ports && worker == event_worker; j++) {
+        ev.data.ptr = &w->lfds[j];
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lfds[j], &ev) < 0) {
+          log_msg(LGG_ERR, "Failed to add listener to event worker %d: %m", i);
+          return -1;
+        }
+      }
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&w->thread, &attr, worker, (void*)w)) {
+      log_msg(LGG_ERR, "Failed to create event worker %d", i);
+      return -1;
+    }
+    num_workers++;
+  }
+  log_msg(LGG_NOTICE, "Started %d %s event workers%s", num_workers,
+      (worker == event_worker) ? "epoll" : "io_uring",
+      (shard_fds) ? " on SO_REUSEPORT listeners" : "");
+  return 0;
+}
+
+/* hash of the certificate name serving sni: names under the same parent
+   domain share a wildcard certificate, see tls_servername_cb() */
+static unsigned int sni_hash(const char *sni) {
+  const char *dot = strchr(sni, '.');
+  unsigned int h = 5381;
+
+  if (dot && strchr(dot + 1, '.') && !isdigit((unsigned char)sni[strlen(sni) - 1]))
+    sni = dot;
+  while (*sni)
+    h = h * 33 + (unsigned char)tolower(*sni++);
+  return h;
+}
+
+int event_listening(void) {
+  return __atomic_load_n(&listening, __ATOMIC_ACQUIRE);
+}
+
+void event_drain(void) {
+  uint64_t one = 1;
+  int i;
+
+  draining = 1;
+  for (i = 0; i < num_workers; i++)
+    if (write(workers[i].evfd, &one, sizeof(one)) < 0)
+      log_msg(LGG_DEBUG, "eventfd write() reported error: %m");
+}
+
+int event_dispatch(conn_tlstor_struct *conn_tlstor, const char *sni) {
+  event_worker_struct *w;
+  event_conn_struct *c;
+  uint64_t one = 1;
+
+  if (!num_workers || !(c = conn_new(conn_tlstor)))
+    return -1;
+  free(conn_tlstor);
+
+  if (sni)
+    w = &workers[sni_hash(sni) % num_workers];
+  else {
+    w = &workers[next_worker];
+    next_worker = (next_worker + 1) % num_workers;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  c->next = w->pending;
+  w->pending = c;
+  pthread_mutex_unlock(&w->lock);
+  if (write(w->evfd, &one, sizeof(one)) < 0)
+    log_msg(LGG_DEBUG, "eventfd write() reported error: %m");
+  return 0;
+}
+
+#endif // USE_PTHREAD
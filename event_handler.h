@@ -0,0 +1,34 @@
+#ifndef EVENT_HANDLER_H
+#define EVENT_HANDLER_H
+
+#include "certs.h"
+
+#define MAX_EVENT_WORKERS   64       /* max number of epoll worker threads */
+#define EVENT_MAX_EVENTS    128      /* events fetched per epoll_wait() */
+#define DEFAULT_CONN_MAX    20480    /* connections in event mode before TLS is refused */
+#define EVENT_REQ_SPARE     64       /* spare request states kept per worker */
+
+// start num_workers epoll worker threads. returns 0 on success.
+// shard_fds, if not NULL, holds num_ports SO_REUSEPORT listeners per worker,
+// worker i owning shard_fds[i * num_ports] onwards and accepting on its own.
+// with uring set workers use io_uring if the kernel supports it
+int event_init(int num_workers, int *shard_fds, int num_ports, int uring);
+
+// attach a classic BPF program to a SO_REUSEPORT group selecting the
+// listener by the CPU the connection arrived on. returns setsockopt() result
+int reuseport_steer_cpu(int fd, int num_workers);
+
+// hand over an accepted connection to a worker, which also does the TLS
+// handshake if conn_tlstor->tls is set. connections with the same sni
+// certificate go to the same worker, others round robin. conn_tlstor is
+// freed on success. returns 0 on success, -1 if no worker is available
+int event_dispatch(conn_tlstor_struct *conn_tlstor, const char *sni);
+
+// stop accepting on SO_REUSEPORT listeners and close keep-alive connections
+// once idle, as the instance is about to go away
+void event_drain(void);
+
+// how many SO_REUSEPORT listeners workers may still accept on
+int event_listening(void);
+
+#endif // EVENT_HANDLER_H
@@ -0,0 +1,150 @@
+#include "util.h" // _GNU_SOURCE
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "feed.h"
+
+/*
+ * Stats feed: server-sent events pushed to clients that keep a connection
+ * open, instead of polling the stats pages. Every interval one event is
+ * taken, by whichever subscriber finds it due, and carries only the values
+ * that changed, each with its change since the event before. All
+ * subscribers send the very same event, so the cost of taking it does not
+ * grow with their number. A new subscriber starts with a snapshot of all
+ * values; so does one which fell behind and missed an event, since it
+ * cannot add up the changes any more:
+ *
+ *   id: 41
+ *   event: snapshot
+ *   data: {"uts":1234,"secs":1,"kcc":3,"req":1500,...}
+ *
+ *   id: 42
+ *   event: delta
+ *   data: {"uts":1235,"msec":1000,"req":[1512,12],"gif":[310,10]}
+ *
+ * 'uts' is the process uptime, 'msec' the time since the event before, so
+ * a rate is the change over it. Names are those of the stats pages.
+ */
+
+static struct {
+#ifdef USE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+  int secs;
+  unsigned int seq;             /* of the last event; 0 before the first */
+  time_t due;                   /* second the next event is due */
+  struct timespec taken;        /* when the last one was */
+  int num;
+  const char *names[FEED_VALUES];
+  int values[FEED_VALUES];      /* as of the last event */
+  strbuf_struct ev;             /* the last event */
+} feed = {
+#ifdef USE_PTHREAD
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+  .secs = DEFAULT_FEED_SECS
+};
+
+static struct timespec startup;
+
+void feed_init(int secs) {
+  feed.secs = secs;
+  get_time(&startup);
+}
+
+static long uptime(const struct timespec *now) {
+  return now->tv_sec - startup.tv_sec;
+}
+
+/* take the next event. lock held */
+static int feed_take(const struct timespec *now) {
+  int values[FEED_VALUES];
+  int i, num, rv;
+
+  num = get_feed(feed.names, values);
+  feed.ev.len = 0;
+  rv = strbuf_printf(&feed.ev, "id: %u\nevent: delta\ndata: {\"uts\":%ld,\"msec\":%.0f",
+      feed.seq + 1, uptime(now), elapsed_time_msec(feed.taken));
+  for (i = 0; i < num; i++) {
+    if (i < feed.num && values[i] == feed.values[i])
+      continue;
+    rv |= strbuf_printf(&feed.ev, ",\"%s\":[%d,%d]", feed.names[i], values[i],
+        values[i] - ((i < feed.num) ? feed.values[i] : 0));
+  }
+  rv |= strbuf_printf(&feed.ev, "}\n\n");
+  if (rv < 0)
+    return -1;
+  memcpy(feed.values, values, num * sizeof(int));
+  feed.num = num;
+  feed.seq++;
+  feed.taken = *now;
+  feed.due = now->tv_sec + feed.secs;
+  return 0;
+}
+
+/* all values as of the last event, appended to sb. lock held */
+static int feed_snapshot(strbuf_struct *sb) {
+  int i, rv;
+
+  rv = strbuf_printf(sb, "id: %u\nevent: snapshot\ndata: {\"uts\":%ld,\"secs\":%d",
+      feed.seq, uptime(&feed.taken), feed.secs);
+  for (i = 0; i < feed.num; i++)
+    rv |= strbuf_printf(sb, ",\"%s\":%d", feed.names[i], feed.values[i]);
+  return rv | strbuf_printf(sb, "}\n\n");
+}
+
+/* the events as far as due. lock held */
+static int feed_update(void) {
+  struct timespec now;
+
+  get_time(&now);
+  if (feed.seq && now.tv_sec < feed.due)
+    return 0;
+  return feed_take(&now);
+}
+
+int feed_open(strbuf_struct *sb, unsigned int *seq) {
+  int rv;
+
+#ifdef USE_PTHREAD
+  pthread_mutex_lock(&feed.lock);
+#endif
+  rv = feed_update();
+  if (rv == 0) {
+    /* reconnecting after 'retry' msec is left to the client */
+    rv = strbuf_printf(sb, "retry: %d\n\n", feed.secs * 1000);
+    rv |= feed_snapshot(sb);
+    *seq = feed.seq;
+  }
+#ifdef USE_PTHREAD
+  pthread_mutex_unlock(&feed.lock);
+#endif
+  return rv;
+}
+
+int feed_event(strbuf_struct *sb, unsigned int *seq) {
+  int rv;
+
+  sb->len = 0;
+#ifdef USE_PTHREAD
+  pthread_mutex_lock(&feed.lock);
+#endif
+  rv = feed_update();
+  if (rv == 0 && *seq != feed.seq) {
+    if (*seq + 1 == feed.seq)
+      rv = strbuf_printf(sb, "%s", feed.ev.buf);
+    else
+      rv = feed_snapshot(sb);
+    *seq = feed.seq;
+  }
+#ifdef USE_PTHREAD
+  pthread_mutex_unlock(&feed.lock);
+#endif
+  return (rv < 0) ? -1 : sb->len;
+}
+
+time_t feed_due(void) {
+  return __atomic_load_n(&feed.due, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,26 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <time.h>
+
+#include "util.h"
+
+#define DEFAULT_FEED_SECS   1        /* between events of the stats feed */
+
+// seconds between events. must be called before any worker is started
+void feed_init(int secs);
+
+// the response opening a stats feed: headers and a snapshot of every value,
+// appended to sb. *seq is set for feed_event(). returns -1 if out of memory
+int feed_open(strbuf_struct *sb, unsigned int *seq);
+
+// the event which follows *seq into sb (emptied first), taking a new one
+// first if due: normally the changes since, or a fresh snapshot for a
+// subscriber which missed events. returns its length, 0 if there is none
+// yet, -1 if out of memory. safe from any thread
+int feed_event(strbuf_struct *sb, unsigned int *seq);
+
+// second (as get_time()) the next event is due
+time_t feed_due(void);
+
+#endif // FEED_H
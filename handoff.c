@@ -0,0 +1,177 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "logger.h"
+
+/*
+ * Listening sockets are passed on for binary upgrades. An instance started
+ * with a control socket path listens on it once it serves. Another one
+ * started with the same path connects to it first, receives the listening
+ * sockets and takes those bound to its own addresses instead of binding
+ * new ones. When it serves in turn it says so, and the old instance stops
+ * accepting and drains its connections. The sockets stay open throughout,
+ * so connections queue in their backlog rather than being refused. Should
+ * the new instance go away before it is ready, the old one carries on.
+ */
+
+#define HANDOFF_CHUNK  32       /* descriptors per message */
+#define MSG_FDS        'F'
+#define MSG_END        'E'
+#define MSG_READY      'R'
+
+static int ctl_conn = -1;       /* new instance: connection to the old one */
+static int *recv_fds = NULL;
+static int num_recv_fds = 0;
+
+static int ctl_addr(const char *path, struct sockaddr_un *sun) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sun->sun_path)) {
+    log_msg(LGG_ERR, "control socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(sun->sun_path, path);
+  return 0;
+}
+
+/* send a message of type with up to HANDOFF_CHUNK descriptors */
+static int send_fds(int conn, char type, const int *fds, int n) {
+  char cbuf[CMSG_SPACE(HANDOFF_CHUNK * sizeof(int))];
+  struct iovec iov = { &type, 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  struct cmsghdr *cmsg;
+
+  if (n) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+  }
+  return (sendmsg(conn, &msg, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+int handoff_receive(const char *path) {
+  char cbuf[CMSG_SPACE(HANDOFF_CHUNK * sizeof(int))];
+  struct sockaddr_un sun;
+  struct cmsghdr *cmsg;
+  char type = 0;
+  int n, *p;
+
+  if (ctl_addr(path, &sun) < 0
+      || (ctl_conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    return 0;
+  if (connect(ctl_conn, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+    // nothing to take over
+    close(ctl_conn);
+    ctl_conn = -1;
+    return 0;
+  }
+
+  while (type != MSG_END) {
+    struct iovec iov = { &type, 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+
+    if (recvmsg(ctl_conn, &msg, MSG_CMSG_CLOEXEC) != 1) {
+      log_msg(LGG_ERR, "Failed to receive listeners from %s: %m", path);
+      break;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (!(p = realloc(recv_fds, (num_recv_fds + n) * sizeof(int))))
+        break;
+      recv_fds = p;
+      memcpy(recv_fds + num_recv_fds, CMSG_DATA(cmsg), n * sizeof(int));
+      num_recv_fds += n;
+    }
+  }
+  log_msg(LGG_NOTICE, "Taking over %d listeners from %s", num_recv_fds, path);
+  return num_recv_fds;
+}
+
+int handoff_take(const struct sockaddr *addr, socklen_t len) {
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  int i, fd;
+
+  for (i = 0; i < num_recv_fds; i++) {
+    if (recv_fds[i] < 0)
+      continue;
+    sslen = sizeof(ss);
+    if (getsockname(recv_fds[i], (struct sockaddr *)&ss, &sslen) == 0
+        && sslen == len && !memcmp(&ss, addr, len)) {
+      fd = recv_fds[i];
+      recv_fds[i] = -1;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+int handoff_ready(const char *path) {
+  struct sockaddr_un sun;
+  char type = MSG_READY;
+  int i, fd;
+
+  for (i = 0; i < num_recv_fds; i++)
+    if (recv_fds[i] >= 0)
+      close(recv_fds[i]);
+  free(recv_fds);
+  recv_fds = NULL;
+  num_recv_fds = 0;
+  if (ctl_conn >= 0) {
+    if (send(ctl_conn, &type, 1, MSG_NOSIGNAL) != 1)
+      log_msg(LGG_WARNING, "Failed to tell old instance to drain: %m");
+    close(ctl_conn);
+    ctl_conn = -1;
+  }
+
+  if (ctl_addr(path, &sun) < 0
+      || (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 1) < 0) {
+    log_msg(LGG_ERR, "Failed to listen on control socket %s: %m", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int handoff_accept(int ctl_fd, const int *fds, int num_fds) {
+  int conn, i, n;
+
+  if ((conn = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    return -1;
+  for (i = 0; i < num_fds; i += n) {
+    n = (num_fds - i < HANDOFF_CHUNK) ? num_fds - i : HANDOFF_CHUNK;
+    if (send_fds(conn, MSG_FDS, fds + i, n) < 0)
+      break;
+  }
+  if (i < num_fds || send_fds(conn, MSG_END, NULL, 0) < 0) {
+    log_msg(LGG_ERR, "Failed to pass on listeners: %m");
+    close(conn);
+    return -1;
+  }
+  log_msg(LGG_NOTICE, "Passed on %d listeners, waiting for new instance", num_fds);
+  return conn;
+}
+
+int handoff_check(int conn) {
+  char type;
+  int rv = recv(conn, &type, 1, MSG_DONTWAIT);
+
+  if (rv == 1 && type == MSG_READY)
+    return 1;
+  if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return -1;
+  return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/socket.h>
+
+#define DRAIN_MAX_SECS      30       /* an upgraded instance exits after at most */
+
+// connect to the instance listening on the control socket path, if any, and
+// receive its listening sockets. returns how many, 0 if there is none
+int handoff_receive(const char *path);
+
+// one of the received listeners bound to addr, to use instead of a new
+// socket. each is given out once. returns -1 if none matches
+int handoff_take(const struct sockaddr *addr, socklen_t len);
+
+// close received listeners not taken, tell the old instance to drain and
+// listen on path for the next upgrade. returns the control socket or -1
+int handoff_ready(const char *path);
+
+// a new instance connected to ctl_fd: send it the num_fds listeners in fds.
+// returns the connection to wait on with handoff_check(), or -1
+int handoff_accept(int ctl_fd, const int *fds, int num_fds);
+
+// whether the new instance on conn took over: 1 if so, 0 if it went away
+// without, -1 if it has not said yet
+int handoff_check(int conn);
+
+#endif // HANDOFF_H
@@ -0,0 +1,205 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "hitters.h"
+#include "stats.h"
+
+/*
+ * Heavy hitters: the server names, Host headers and clients seen most,
+ * in fixed memory. Each thread keeps a Space-Saving summary per kind in its
+ * stats block: a name already there is counted up, a new one takes over
+ * the slot counted least and starts from its count, which is then the most
+ * it can be over. Nothing is shared while counting. The summaries of all
+ * threads are merged when read; a name missing from a full summary may
+ * have been counted there up to its least count, which goes into the error
+ * bound as well.
+ */
+
+typedef struct {
+  hit_slot_struct slot;
+  unsigned int min;             /* least count of its summary if full, else 0 */
+} hit_entry_struct;
+
+static const char *kind_names[HIT_KINDS] = { "sni", "hst", "cli" };
+static const char *kind_texts[HIT_KINDS] = {
+  "TLS handshakes for this server name", "requests with this Host header",
+  "connections from this client"
+};
+
+#ifdef USE_PTHREAD
+static uint32_t key_hash(const unsigned char *key, int len) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+#endif
+
+void hitters_count(hit_enum kind, const void *key, int len) {
+#ifdef USE_PTHREAD
+  hitters_struct *h = &stats_local()->hit;
+  hit_slot_struct *s = h->slots[kind], *min = NULL;
+  unsigned int n = h->used[kind];
+  uint32_t hash;
+  int i;
+
+  if (len > HITTERS_KEY)
+    len = HITTERS_KEY;
+  if (len <= 0)
+    return;
+  hash = key_hash(key, len);
+  for (i = 0; i < n; i++) {
+    if (s[i].hash == hash && s[i].len == len && !memcmp(s[i].key, key, len)) {
+      s[i].count++;
+      return;
+    }
+    if (!min || s[i].count < min->count)
+      min = &s[i];
+  }
+  if (n < HITTERS_SLOTS) {
+    min = &s[n];
+    min->count = 0;
+    h->used[kind] = n + 1;
+  }
+  min->err = min->count;
+  min->count++;
+  min->hash = hash;
+  min->len = len;
+  memcpy(min->key, key, len);
+#endif
+}
+
+void hitters_count_addr(const struct sockaddr *sa) {
+  unsigned char addr[16];
+
+  // the same key for IPv4 clients of IPv6 listeners
+  if (sa->sa_family == AF_INET6)
+    memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+  else if (sa->sa_family == AF_INET) {
+    memset(addr, 0, 10);
+    addr[10] = addr[11] = 0xff;
+    memcpy(addr + 12, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+  } else
+    return;
+  hitters_count(HIT_CLIENT, addr, 16);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+  const hit_slot_struct *x = &((const hit_entry_struct *)a)->slot;
+  const hit_slot_struct *y = &((const hit_entry_struct *)b)->slot;
+
+  if (x->hash != y->hash)
+    return (x->hash < y->hash) ? -1 : 1;
+  if (x->len != y->len)
+    return x->len - y->len;
+  return memcmp(x->key, y->key, x->len);
+}
+
+/* key as shown: an address, or a name with anything odd replaced, since
+   Host headers and server names are whatever clients send */
+static void key_text(hit_enum kind, const hit_slot_struct *s, char *text) {
+  static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+  int i;
+
+  if (kind == HIT_CLIENT) {
+    if (!memcmp(s->key, v4mapped, 12))
+      inet_ntop(AF_INET, s->key + 12, text, INET6_ADDRSTRLEN);
+    else
+      inet_ntop(AF_INET6, s->key, text, INET6_ADDRSTRLEN);
+    return;
+  }
+  for (i = 0; i < s->len; i++)
+    text[i] = (isalnum(s->key[i]) || (s->key[i] && strchr(".-_:[]", s->key[i]))) ? s->key[i] : '?';
+  text[i] = '\0';
+}
+
+/* the top of kind over all summaries into top[], highest first. returns
+   how many, -1 if out of memory */
+static int kind_top(hit_enum kind, hit_entry_struct *top) {
+  hit_entry_struct *e, m;
+  stats_block_struct *b;
+  unsigned int i, n, used, min, total_min = 0, covered;
+  int num = 0, k;
+
+  for (n = 0, b = stats_blocks(); b; b = b->next)
+    n += HITTERS_SLOTS;
+  if (!n)
+    return 0;
+  if (!(e = malloc(n * sizeof(*e))))
+    return -1;
+  // a copy of each summary as it is now
+  for (n = 0, b = stats_blocks(); b; b = b->next) {
+    used = __atomic_load_n(&b->hit.used[kind], __ATOMIC_RELAXED);
+    if (used > HITTERS_SLOTS)
+      used = HITTERS_SLOTS;
+    for (min = 0, i = 0; i < used; i++) {
+      e[n + i].slot = b->hit.slots[kind][i];
+      if (e[n + i].slot.len > HITTERS_KEY)
+        e[n + i].slot.len = HITTERS_KEY;
+      if (!i || e[n + i].slot.count < min)
+        min = e[n + i].slot.count;
+    }
+    if (used < HITTERS_SLOTS)
+      min = 0;
+    for (i = 0; i < used; i++)
+      e[n + i].min = min;
+    total_min += min;
+    n += used;
+  }
+  qsort(e, n, sizeof(*e), entry_cmp);
+  for (i = 0; i < n; ) {
+    m = e[i];
+    covered = e[i].min;
+    for (i++; i < n && !entry_cmp(&m, &e[i]); i++) {
+      m.slot.count += e[i].slot.count;
+      m.slot.err += e[i].slot.err;
+      covered += e[i].min;
+    }
+    m.slot.count += total_min - covered;
+    m.slot.err += total_min - covered;
+    if (num == HITTERS_TOP && m.slot.count <= top[num - 1].slot.count)
+      continue;
+    if (num < HITTERS_TOP)
+      num++;
+    for (k = num - 1; k > 0 && m.slot.count > top[k - 1].slot.count; k--)
+      top[k] = top[k - 1];
+    top[k] = m;
+  }
+  free(e);
+  return num;
+}
+
+char *hitters_top(int html) {
+  hit_entry_struct top[HITTERS_TOP];
+  char text[HITTERS_KEY + INET6_ADDRSTRLEN];
+  strbuf_struct sb = {0};
+  int kind, i, num, rv = 0;
+
+  for (kind = 0; kind < HIT_KINDS; kind++) {
+    if ((num = kind_top(kind, top)) < 0)
+      rv = -1;
+    if (num > 0 && html)
+      rv |= strbuf_printf(&sb, "<tr><th colspan=\"3\"></th></tr>");
+    for (i = 0; i < num; i++) {
+      key_text(kind, &top[i].slot, text);
+      if (html)
+        rv |= strbuf_printf(&sb, "<tr><td>%s%d</td><td>%s</td><td>%u %s (%u fewer at most)</td></tr>",
+            kind_names[kind], i + 1, text, top[i].slot.count, kind_texts[kind], top[i].slot.err);
+      else
+        rv |= strbuf_printf(&sb, ", %s/%u/%u %s%d", text, top[i].slot.count, top[i].slot.err,
+            kind_names[kind], i + 1);
+    }
+  }
+  if (rv < 0) {
+    free(sb.buf);
+    return NULL;
+  }
+  return sb.buf;
+}
@@ -0,0 +1,42 @@
+#ifndef HITTERS_H
+#define HITTERS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define HITTERS_SLOTS  32       /* names tracked per kind by each thread */
+#define HITTERS_TOP    10       /* listed on the stats pages */
+#define HITTERS_KEY    40       /* bytes of a name kept */
+
+typedef enum {
+  HIT_SNI,                      /* TLS server names, per handshake */
+  HIT_HOST,                     /* Host headers, per request */
+  HIT_CLIENT,                   /* client addresses, per connection */
+  HIT_KINDS
+} hit_enum;
+
+typedef struct {
+  uint32_t hash;
+  unsigned int count;           /* never below the true count */
+  unsigned int err;             /* nor above it by more than this */
+  unsigned char len;
+  unsigned char key[HITTERS_KEY];
+} hit_slot_struct;
+
+// Space-Saving summaries of one thread, part of its stats block
+typedef struct {
+  hit_slot_struct slots[HIT_KINDS][HITTERS_SLOTS];
+  unsigned int used[HIT_KINDS];
+} hitters_struct;
+
+// count a name of kind for the calling thread. not kept without USE_PTHREAD
+void hitters_count(hit_enum kind, const void *key, int len);
+// count a client connecting from sa
+void hitters_count_addr(const struct sockaddr *sa);
+
+// the names counted most of each kind over all threads, with their error
+// bound, as rows of the HTML stats table or entries of the text one. to be
+// freed
+char *hitters_top(int html);
+
+#endif // HITTERS_H
@@ -0,0 +1,139 @@
+/*
+ * pixelserv-stat: print the statistics a running pixelserv-tls publishes
+ * in shared memory (see '-M STATS_SHM'), without a request to the server.
+ * One "name value" line per counter, then one line per latency histogram
+ * with samples: name, p50, p90, p99 and p99.9 in msec, and the count.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "statseg.h"
+
+#define SNAPSHOT_TRIES  1000
+
+/* a consistent copy of the segment under name, to be freed; NULL on error */
+static statseg_header_struct *snapshot(const char *name) {
+  struct timespec pause = {0, 100000};
+  statseg_header_struct *seg, *copy = NULL;
+  struct stat st;
+  uint32_t seq;
+  int fd, i;
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+    fprintf(stderr, "pixelserv-stat: %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(*seg)
+      || (seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "pixelserv-stat: %s: not a stats segment\n", name);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  if (seg->magic != STATSEG_MAGIC || seg->version != STATSEG_VERSION
+      || seg->size > st.st_size) {
+    fprintf(stderr, "pixelserv-stat: %s: unknown layout, version %u\n", name, seg->version);
+    goto out;
+  }
+  if (!(copy = malloc(seg->size)))
+    goto out;
+  for (i = 0; i < SNAPSHOT_TRIES; i++) {
+    seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+      memcpy(copy, seg, seg->size);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq)
+        break;
+    }
+    nanosleep(&pause, NULL);
+  }
+  if (i == SNAPSHOT_TRIES) {
+    fprintf(stderr, "pixelserv-stat: %s: always being written\n", name);
+    free(copy);
+    copy = NULL;
+  }
+out:
+  munmap(seg, st.st_size);
+  return copy;
+}
+
+/* value in msec below which fraction q of the samples in h fall */
+static double quantile(const statseg_hist_struct *h, const uint32_t *bounds,
+                       uint32_t num, double q) {
+  uint64_t want = q * h->count + 0.999, seen = 0;
+  uint32_t i;
+
+  for (i = 0; i < num - 1; i++)
+    if ((seen += h->buckets[i]) >= want)
+      break;
+  return bounds[i] / 1000.0;
+}
+
+static int print_stats(const char *name) {
+  statseg_header_struct *seg;
+  const statseg_value_struct *v;
+  const statseg_hist_struct *h;
+  const uint32_t *bounds;
+  uint32_t i;
+
+  if (!(seg = snapshot(name)))
+    return -1;
+  if (kill(seg->pid, 0) < 0 && errno == ESRCH) {
+    fprintf(stderr, "pixelserv-stat: %s: pid %d is gone\n", name, seg->pid);
+    free(seg);
+    return -1;
+  }
+  printf("pid %d\nuts %lld\nage %lld\n", seg->pid,
+         (long long)(seg->updated - seg->started), (long long)(time(NULL) - seg->updated));
+  v = (const statseg_value_struct *)((const char *)seg + seg->values_off);
+  for (i = 0; i < seg->num_values; i++)
+    printf("%.*s %lld\n", STATSEG_NAME_LEN, v[i].name, (long long)v[i].value);
+  bounds = (const uint32_t *)((const char *)seg + seg->bounds_off);
+  for (i = 0; i < seg->num_hists; i++) {
+    h = (const statseg_hist_struct *)((const char *)seg + seg->hists_off + i * seg->hist_size);
+    if (!h->count || !h->name[0])
+      continue;
+    printf("%.*s %.2f %.2f %.2f %.2f %llu\n", STATSEG_NAME_LEN, h->name,
+           quantile(h, bounds, seg->num_buckets, 0.5), quantile(h, bounds, seg->num_buckets, 0.9),
+           quantile(h, bounds, seg->num_buckets, 0.99), quantile(h, bounds, seg->num_buckets, 0.999),
+           (unsigned long long)h->count);
+  }
+  free(seg);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *name = DEFAULT_STATSEG_NAME;
+  int opt, secs = 0;
+
+  while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+    switch (opt) {
+      case 'n': name = optarg;            break;
+      case 'i': secs = atoi(optarg);      break;
+      default:
+        fprintf(stderr, "Usage: pixelserv-stat [-n STATS_SHM] [-i SECS]\n"
+                "\t" "-n  STATS_SHM\t(as '-M' of pixelserv-tls; default: " DEFAULT_STATSEG_NAME ")\n"
+                "\t" "-i  SECS\t(print again every SECS; default: once)\n");
+        return EXIT_FAILURE;
+    }
+  }
+  for (;;) {
+    if (print_stats(name) < 0)
+      return EXIT_FAILURE;
+    if (secs <= 0)
+      return EXIT_SUCCESS;
+    printf("\n");
+    fflush(stdout);
+    sleep(secs);
+  }
+}
@@ -26,6 +26,20 @@
 #include <openssl/err.h>
 #include "certs.h"
 #include "logger.h"
+#include "event_handler.h"
+#include "conn_pool.h"
+#include "conn_timer.h"
+#include "prefork.h"
+#include "affinity.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "handoff.h"
+#include "probes.h"
+#include "stats.h"
+#include "feed.h"
+#include "series.h"
+#include "statseg.h"
+#include "hitters.h"
 
 #ifdef USE_PTHREAD
 #include <pthread.h>
@@ -34,8 +48,16 @@
 
 #define THREAD_STACK_SIZE  32767
 
+static int reload_pipe[2] = {-1, -1};  // SIGHUP wakes up main() with a byte
+
 void signal_handler(int sig)
 {
+  if (sig == SIGHUP) {
+    // the reload itself is no job for a signal handler
+    if (write(reload_pipe[1], "", 1) < 0)
+      ;  // one is already pending
+    return;
+  }
   if (sig != SIGTERM
    && sig != SIGUSR1
 #ifdef DEBUG
@@ -75,11 +97,58 @@ const char *tls_pem = DEFAULT_PEM_PATH;
 int tls_ports[MAX_TLS_PORTS] = {0};
 int num_tls_ports = 0;
 STACK_OF(X509_INFO) *cachain = NULL;
+SSL_CTX *sslctx = NULL;
 struct Global *g;
 cert_tlstor_t cert_tlstor;
 #ifdef USE_PTHREAD
 pthread_t certgen_thread;
+#else
+pid_t certgen_pid = 0;
+#endif
+
+#ifdef USE_PTHREAD
+static int is_tls_port(int port)
+{
+  int i;
+  for (i = 0; i < num_tls_ports; i++)
+    if (tls_ports[i] == port)
+      return 1;
+  return 0;
+}
+#endif
+
+// re-read the CA chain; certificates are loaded afresh from now on
+static void reload(void)
+{
+  static STACK_OF(X509_INFO) *retired = NULL;
+  STACK_OF(X509_INFO) *chain;
+
+  if (cachain_load(tls_pem, &chain) < 0) {
+    log_msg(LGG_ERR, "Reload failed, keeping the current CA");
+    return;
+  }
+  // handshakes under way may still use the previous chain
+  sk_X509_INFO_pop_free(retired, X509_INFO_free);
+  retired = cachain;
+  cachain = chain;
+  sslctx_cache_flush();
+#ifndef USE_PTHREAD
+  // workers have their own copy of all that
+  prefork_recycle();
 #endif
+  log_msg(LGG_NOTICE, "Reloaded CA from %s on SIGHUP", tls_pem);
+}
+
+// leave after being taken over by a new instance
+static void drain_exit(void)
+{
+  log_msg(LGG_NOTICE, "Drained, exit with %d connections left", kcc);
+#ifndef USE_PTHREAD
+  if (certgen_pid > 0)
+    kill(certgen_pid, SIGTERM);
+#endif
+  exit(EXIT_SUCCESS);
+}
 
 int main (int argc, char* argv[]) // program start
 {
@@ -96,8 +165,10 @@ int main (int argc, char* argv[]) // program start
   int use_ip = 0;
   struct addrinfo hints, *servinfo;
   int error = 0;
-  int pipefd[2];  // IPC pipe ends (0 = read, 1 = write)
-  response_struct pipedata = { FAIL_GENERAL, { 0 }, 0.0, 0 };
+  int pipefd[2] = { -1, -1 };  // IPC pipe ends (0 = read, 1 = write)
+#ifndef USE_PTHREAD
+  response_struct pipedata = { FAIL_GENERAL, { 0 }, 0.0, { 0 }, { 0 }, 0 };
+#endif
   char* ports[MAX_PORTS];
   ports[0] = DEFAULT_PORT;
   ports[1] = SECOND_PORT;
@@ -109,7 +180,18 @@ int main (int argc, char* argv[]) // program start
   int select_rv = 0;
   int nfds = 0;
   int num_ports = 0;
-  int i;
+  int num_sockfds = 0;
+  int batch;
+  int i, j;
+  char *ctl_path = NULL;
+  int ctl_fd = -1;    // control socket for the next upgrade
+  int ctl_conn = -1;  // new instance taking over
+  int *listen_fds = NULL;
+  int num_listen_fds = 0;
+  struct timespec drain_start = {0, 0};
+#ifndef USE_PTHREAD
+  int use_prefork = 0;
+#endif
 #ifdef IF_MODE
   char *ifname = "";
   int use_if = 0;
@@ -120,15 +202,31 @@ int main (int argc, char* argv[]) // program start
 #endif
   char* stats_url = DEFAULT_STATS_URL;
   char* stats_text_url = DEFAULT_STATS_TEXT_URL;
+  char* metrics_url = DEFAULT_METRICS_URL;
+  char* feed_url = DEFAULT_FEED_URL;
+  char* trace_url = DEFAULT_TRACE_URL;
+  int feed_secs = DEFAULT_FEED_SECS;
+  char* statseg_name = DEFAULT_STATSEG_NAME;
   int do_204 = 1;
 #ifndef TEST
   int do_foreground = 0;
 #endif // !TEST
   int do_redirect = 1;
-#ifdef DEBUG
   int warning_time = 0;
-#endif //DEBUG
   int max_num_threads = DEFAULT_THREAD_MAX;
+  int pool_min = DEFAULT_POOL_MIN;
+  int pool_idle = DEFAULT_POOL_IDLE;
+  int latency_target = 0;
+  int max_tls = 0;
+#ifdef USE_PTHREAD
+  int event_workers = 0;
+  int max_num_conns = DEFAULT_CONN_MAX;
+  int reuseport = 0;  // 1: SO_REUSEPORT listeners per worker 2: plus CPU steering
+  int *shard_fds = NULL;
+  int use_uring = 0;
+  int sni_route = 0;
+#endif
+  int num_shards = 1;
 
   // command line arguments processing
   for (i = 1; i < argc && error == 0; ++i) {
@@ -136,11 +234,19 @@ int main (int argc, char* argv[]) // program start
       // handle arguments that don't require a subsequent argument
       switch (argv[i][1]) {
         case '2': do_204 = 0;                                 continue;
+#ifdef USE_PTHREAD
+        case 'B': reuseport = 2;                              continue;
+#endif
 #ifndef TEST
         case 'f': do_foreground = 1;                          continue;
 #endif // !TEST
         case 'r': /* deprecated - ignoring */                 continue;
         case 'R': do_redirect = 0;                            continue;
+#ifdef USE_PTHREAD
+        case 'N': sni_route = 1;                              continue;
+        case 'S': if (!reuseport) reuseport = 1;              continue;
+        case 'U': use_uring = 1;                              continue;
+#endif
         // no default here because we want to move on to the next section
         case 'l':
           if ((i + 1) == argc || argv[i + 1][0] == '-') {
@@ -153,6 +259,70 @@ int main (int argc, char* argv[]) // program start
       if ((i + 1) < argc) {
         // switch on parameter letter and process subsequent argument
         switch (argv[i++][1]) {
+#ifdef USE_PTHREAD
+          case 'c':
+            errno = 0;
+            max_num_conns = strtol(argv[i], NULL, 10);
+            if (errno || max_num_conns <= 0) {
+              error = 1;
+            }
+          continue;
+          case 'E':
+            errno = 0;
+            event_workers = strtol(argv[i], NULL, 10);
+            if (errno || event_workers <= 0 || event_workers > MAX_EVENT_WORKERS) {
+              error = 1;
+            }
+          continue;
+#endif
+          case 'a':
+            if (affinity_set(CPU_ACCEPT, argv[i]) < 0)
+              error = 1;
+          continue;
+          case 'A':
+            if (affinity_set(CPU_SERVE, argv[i]) < 0)
+              error = 1;
+          continue;
+          case 'G':
+            if (affinity_set(CPU_CERTGEN, argv[i]) < 0)
+              error = 1;
+          continue;
+          case 'e': feed_url = argv[i];                       continue;
+          case 'H':
+            errno = 0;
+            max_tls = strtol(argv[i], NULL, 10);
+            if (errno || max_tls <= 0) {
+              error = 1;
+            }
+          continue;
+          case 'i':
+            errno = 0;
+            feed_secs = strtol(argv[i], NULL, 10);
+            if (errno || feed_secs <= 0) {
+              error = 1;
+            }
+          continue;
+          case 'I':
+            errno = 0;
+            pool_idle = strtol(argv[i], NULL, 10);
+            if (errno || pool_idle <= 0) {
+              error = 1;
+            }
+          continue;
+          case 'P':
+            errno = 0;
+            pool_min = strtol(argv[i], NULL, 10);
+            if (errno || pool_min < 0) {
+              error = 1;
+            }
+          continue;
+          case 'L':
+            errno = 0;
+            latency_target = strtol(argv[i], NULL, 10);
+            if (errno || latency_target < 0) {
+              error = 1;
+            }
+          continue;
           case 'l':
             if ((logger_level)atoi(argv[i]) > LGG_DEBUG
                 || (logger_level)atoi(argv[i]) < 0)
@@ -193,6 +363,12 @@ int main (int argc, char* argv[]) // program start
               error = 1;
             }
           continue;
+          case 'Q':
+            if (ratelimit_init(argv[i]) < 0)
+              error = 1;
+          continue;
+          case 'm': metrics_url = argv[i];                    continue;
+          case 'M': statseg_name = argv[i];                   continue;
           case 's': stats_url = argv[i];                      continue;
           case 't': stats_text_url = argv[i];                 continue;
           case 'T':
@@ -205,7 +381,6 @@ int main (int argc, char* argv[]) // program start
 #ifdef DROP_ROOT
           case 'u': user = argv[i];                           continue;
 #endif
-#ifdef DEBUG
           case 'w':
             errno = 0;
             warning_time = strtol(argv[i], NULL, 10);
@@ -213,7 +388,8 @@ int main (int argc, char* argv[]) // program start
               error = 1;
             }
           continue;
-#endif //DEBUG
+          case 'x': ctl_path = argv[i];                       continue;
+          case 'y': trace_url = argv[i];                      continue;
           case 'z':
             tls_pem = argv[i];
           continue;
@@ -230,28 +406,80 @@ int main (int argc, char* argv[]) // program start
     } // -
   } // for
 
+#ifdef USE_PTHREAD
+  if ((reuseport || use_uring || sni_route) && !event_workers)
+    error = 1;
+  if (sni_route && reuseport)
+    error = 1;
+  // plain HTTP needs a share of its own
+  if (max_tls >= ((event_workers) ? max_num_conns : max_num_threads))
+    error = 1;
+#else
+  if (max_tls >= max_num_threads)
+    error = 1;
+#endif
+
   if (error) {
     printf("%s: %s compiled: " __DATE__ " " __TIME__ "\n"
            "Usage: pixelserv-tls [OPTION]" "\n"
            "options:" "\n"
            "\t" "ip_addr/hostname\t(default: 0.0.0.0)" "\n"
            "\t" "-2\t\t\t(disable HTTP 204 reply to generate_204 URLs)" "\n"
+           "\t" "-a  CPUS\t\t(CPUs for the accept loop, e.g. 0-1,4; default: any)" "\n"
+           "\t" "-A  CPUS\t\t(CPUs for serving connections; default: any)" "\n"
+#ifdef USE_PTHREAD
+           "\t" "-B\t\t\t(with -E; as -S and steer connections to workers by CPU)" "\n"
+           "\t" "-c  MAX_CONNS\t\t(with -E; default: %d)" "\n"
+#endif
+           "\t" "-e  FEED_URL\t\t(stats feed of server-sent events; default: "
+           DEFAULT_FEED_URL
+           ")" "\n"
+#ifdef USE_PTHREAD
+           "\t" "-E  WORKERS\t\t(event-driven mode with WORKERS epoll threads; default: off)" "\n"
+#endif
 #ifndef TEST
            "\t" "-f\t\t\t(stay in foreground/don't daemonize)" "\n"
 #endif // !TEST
+           "\t" "-G  CPUS\t\t(CPUs for certificate generation; default: any)" "\n"
+           "\t" "-H  MAX_TLS\t\t(HTTPS share of -T or -c, below it; default: 3/4)" "\n"
+           "\t" "-i  FEED_SECS\t\t(between stats feed events; default: %ds)" "\n"
+#ifdef USE_PTHREAD
+           "\t" "-I  THREAD_IDLE\t\t(secs before a spare pool thread exits; default: %ds)" "\n"
+#else
+           "\t" "-I  PROC_IDLE\t\t(secs before a spare worker process exits; default: %ds)" "\n"
+#endif
            "\t" "-k  HTTPS_PORT\t\t(default: "
            SECOND_PORT
            ")" "\n"
            "\t" "-l  LEVEL\t\t(0:critical 1:error<default> 2:warning 3:notice 4:info 5:debug)" "\n"
+           "\t" "-L  LATENCY\t\t(shed load above this request latency in msec; default: off)" "\n"
+           "\t" "-m  METRICS_URL\t\t(OpenMetrics stats; default: "
+           DEFAULT_METRICS_URL
+           ")" "\n"
+           "\t" "-M  STATS_SHM		(shared memory stats for pixelserv-stat; empty: off; default: "
+           DEFAULT_STATSEG_NAME
+           ")" "\n"
 #ifdef IF_MODE
            "\t" "-n  IFACE\t\t(default: all interfaces)" "\n"
 #endif // IF_MODE
+#ifdef USE_PTHREAD
+           "\t" "-N\t\t\t(with -E; route HTTPS connections to workers by SNI)" "\n"
+#endif
            "\t" "-o  SELECT_TIMEOUT\t(default: %ds)" "\n"
            "\t" "-O  KEEPALIVE_TIME\t(for HTTP/1.1 connections; default: %ds)" "\n"
            "\t" "-p  HTTP_PORT\t\t(default: "
            DEFAULT_PORT
            ")" "\n"
+#ifdef USE_PTHREAD
+           "\t" "-P  MIN_THREADS\t\t(pool threads kept ready; default: %d)" "\n"
+#else
+           "\t" "-P  MIN_PROCS\t\t(worker processes kept ready; default: %d)" "\n"
+#endif
+           "\t" "-Q  CPS:RPS:CONNS\t(per client IP: connections/s, requests/s, open connections; 0: no limit; default: off)" "\n"
            "\t" "-R\t\t\t(disable redirect to encoded path in tracker links)" "\n"
+#ifdef USE_PTHREAD
+           "\t" "-S\t\t\t(with -E; each worker accepts on own SO_REUSEPORT listeners)" "\n"
+#endif
            "\t" "-s  STATS_HTML_URL\t(default: "
            DEFAULT_STATS_URL
            ")" "\n"
@@ -262,13 +490,23 @@ int main (int argc, char* argv[]) // program start
 #ifdef DROP_ROOT
            "\t" "-u  USER\t\t(default: \"nobody\")" "\n"
 #endif // DROP_ROOT
-#ifdef DEBUG
-           "\t" "-w  warning_time\t(warn when elapsed connection time exceeds value in msec)" "\n"
-#endif //DEBUG
+#ifdef USE_PTHREAD
+           "\t" "-U\t\t\t(with -E; use io_uring for plain HTTP connections)" "\n"
+#endif
+           "\t" "-w  warning_time\t(keep traces of requests taking longer, in msec; default: off)" "\n"
+           "\t" "-x  CTL_SOCKET\t\t(take over listeners from the instance on CTL_SOCKET and await the next one there; default: off)" "\n"
+           "\t" "-y  TRACE_URL\t\t(latest requests traced; default: "
+           DEFAULT_TRACE_URL
+           ")" "\n"
            "\t" "-z  CERT_PATH\t\t(default: "
            DEFAULT_PEM_PATH
            ")" "\n"
-           , argv[0], VERSION, DEFAULT_TIMEOUT, DEFAULT_KEEPALIVE, DEFAULT_THREAD_MAX);
+           , argv[0], VERSION,
+#ifdef USE_PTHREAD
+           DEFAULT_CONN_MAX,
+#endif
+           DEFAULT_FEED_SECS, DEFAULT_POOL_IDLE, DEFAULT_TIMEOUT, DEFAULT_KEEPALIVE, DEFAULT_POOL_MIN,
+           DEFAULT_THREAD_MAX);
     exit(EXIT_FAILURE);
   }
 
@@ -278,6 +516,8 @@ int main (int argc, char* argv[]) // program start
     exit(EXIT_FAILURE);
   }
 #endif
+  // threads and processes started later move on to their own CPUs
+  affinity_apply(CPU_ACCEPT, -1);
 
   openlog("pixelserv-tls", LOG_PID | LOG_CONS | LOG_PERROR, LOG_DAEMON);
   version_string = get_version(argc, argv);
@@ -288,6 +528,9 @@ int main (int argc, char* argv[]) // program start
     exit(EXIT_FAILURE);
   }
 
+  // before anything gets allocated by OpenSSL
+  if (ssl_mem_init() < 0)
+    log_msg(LGG_DEBUG, "Cannot account for OpenSSL memory per connection");
   SSL_library_init();
 #ifdef USE_PTHREAD
   ssl_init_locks();
@@ -299,49 +542,21 @@ int main (int argc, char* argv[]) // program start
     struct rlimit l = {THREAD_STACK_SIZE, THREAD_STACK_SIZE * 2};
     if (setrlimit(RLIMIT_STACK, &l) == -1)
       log_msg(LGG_ERR, "setrlimit STACK failed: %d %d errno:%d", l.rlim_cur, l.rlim_max, errno);
+#ifdef USE_PTHREAD
+    if (event_workers)
+      max_num_threads = max_num_conns;
+#endif
+    admission_init(max_num_threads, max_tls, latency_target);
+    feed_init(feed_secs);
     l.rlim_cur = max_num_threads + 50;
     l.rlim_max = max_num_threads * 2;
     if (setrlimit(RLIMIT_NOFILE, &l) == -1)
       log_msg(LGG_ERR, "setrlimit NOFILE failed: %d %d errno:%d", l.rlim_cur, l.rlim_max, errno);
 
-    char *fname = malloc(PIXELSERV_MAX_PATH);
-    strcpy(fname, tls_pem);
-    strcat(fname, "/ca.crt");
-    FILE *fp = fopen(fname, "r");
-    X509 *cacert = X509_new();
-    if(fp == NULL || PEM_read_X509(fp, &cacert, NULL, NULL) == NULL)
-      log_msg(LGG_ERR, "Failed to open/read ca.crt");
-    else {
-      EVP_PKEY * pubkey = X509_get_pubkey(cacert);
-      if (X509_verify(cacert, pubkey) <= 0)
-      {
-        BIO *bioin; int fsz; char *cafile;
-
-        if (fseek(fp, 0L, SEEK_END) < 0)
-          log_msg(LGG_ERR, "Failed to seek ca.crt");
-        fsz = ftell(fp);
-        cafile = malloc(fsz);
-        fseek(fp, 0L, SEEK_SET);
-        fread(cafile, 1, fsz, fp);
-
-        bioin = BIO_new_mem_buf(cafile, fsz);
-        if (!bioin)
-          log_msg(LGG_ERR, "Failed to create new BIO mem buffer");
-
-        cachain = PEM_X509_INFO_read_bio(bioin, NULL, NULL, NULL);
-        if (!cachain)
-          log_msg(LGG_ERR, "Failed to read CA chain from ca.crt");
-        BIO_free(bioin);
-        free(cafile);
-      }
-      fclose(fp);
-      free(fname);
-      EVP_PKEY_free(pubkey);
-      X509_free(cacert);
-
+    if (cachain_load(tls_pem, &cachain) == 0) {
       cert_tlstor.pem_dir = tls_pem;
   #ifndef USE_PTHREAD
-      if(fork() == 0){
+      if((certgen_pid = fork()) == 0){
         sigset_t mask;
         sigemptyset(&mask);
         sigaddset(&mask, SIGUSR1);
@@ -380,6 +595,18 @@ int main (int argc, char* argv[]) // program start
   //no -p
     ports[num_ports++] = DEFAULT_PORT;    
 
+#ifdef USE_PTHREAD
+  if (reuseport) {
+    num_shards = event_workers;
+    shard_fds = malloc(num_shards * num_ports * sizeof(int));
+  }
+#endif
+
+  // listeners of a running instance are taken over rather than bound again
+  if (ctl_path)
+    handoff_receive(ctl_path);
+  listen_fds = malloc(num_shards * num_ports * sizeof(int));
+
   // clear the set
   FD_ZERO(&readfds);
   for (i = 0; i < num_ports; i++) {
@@ -391,33 +618,58 @@ int main (int argc, char* argv[]) // program start
       exit(EXIT_FAILURE);
     }
 
-    if ( ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 1)
-      || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)))
-      || (setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &yes, sizeof(int)))  // send short packets straight away
+    // one listener per port; with SO_REUSEPORT sharding one per port per worker
+    for (j = 0; j < num_shards; j++) {
+      sockfd = handoff_take(servinfo->ai_addr, servinfo->ai_addrlen);
+      if ( sockfd < 0 && (
+           ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 1)
+        || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)))
+#ifdef USE_PTHREAD
+        || (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)))
+#endif
+        || (setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &yes, sizeof(int)))  // send short packets straight away
 #ifdef IF_MODE
-      || (use_if && (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname))))  // only use selected i/f
+        || (use_if && (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname))))  // only use selected i/f
 #endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
-      || (setsockopt(sockfd, SOL_TCP, TCP_FASTOPEN, &yes, sizeof(int)))
+        || (setsockopt(sockfd, SOL_TCP, TCP_FASTOPEN, &yes, sizeof(int)))
+#endif
+#ifdef USE_PTHREAD
+        // accept TLS clients only once their ClientHello is there to peek at
+        || (sni_route && is_tls_port(atoi(port))
+            && setsockopt(sockfd, SOL_TCP, TCP_DEFER_ACCEPT, &yes, sizeof(int)))
 #endif
-      || (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen))
-      || (listen(sockfd, BACKLOG))
-      || (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK))  // set non-blocking mode
-       ) {
+        || (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen))
+        || (listen(sockfd, BACKLOG))
+        || (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK))  // set non-blocking mode
+         )) {
 #ifdef IF_MODE
-      log_msg(LGG_ERR, "Abort: %m - %s:%s:%s", ifname, ip_addr, port);
+        log_msg(LGG_ERR, "Abort: %m - %s:%s:%s", ifname, ip_addr, port);
 #else
-      log_msg(LOG_ERR, "Abort: %m - %s:%s", ip_addr, port);
+        log_msg(LOG_ERR, "Abort: %m - %s:%s", ip_addr, port);
 #endif
-      exit(EXIT_FAILURE);
-    }
+        exit(EXIT_FAILURE);
+      }
+      listen_fds[num_listen_fds++] = sockfd;
 
-    sockfds[i] = sockfd;
-    // add descriptor to the set
-    FD_SET(sockfd, &readfds);
-    if (sockfd > nfds) {
-      nfds = sockfd;
+#ifdef USE_PTHREAD
+      if (reuseport) {
+        shard_fds[j * num_ports + i] = sockfd;
+        continue;
+      }
+#endif
+      sockfds[i] = sockfd;
+      num_sockfds = i + 1;
+      // add descriptor to the set
+      FD_SET(sockfd, &readfds);
+      if (sockfd > nfds) {
+        nfds = sockfd;
+      }
     }
+#ifdef USE_PTHREAD
+    if (reuseport > 1 && reuseport_steer_cpu(shard_fds[i], num_shards) < 0)
+      log_msg(LGG_WARNING, "SO_ATTACH_REUSEPORT_CBPF failed on port %s: %m", port);
+#endif
 
     freeaddrinfo(servinfo); // all done with this structure
 #ifdef IF_MODE
@@ -450,6 +702,11 @@ int main (int argc, char* argv[]) // program start
       log_msg(LOG_ERR, "SIGUSR1 %m");
       exit(EXIT_FAILURE);
     }
+    // set signal handler for reload
+    if (pipe2(reload_pipe, O_NONBLOCK | O_CLOEXEC) || sigaction(SIGHUP, &sa, NULL)) {
+      log_msg(LOG_ERR, "SIGHUP %m");
+      exit(EXIT_FAILURE);
+    }
 #if defined(__GLIBC__) && defined(BACKTRACE)
     sa.sa_handler = print_trace;
     if (sigaction(SIGSEGV, &sa, NULL)) {
@@ -481,7 +738,9 @@ int main (int argc, char* argv[]) // program start
   //  SIGPIPE signals
   signal(SIGPIPE, SIG_IGN);
 
+#ifndef USE_PTHREAD
   // open pipe for children to use for writing data back to main
+  // threads count straight into their own stats blocks instead
   if (pipe(pipefd) == -1) {
     log_msg(LOG_ERR, "pipe() error: %m");
     exit(EXIT_FAILURE);
@@ -499,10 +758,12 @@ int main (int argc, char* argv[]) // program start
   if (pipefd[0] > nfds) {
     nfds = pipefd[0];
   }
+#endif
 
-  // nfds now contains the largest fd number of interest;
-  //  increment by 1 for use with select()
-  ++nfds;
+  FD_SET(reload_pipe[0], &readfds);
+  if (reload_pipe[0] > nfds) {
+    nfds = reload_pipe[0];
+  }
 
   sin_size = sizeof their_addr;
 
@@ -514,18 +775,68 @@ int main (int argc, char* argv[]) // program start
         pipefd[1],
         stats_url,
         stats_text_url,
+        metrics_url,
+        feed_url,
+        trace_url,
         do_204,
         do_redirect,
-#ifdef DEBUG
         warning_time,
-#endif
   };
   g = &_g;
 
-  SSL_CTX *sslctx = create_default_sslctx(tls_pem);
+  sslctx = create_default_sslctx(tls_pem);
+
+  if (series_init(THREAD_STACK_SIZE) < 0)
+    log_msg(LGG_WARNING, "Failed to set up time series of the stats");
+  if (*statseg_name && statseg_init(statseg_name, THREAD_STACK_SIZE) < 0)
+    log_msg(LGG_WARNING, "Failed to publish stats in shared memory");
+
+#ifdef USE_PTHREAD
+  if (event_workers && event_init(event_workers, shard_fds, (shard_fds) ? num_ports : 0, use_uring) < 0) {
+    log_msg(LGG_ERR, "Failed to start event workers");
+    exit(EXIT_FAILURE);
+  }
+  if (!event_workers && (conn_timer_init(THREAD_STACK_SIZE) < 0
+      || conn_pool_init(pool_min, max_num_threads, pool_idle, THREAD_STACK_SIZE) < 0)) {
+    log_msg(LGG_ERR, "Failed to start service thread pool");
+    exit(EXIT_FAILURE);
+  }
+#else
+  if (conn_timer_init(0) < 0)
+    exit(EXIT_FAILURE);
+  // worker processes accept on the listeners from here on; main() only
+  // collects their stats
+  if (prefork_init(sockfds, num_sockfds, pool_min, max_num_threads, pool_idle) < 0) {
+    log_msg(LGG_WARNING, "Failed to start worker processes, forking per connection");
+  } else {
+    for (i = 0; i < num_sockfds; i++)
+      FD_CLR(sockfds[i], &readfds);
+    num_sockfds = 0;
+    use_prefork = 1;
+  }
+#endif
+
+  // serving now: an instance taken over from can go, the next one can come
+  if (ctl_path && (ctl_fd = handoff_ready(ctl_path)) >= 0) {
+    FD_SET(ctl_fd, &readfds);
+    if (ctl_fd > nfds) {
+      nfds = ctl_fd;
+    }
+  }
+
+  // nfds now contains the largest fd number of interest;
+  //  increment by 1 for use with select()
+  ++nfds;
 
   // main accept() loop
   while(1) {
+#ifndef USE_PTHREAD
+    series_tick();
+    statseg_update();
+    stats_shm_publish();
+#endif
+    if (drain_start.tv_sec && elapsed_time_msec(drain_start) >= DRAIN_MAX_SECS * 1000)
+      drain_exit();
     // only call select() if we have something more to process
     if (select_rv <= 0) {
       // select() modifies its fd set, so make a working copy
@@ -534,6 +845,32 @@ int main (int argc, char* argv[]) // program start
       selectfds = readfds;
       // NOTE: MACRO needs "_GNU_SOURCE"; without this the select gets
       //       interrupted with errno EINTR
+#ifndef USE_PTHREAD
+      if (use_prefork) {
+        struct timeval tv = {PREFORK_CHECK_SECS, 0};
+        select_rv = TEMP_FAILURE_RETRY(select(nfds, &selectfds, NULL, NULL, &tv));
+        if (select_rv == 0) {
+          prefork_check();
+          if (drain_start.tv_sec && prefork_workers() == 0)
+            drain_exit();
+          continue;
+        }
+      } else
+#endif
+      if (drain_start.tv_sec) {
+        struct timeval tv = {1, 0};
+        select_rv = TEMP_FAILURE_RETRY(select(nfds, &selectfds, NULL, NULL, &tv));
+        // with nothing left in the stats pipe, the count is final
+        if (select_rv == 0) {
+          if (kcc <= 0
+#ifdef USE_PTHREAD
+              && event_listening() == 0
+#endif
+             )
+            drain_exit();
+          continue;
+        }
+      } else
       select_rv = TEMP_FAILURE_RETRY(select(nfds, &selectfds, NULL, NULL, NULL));
       if (select_rv < 0) {
         log_msg(LOG_ERR, "main select() error: %m");
@@ -549,7 +886,7 @@ int main (int argc, char* argv[]) // program start
     // note that even though multiple sockets may be ready, we only process one
     //  per loop iteration; subsequent ones will be handled on subsequent passes
     //  through the loop
-    for (i = 0, sockfd = 0; i < num_ports; i++) {
+    for (i = 0, sockfd = 0; i < num_sockfds; i++) {
       if ( FD_ISSET(sockfds[i], &selectfds) ) {
         // select sockfds[i] for servicing during this loop pass
         sockfd = sockfds[i];
@@ -559,6 +896,72 @@ int main (int argc, char* argv[]) // program start
       }
     }
 
+    if (!sockfd && FD_ISSET(reload_pipe[0], &selectfds)) {
+      char b[16];
+      FD_CLR(reload_pipe[0], &selectfds);
+      --select_rv;
+      while (read(reload_pipe[0], b, sizeof(b)) > 0)
+        ;
+      reload();
+      continue;
+    }
+
+    // a new instance asks for the listeners
+    if (!sockfd && ctl_fd >= 0 && FD_ISSET(ctl_fd, &selectfds)) {
+      FD_CLR(ctl_fd, &selectfds);
+      --select_rv;
+      if (ctl_conn >= 0)
+        close(accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC));  // one at a time
+      else if ((ctl_conn = handoff_accept(ctl_fd, listen_fds, num_listen_fds)) >= 0) {
+        FD_SET(ctl_conn, &readfds);
+        if (ctl_conn >= nfds) {
+          nfds = ctl_conn + 1;
+        }
+      }
+      continue;
+    }
+
+    if (!sockfd && ctl_conn >= 0 && FD_ISSET(ctl_conn, &selectfds)) {
+      FD_CLR(ctl_conn, &selectfds);
+      --select_rv;
+      if ((rv = handoff_check(ctl_conn)) < 0)
+        continue;
+      FD_CLR(ctl_conn, &readfds);
+      close(ctl_conn);
+      ctl_conn = -1;
+      if (rv == 0) {
+        log_msg(LGG_WARNING, "New instance went away before taking over");
+        continue;
+      }
+      // the new instance serves: stop accepting and let connections finish
+      log_msg(LGG_NOTICE, "Taken over by new instance, draining %d connections", kcc);
+      FD_CLR(ctl_fd, &readfds);
+      close(ctl_fd);
+      ctl_fd = -1;
+      for (i = 0; i < num_sockfds; i++)
+        FD_CLR(sockfds[i], &readfds);
+      num_sockfds = 0;
+#ifdef USE_PTHREAD
+      // sharded listeners belong to the workers
+      if (!shard_fds)
+#endif
+      for (i = 0; i < num_listen_fds; i++)
+        close(listen_fds[i]);
+      admission_drain();
+#ifdef USE_PTHREAD
+      if (event_workers)
+        event_drain();
+      else
+        conn_timer_shed_idle(kcc);
+#else
+      if (use_prefork)
+        prefork_drain();
+#endif
+      get_time(&drain_start);
+      continue;
+    }
+
+#ifndef USE_PTHREAD
     // if select() didn't return due to a socket connection, check for pipe I/O
     if (!sockfd && FD_ISSET(pipefd[0], &selectfds)) {
       // perform a single read from pipe
@@ -570,76 +973,16 @@ int main (int argc, char* argv[]) // program start
       } else if (rv != sizeof(pipedata)) {
         log_msg(LGG_WARNING, "pipe read() got %d bytes, but %u bytes were expected - discarding", rv, (unsigned int)sizeof(pipedata));
       } else {
-        // process response type
-        switch (pipedata.status) {
-          case FAIL_GENERAL:   ++err; break;
-          case FAIL_TIMEOUT:   ++tmo; break;
-          case FAIL_CLOSED:    ++cls; break;
-          case FAIL_REPLY:     ++cly; break;
-          case SEND_GIF:       ++gif; break;
-          case SEND_TXT:       ++txt; break;
-          case SEND_JPG:       ++jpg; break;
-          case SEND_PNG:       ++png; break;
-          case SEND_SWF:       ++swf; break;
-          case SEND_ICO:       ++ico; break;
-          case SEND_BAD:       ++bad; break;
-          case SEND_STATS:     ++sta; break;
-          case SEND_STATSTEXT: ++stt; break;
-          case SEND_204:       ++noc; break;
-          case SEND_REDIRECT:  ++rdr; break;
-          case SEND_NO_EXT:    ++nfe; break;
-          case SEND_UNK_EXT:   ++ufe; break;
-          case SEND_NO_URL:    ++nou; break;
-          case SEND_BAD_PATH:  ++pth; break;
-          case SEND_POST:      ++pst; break;
-          case SEND_HEAD:      ++hed; break;
-          case SEND_OPTIONS:   ++opt; break;
-          case ACTION_LOG_VERB:  log_set_verb(pipedata.verb); break;
-          case ACTION_DEC_KCC: --kcc; break;
-          default:
-            log_msg(LOG_DEBUG, "conn_handler reported unknown response value: %d", pipedata.status);
-        }
-        switch (pipedata.ssl) {
-          case SSL_HIT:        ++slh; break;
-          case SSL_HIT_CLS:    ++slc; break;
-          default:             ;
-        }
-        if (pipedata.status < ACTION_LOG_VERB) {
-          count++;
-          // count only positive receive sizes
-          if (pipedata.rx_total <= 0) {
-            log_msg(LOG_DEBUG, "pipe read() got nonsensical rx_total data value %d - ignoring", pipedata.rx_total);
-          } else {
-            // calculate average byte per request (avg) using
-            static float favg = 0.0; 
-            static int favg_cnt = 0;
-            favg = ema(favg, pipedata.rx_total, &favg_cnt);
-            avg = favg + 0.5;
-            // look for a new high score
-            if (pipedata.rx_total > rmx)
-              rmx = pipedata.rx_total;
-          }
-
-          if (pipedata.status != FAIL_TIMEOUT) {
-            // calculate average process time (tav) using
-            static float ftav = 0.0;
-            static int ftav_cnt = 0;
-            ftav = ema(ftav, pipedata.run_time, &ftav_cnt);
-            tav = ftav + 0.5;
-            // look for a new high score, adding 0.5 for rounding
-            if (pipedata.run_time + 0.5 > tmx)
-              tmx = (pipedata.run_time + 0.5);
-          }
-        } else if (pipedata.status == ACTION_DEC_KCC) {
-          static int kvg_cnt = 0;
-          kvg = ema(kvg, pipedata.krq, &kvg_cnt);
-          if (pipedata.krq > krq)
-            krq = pipedata.krq;
+        stats_account(&pipedata);
+        if (use_prefork) {
+          prefork_check();
+          stats_shm_publish_conns();
         }
       }
       --select_rv;
       continue;
     }
+#endif
 
     // if select() returned but no fd's of interest were found, give up
     // note that this is bad because it means that select() will probably never
@@ -655,111 +998,137 @@ int main (int argc, char* argv[]) // program start
       continue;
     }
 
-    struct timespec init_time = {0, 0};
-    get_time(&init_time);
-    new_fd = accept(sockfd, (struct sockaddr *) &their_addr, &sin_size);
-    if (new_fd < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            cls++;   /* client closed connection before we got a chance to accept it */
-        }
-        log_msg(LGG_DEBUG, "accept: %m");
+    // accept everything pending on this listener, up to a per-wakeup budget
+    for (batch = 0; batch < ACCEPT_BUDGET; ) {
+      struct timespec init_time = {0, 0};
+      int tls;
+      rate_enum rate;
+      get_time(&init_time);
+      sin_size = sizeof their_addr;
+      new_fd = accept4(sockfd, (struct sockaddr *) &their_addr, &sin_size, SOCK_CLOEXEC);
+      if (new_fd < 0) {
+          if (!batch && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+              STATS_INC(cls);   /* client closed connection before we got a chance to accept it */
+          }
+          if (!batch || (errno != EAGAIN && errno != EWOULDBLOCK))
+              log_msg(LGG_DEBUG, "accept: %m");
+          break;
+      }
+      ++batch;
+      hitters_count_addr((struct sockaddr *) &their_addr);
+
+      conn_tlstor_struct *conn_tlstor = malloc(sizeof(conn_tlstor_struct));
+      conn_tlstor->new_fd = new_fd;
+      conn_tlstor->ssl = NULL;
+      conn_tlstor->tlsext_cb_arg = NULL;
+      // TLS handshake is left to whoever serves the connection
+      conn_tlstor->tls = tls = is_ssl_conn(new_fd, conn_tlstor->server_ip, INET6_ADDRSTRLEN, tls_ports, num_tls_ports);
+      conn_tlstor->init_time = elapsed_time_msec(init_time);
+      conn_tlstor->accept_time = init_time;
+      PROBE2(accept, new_fd, tls);
+
+      // clients over their own limits are turned away before anything else
+      if ((rate = ratelimit_conn(new_fd, &conn_tlstor->client)) != RATE_OK) {
+        admission_refuse(new_fd, tls);
+        if (rate == RATE_CONNS)
+          STATS_INC(rln);
+        else
+          STATS_INC(rlc);
+        free(conn_tlstor);
         continue;
-    }
-    if (kcc >= max_num_threads) {
-        clt++;
-        shutdown(new_fd, SHUT_RDWR);
-        close(new_fd);
+      }
+
+      // each class is held to its quota, whatever the load
+      if (admission_over_quota(tls)) {
+        admission_refuse(new_fd, tls);
+        ratelimit_close(conn_tlstor->client);
+        if (tls)
+          STATS_INC(trj);
+        else
+          STATS_INC(hrj);
+        STATS_INC(clt);
+        free(conn_tlstor);
         continue;
-    }
+      }
 
-    conn_tlstor_struct *conn_tlstor = malloc(sizeof(conn_tlstor_struct));
-    conn_tlstor->new_fd = new_fd;
-    conn_tlstor->ssl = NULL;
-    conn_tlstor->tlsext_cb_arg = NULL;
-    char server_ip[INET6_ADDRSTRLEN] = {'\0'};
-    if (is_ssl_conn(new_fd, server_ip, INET6_ADDRSTRLEN, tls_ports, num_tls_ports)) {
-        SSL *ssl = NULL;
-        tlsext_cb_arg_struct *t = malloc(sizeof(tlsext_cb_arg_struct));
-        t->tls_pem = tls_pem;
-        t->cachain = cachain;
-        t->servername = NULL;
-        strncpy(t->server_ip, server_ip, INET6_ADDRSTRLEN);
-        t->status = SSL_UNKNOWN;
-        t->sslctx = NULL;
-
-        SSL_CTX_set_tlsext_servername_arg(sslctx, t);
-        ssl = SSL_new(sslctx);
-        SSL_set_fd(ssl, new_fd);
-        int ssl_err = SSL_accept(ssl);
-        if (ssl_err != 1) {
-            count++;
-            log_msg(LGG_DEBUG, "SSL_accept error:%d status:%d\n", ssl_err, t->status);
-            switch(t->status) {
-                case SSL_MISS:       ++slm; break;
-                case SSL_ERR:        ++sle; break;
-                case SSL_UNKNOWN:    ++slu; break;
-                default:             ;
-            }
-            SSL_free(ssl);
-            SSL_CTX_free((SSL_CTX*)t->sslctx);
-            shutdown(new_fd, SHUT_RDWR);
-            close(new_fd);
-            free(t);
+      // shed idle keep-alives first, then new TLS; plain HTTP always gets in
+      switch (admission_level()) {
+        case ADM_SHED_TLS:
+          if (conn_tlstor->tls) {
+            admission_refuse(new_fd, 1);
+            ratelimit_close(conn_tlstor->client);
+            free(conn_tlstor);
+            STATS_INC(sht);
+            STATS_INC(clt);
             continue;
-        }
-        TESTPRINT("ssl new_fd:%d\n", new_fd);
-        conn_tlstor->ssl = ssl;
-        conn_tlstor->tlsext_cb_arg = t;
-    }
-    conn_tlstor->init_time = elapsed_time_msec(init_time);
-
-#ifdef USE_PTHREAD
-    pthread_t conn_thread;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
-    int err;
-    if ((err=pthread_create(&conn_thread, &attr, conn_handler, (void*)conn_tlstor))) {
-      log_msg(LGG_ERR, "Failed to create conn_handler thread. err: %d", err);
-      if(conn_tlstor->ssl){
-        SSL_set_shutdown(conn_tlstor->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
-        SSL_free(conn_tlstor->ssl);
-        SSL_CTX_free((SSL_CTX*)conn_tlstor->tlsext_cb_arg->sslctx);
-        free(conn_tlstor->tlsext_cb_arg);
+          }
+          /* fall through */
+        case ADM_SHED_IDLE:
+          // parked pool threads are woken up to make room
+          conn_timer_shed_idle(1);
+          break;
+        default:
+          break;
       }
-      shutdown(new_fd, SHUT_RDWR);
-      close(new_fd);
-      continue;
-    }
-#else
-    if (fork() == 0) {
-      // detach child from signal handler
-      signal(SIGTERM, SIG_DFL); // default is kill?
-      signal(SIGUSR1, SIG_DFL); // default is ignore?
-#ifdef DEBUG
-      signal(SIGUSR2, SIG_DFL); // default is ignore?
-#endif
-      // close unneeded file handles inherited from the parent process
-      close(sockfd);
 
-      // note that only the read end is closed
-      // even main() should leave the write end open so that children can
-      //  inherit it
-      close(pipefd[0]);
+      // counted before the handoff: whoever serves it may close it at once
+      stats_conn_open(tls);
+  #ifdef USE_PTHREAD
+      if (event_workers) {
+        char sni[PIXELSERV_MAX_SERVER_NAME + 1];
+        if (event_dispatch(conn_tlstor, (sni_route && tls
+              && tls_peek_sni(new_fd, sni, sizeof(sni)) > 0) ? sni : NULL) < 0) {
+          log_msg(LGG_ERR, "Failed to hand over connection to event worker");
+          stats_conn_close(tls);
+          ratelimit_close(conn_tlstor->client);
+          free(conn_tlstor);
+          shutdown(new_fd, SHUT_RDWR);
+          close(new_fd);
+          continue;
+        }
+        continue;
+      }
+      if (conn_pool_submit(conn_tlstor) < 0) {
+        log_msg(LGG_DEBUG, "Service thread pool queue full");
+        stats_conn_close(tls);
+        if (conn_tlstor->tls)
+          STATS_INC(sht);
+        else
+          STATS_INC(shh);
+        STATS_INC(clt);
+        admission_refuse(new_fd, conn_tlstor->tls);
+        ratelimit_close(conn_tlstor->client);
+        free(conn_tlstor);
+        continue;
+      }
+  #else
+      if (fork() == 0) {
+        // detach child from signal handler
+        signal(SIGTERM, SIG_DFL); // default is kill?
+        signal(SIGUSR1, SIG_DFL); // default is ignore?
+  #ifdef DEBUG
+        signal(SIGUSR2, SIG_DFL); // default is ignore?
+  #endif
+        affinity_apply(CPU_SERVE, -1);
+        // close unneeded file handles inherited from the parent process
+        close(sockfd);
 
-      conn_handler( (void*)conn_tlstor );
-      exit(0);
-    } // end of forked child process
+        // note that only the read end is closed
+        // even main() should leave the write end open so that children can
+        //  inherit it
+        close(pipefd[0]);
 
-    // this is guaranteed to be the parent process, as the child calls exit()
-    //  above when it's done instead of proceeding to this point
-    close(new_fd);  // parent doesn't need this
-    free(conn_tlstor);
-#endif // USE_PTHREAD
+        conn_handler( (void*)conn_tlstor );
+        exit(0);
+      } // end of forked child process
 
-    if (++kcc > kmx)
-      kmx = kcc;
+      // this is guaranteed to be the parent process, as the child calls exit()
+      //  above when it's done instead of proceeding to this point
+      close(new_fd);  // parent doesn't need this
+      free(conn_tlstor);
+  #endif // USE_PTHREAD
+    }
+    stats_accept_batch(batch);
 
     // reap any zombie child processes that have exited
     // irony note: I wrote this while watching The Walking Dead :p
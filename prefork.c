@@ -0,0 +1,285 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "prefork.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "affinity.h"
+#include "certs.h"
+#include "socket_handler.h"
+#include "stats.h"
+#include "logger.h"
+#include "probes.h"
+
+#ifndef USE_PTHREAD
+
+/*
+ * Pool of pre-forked worker processes for builds without thread support.
+ * Each worker polls the listeners, accepts one connection at a time and
+ * serves it with conn_handler, reporting to main() over the stats pipe just
+ * as service threads do. main() keeps at least min_procs workers and starts
+ * another whenever none is left idle, up to max_procs. Workers above
+ * min_procs exit after idle_timeout secs without a connection.
+ */
+
+#define BUSY_HTTP 1
+#define BUSY_TLS  2
+
+typedef struct {
+  int procs;                    /* live workers */
+  int generation;               /* workers of an older one leave */
+  char busy[];                  /* per slot: BUSY_HTTP, BUSY_TLS or 0 if idle */
+} prefork_shm_struct;
+
+extern struct Global *g;
+extern int tls_ports[];
+extern int num_tls_ports;
+
+static prefork_shm_struct *shm = NULL;
+static pid_t *pids = NULL;      /* main() only: worker in each slot */
+static int listen_fds[MAX_PORTS];
+static int num_listen_fds = 0;
+static int min_procs = 0;
+static int max_procs = 0;
+static int idle_timeout = 0;
+static int draining = 0;        /* main() only: start no more workers */
+static volatile sig_atomic_t child_exited = 0;
+
+static void sigchld_handler(int sig) {
+  child_exited = 1;
+}
+
+/* leave the pool unless that would take it below min_procs */
+static int prefork_retire(void) {
+  int n = __atomic_load_n(&shm->procs, __ATOMIC_RELAXED);
+
+  while (n > min_procs)
+    if (__atomic_compare_exchange_n(&shm->procs, &n, n - 1, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+static void prefork_serve(int slot, int lfd) {
+  response_struct pipedata = {0};
+  struct timespec init_time = {0, 0};
+  conn_tlstor_struct *conn_tlstor;
+  int fd;
+
+  get_time(&init_time);
+  // with several workers polling, another one may have got it first
+  if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      log_msg(LGG_DEBUG, "accept: %m");
+    return;
+  }
+  if (!(conn_tlstor = malloc(sizeof(conn_tlstor_struct)))) {
+    log_msg(LGG_ERR, "Failed to allocate connection in worker process");
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    return;
+  }
+  conn_tlstor->new_fd = fd;
+  conn_tlstor->ssl = NULL;
+  conn_tlstor->tlsext_cb_arg = NULL;
+  conn_tlstor->tls = is_ssl_conn(fd, conn_tlstor->server_ip, INET6_ADDRSTRLEN, tls_ports, num_tls_ports);
+  conn_tlstor->init_time = elapsed_time_msec(init_time);
+  conn_tlstor->accept_time = init_time;
+  PROBE2(accept, fd, conn_tlstor->tls);
+
+  stats_shm_load();
+  pipedata.tls = conn_tlstor->tls;
+  if ((pipedata.rate = ratelimit_conn(fd, &conn_tlstor->client)) != RATE_OK) {
+    pipedata.status = ACTION_RATE;
+    stats_report(&pipedata);
+    admission_refuse(fd, conn_tlstor->tls);
+    free(conn_tlstor);
+    return;
+  }
+  if (admission_over_quota(conn_tlstor->tls)) {
+    pipedata.status = ACTION_QUOTA;
+    stats_report(&pipedata);
+    admission_refuse(fd, conn_tlstor->tls);
+    ratelimit_close(conn_tlstor->client);
+    free(conn_tlstor);
+    return;
+  }
+  shm->busy[slot] = (conn_tlstor->tls) ? BUSY_TLS : BUSY_HTTP;
+  pipedata.status = ACTION_INC_KCC;
+  stats_report(&pipedata);
+  conn_handler((void*)conn_tlstor);
+  shm->busy[slot] = 0;
+}
+
+static void prefork_worker(int slot) {
+  struct pollfd pfds[MAX_PORTS];
+  struct timespec idle_since;
+  int generation = shm->generation;
+  int i, rv;
+
+  // don't outlive main()
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGUSR1, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+#ifdef DEBUG
+  signal(SIGUSR2, SIG_DFL);
+#endif
+  if (getppid() == 1)
+    exit(0);
+  affinity_apply(CPU_SERVE, -1);
+
+  for (i = 0; i < num_listen_fds; i++) {
+    pfds[i].fd = listen_fds[i];
+    pfds[i].events = POLLIN;
+  }
+  get_time(&idle_since);
+  for (;;) {
+    rv = poll(pfds, num_listen_fds, PREFORK_CHECK_SECS * 1000);
+    if (__atomic_load_n(&shm->generation, __ATOMIC_RELAXED) != generation) {
+      __atomic_sub_fetch(&shm->procs, 1, __ATOMIC_RELAXED);
+      exit(0);
+    }
+    for (i = 0; rv > 0 && i < num_listen_fds; i++)
+      if (pfds[i].revents & POLLIN) {
+        prefork_serve(slot, pfds[i].fd);
+        get_time(&idle_since);
+        break;
+      }
+    if (elapsed_time_msec(idle_since) >= idle_timeout * 1000 && prefork_retire()) {
+      log_msg(LGG_DEBUG, "worker process exits after %d secs idle", idle_timeout);
+      exit(0);
+    }
+  }
+}
+
+/* fork one more worker. returns 0 on success, -1 if at max_procs or on error */
+static int prefork_spawn(void) {
+  pid_t pid;
+  int slot;
+
+  for (slot = 0; slot < max_procs && pids[slot]; slot++)
+    ;
+  if (slot == max_procs)
+    return -1;
+  shm->busy[slot] = 0;
+  __atomic_add_fetch(&shm->procs, 1, __ATOMIC_RELAXED);
+  if ((pid = fork()) < 0) {
+    __atomic_sub_fetch(&shm->procs, 1, __ATOMIC_RELAXED);
+    log_msg(LGG_ERR, "Failed to fork worker process: %m");
+    return -1;
+  }
+  if (pid == 0)
+    prefork_worker(slot); // never returns
+  pids[slot] = pid;
+  return 0;
+}
+
+int prefork_init(int *lfds, int num_fds, int min, int max, int timeout) {
+  struct sigaction sa;
+  int i;
+
+  if (max < 1 || num_fds < 1 || num_fds > MAX_PORTS)
+    return -1;
+  max_procs = max;
+  min_procs = (min < max) ? min : max;
+  idle_timeout = timeout;
+  memcpy(listen_fds, lfds, num_fds * sizeof(int));
+  num_listen_fds = num_fds;
+
+  shm = mmap(NULL, sizeof(prefork_shm_struct) + max_procs, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED) {
+    shm = NULL;
+    return -1;
+  }
+  if (!(pids = calloc(max_procs, sizeof(pid_t))) || stats_shm_init() < 0) {
+    munmap(shm, sizeof(prefork_shm_struct) + max_procs);
+    shm = NULL;
+    free(pids);
+    return -1;
+  }
+
+  // exited workers need to be reaped to be accounted for
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  for (i = 0; i < min_procs; i++)
+    if (prefork_spawn() < 0)
+      break;
+  prefork_check();
+  log_msg(LGG_NOTICE, "Started %d of max %d worker processes", shm->procs, max_procs);
+  return 0;
+}
+
+void prefork_check(void) {
+  pid_t pid;
+  int status, slot;
+
+  if (!shm)
+    return;
+  while (child_exited) {
+    child_exited = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (slot = 0; slot < max_procs && pids[slot] != pid; slot++)
+        ;
+      if (slot == max_procs)
+        continue; // not a worker, e.g. the cert generator
+      pids[slot] = 0;
+      // a worker leaving on its own has already given up its place
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        continue;
+      log_msg(LGG_WARNING, "worker process %d died, status: %d", pid, status);
+      __atomic_sub_fetch(&shm->procs, 1, __ATOMIC_RELAXED);
+      if (shm->busy[slot]) {
+        stats_conn_close(shm->busy[slot] == BUSY_TLS);
+        shm->busy[slot] = 0;
+      }
+    }
+  }
+
+  if (draining)
+    goto account;
+  // keep min_procs around and one idle worker for the next connection
+  while (shm->procs < min_procs || (shm->procs <= kcc && shm->procs < max_procs))
+    if (prefork_spawn() < 0)
+      break;
+
+account:
+  pln = shm->procs;
+  plb = (kcc < pln) ? kcc : pln;
+  if (pln > plx)
+    plx = pln;
+}
+
+void prefork_recycle(void) {
+  int i;
+
+  if (!shm)
+    return;
+  __atomic_add_fetch(&shm->generation, 1, __ATOMIC_RELAXED);
+  // the new ones are there before the old ones notice
+  for (i = 0; i < min_procs; i++)
+    if (prefork_spawn() < 0)
+      break;
+}
+
+int prefork_workers(void) {
+  return (shm) ? __atomic_load_n(&shm->procs, __ATOMIC_RELAXED) : 0;
+}
+
+void prefork_drain(void) {
+  if (!shm)
+    return;
+  draining = 1;
+  __atomic_add_fetch(&shm->generation, 1, __ATOMIC_RELAXED);
+}
+
+#endif // !USE_PTHREAD
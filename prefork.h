@@ -0,0 +1,27 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#define PREFORK_CHECK_SECS  1        /* housekeeping interval of main() */
+
+// fork min_procs worker processes that accept on the num_fds listeners in
+// lfds and serve each connection with conn_handler. workers are added on
+// demand up to max_procs; those above min_procs exit after idle_timeout
+// secs without a connection. returns 0 on success
+int prefork_init(int *lfds, int num_fds, int min_procs, int max_procs, int idle_timeout);
+
+// reap exited workers and start new ones as needed. called by main() after
+// stats updates and every PREFORK_CHECK_SECS
+void prefork_check(void);
+
+// replace all workers with ones forked from main() as it is now, e.g. after
+// a reload. busy workers leave once done with their connection
+void prefork_recycle(void);
+
+// stop accepting: workers leave once done with their connection and no new
+// ones are started
+void prefork_drain(void);
+
+// number of live workers
+int prefork_workers(void);
+
+#endif // PREFORK_H
@@ -0,0 +1,42 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT static probes for bpftrace, perf and other tracers, provider
+ * "pixelserv". Each is a nop in the code and a note in the binary telling
+ * a tracer where it is and where to find its arguments, so it costs
+ * nothing until one attaches. Built where SystemTap's <sys/sdt.h> is
+ * around, unless NO_PROBES is defined; otherwise probes compile to nothing
+ * and their arguments are not even evaluated, so keep them free of side
+ * effects.
+ *
+ *   accept          fd, tls          connection accepted
+ *   handshake       fd, ok, ssl      TLS handshake over, ssl_enum status
+ *   sni_hit         name             certificate for the server name loaded
+ *   sni_miss        name             none yet for the server name
+ *   cert_enqueue    file             its generation requested
+ *   cert_gen_start  file             generation begun by cert_generator
+ *   cert_gen_done   file             and over
+ *   request_read    fd, len          request in, len <= 0 on EOF or error
+ *   response        fd, status       response_enum selected
+ *   response_sent   fd, len          response written, len < 0 on error
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_PROBES
+# endif
+#endif
+
+#ifdef HAVE_PROBES
+# define PROBE1(name, a)        STAP_PROBE1(pixelserv, name, a)
+# define PROBE2(name, a, b)     STAP_PROBE2(pixelserv, name, a, b)
+# define PROBE3(name, a, b, c)  STAP_PROBE3(pixelserv, name, a, b, c)
+#else
+# define PROBE1(name, a)        do {} while (0)
+# define PROBE2(name, a, b)     do {} while (0)
+# define PROBE3(name, a, b, c)  do {} while (0)
+#endif
+
+#endif // PROBES_H
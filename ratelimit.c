@@ -0,0 +1,252 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "ratelimit.h"
+#include "logger.h"
+
+/*
+ * Per client IP token buckets for new connections and requests, plus a
+ * count of open connections. Clients live in a fixed table of buckets of
+ * CLIENT_WAYS entries each, so memory stays the same however many clients
+ * come and go: a new client takes a free entry of its bucket or, clock
+ * style, the first one not used since the bucket's hand last passed it.
+ * Entries with open connections are never taken; a client finding none to
+ * take simply goes untracked. The table is shared memory, so pre-forked
+ * worker processes see the same buckets; each bucket has a spin lock held
+ * for a few loads and stores only.
+ */
+
+typedef struct {
+  unsigned char addr[16];       /* IPv6, or IPv4 mapped */
+  unsigned long stamp;          /* msec tokens were last added */
+  float conn_tokens;
+  float req_tokens;
+  int conns;                    /* open connections */
+  int rejects;                  /* connections and requests refused */
+  unsigned char used;
+  unsigned char ref;            /* used since the hand passed */
+} client_struct;
+
+typedef struct {
+  char lock;
+  unsigned char hand;
+  client_struct ways[CLIENT_WAYS];
+} bucket_struct;
+
+static bucket_struct *table = NULL;
+static int conn_rate = 0;
+static int req_rate = 0;
+static int max_conns = 0;
+
+static unsigned long now_msec(void) {
+  struct timespec ts;
+  get_time(&ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void bucket_lock(bucket_struct *b) {
+  while (__atomic_test_and_set(&b->lock, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void bucket_unlock(bucket_struct *b) {
+  __atomic_clear(&b->lock, __ATOMIC_RELEASE);
+}
+
+int ratelimit_init(const char *spec) {
+  if (sscanf(spec, "%d:%d:%d", &conn_rate, &req_rate, &max_conns) != 3
+      || conn_rate < 0 || req_rate < 0 || max_conns < 0)
+    return -1;
+  if ((!conn_rate && !req_rate && !max_conns) || table)
+    return 0;
+  table = mmap(NULL, CLIENT_BUCKETS * sizeof(bucket_struct), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    table = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* client of fd as an IPv6 address. returns 0 on success */
+static int client_addr(int fd, unsigned char *addr) {
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+
+  if (getpeername(fd, (struct sockaddr*)&sa, &len) < 0)
+    return -1;
+  if (sa.ss_family == AF_INET6) {
+    memcpy(addr, &((struct sockaddr_in6*)&sa)->sin6_addr, 16);
+    return 0;
+  }
+  if (sa.ss_family == AF_INET) {
+    memset(addr, 0, 10);
+    addr[10] = addr[11] = 0xff;
+    memcpy(addr + 12, &((struct sockaddr_in*)&sa)->sin_addr, 4);
+    return 0;
+  }
+  return -1;
+}
+
+static unsigned int addr_bucket(const unsigned char *addr) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    h = (h ^ addr[i]) * 16777619u;
+  return h & (CLIENT_BUCKETS - 1);
+}
+
+/* the entry of addr, taking one for it if new. bucket locked */
+static client_struct *client_get(bucket_struct *b, const unsigned char *addr, unsigned long now) {
+  client_struct *c;
+  int i, step;
+
+  for (i = 0; i < CLIENT_WAYS; i++)
+    if (b->ways[i].used && !memcmp(b->ways[i].addr, addr, 16))
+      return &b->ways[i];
+  for (i = 0; i < CLIENT_WAYS && b->ways[i].used; i++)
+    ;
+  // second chance for entries used since the hand last passed. two full
+  // rounds from wherever the hand is: the first may only clear references
+  for (step = 0; i == CLIENT_WAYS && step < 2 * CLIENT_WAYS; step++) {
+    c = &b->ways[b->hand];
+    b->hand = (b->hand + 1) % CLIENT_WAYS;
+    if (c->conns)
+      continue;
+    if (c->ref) {
+      c->ref = 0;
+      continue;
+    }
+    i = c - b->ways;
+  }
+  if (i == CLIENT_WAYS)
+    return NULL;
+  c = &b->ways[i];
+  memcpy(c->addr, addr, 16);
+  c->stamp = now;
+  c->conn_tokens = conn_rate;
+  c->req_tokens = req_rate;
+  c->conns = 0;
+  c->rejects = 0;
+  c->used = 1;
+  return c;
+}
+
+static void client_refill(client_struct *c, unsigned long now) {
+  float secs = (now - c->stamp) / 1000.0;
+
+  c->stamp = now;
+  c->ref = 1;
+  // a burst of up to one second's worth
+  c->conn_tokens += secs * conn_rate;
+  if (c->conn_tokens > conn_rate)
+    c->conn_tokens = conn_rate;
+  c->req_tokens += secs * req_rate;
+  if (c->req_tokens > req_rate)
+    c->req_tokens = req_rate;
+}
+
+rate_enum ratelimit_conn(int fd, int *client) {
+  unsigned char addr[16];
+  unsigned long now;
+  bucket_struct *b;
+  client_struct *c;
+  rate_enum rv = RATE_OK;
+
+  *client = 0;
+  if (!table || client_addr(fd, addr) < 0)
+    return RATE_OK;
+  now = now_msec();
+  b = &table[addr_bucket(addr)];
+  bucket_lock(b);
+  if ((c = client_get(b, addr, now))) {
+    client_refill(c, now);
+    if (conn_rate && c->conn_tokens < 1.0)
+      rv = RATE_CONN;
+    else if (max_conns && c->conns >= max_conns)
+      rv = RATE_CONNS;
+    if (rv == RATE_OK) {
+      c->conn_tokens -= 1.0;
+      c->conns++;
+      *client = (b - table) * CLIENT_WAYS + (c - b->ways) + 1;
+    } else
+      c->rejects++;
+  }
+  bucket_unlock(b);
+  return rv;
+}
+
+void ratelimit_close(int client) {
+  bucket_struct *b;
+
+  if (!client--)
+    return;
+  b = &table[client / CLIENT_WAYS];
+  bucket_lock(b);
+  b->ways[client % CLIENT_WAYS].conns--;
+  bucket_unlock(b);
+}
+
+rate_enum ratelimit_request(int client) {
+  client_struct *c;
+  bucket_struct *b;
+  rate_enum rv = RATE_OK;
+
+  if (!client-- || !req_rate)
+    return RATE_OK;
+  b = &table[client / CLIENT_WAYS];
+  c = &b->ways[client % CLIENT_WAYS];
+  bucket_lock(b);
+  client_refill(c, now_msec());
+  if (c->req_tokens < 1.0) {
+    c->rejects++;
+    rv = RATE_REQ;
+  } else
+    c->req_tokens -= 1.0;
+  bucket_unlock(b);
+  return rv;
+}
+
+char *ratelimit_top(int html) {
+  struct {
+    unsigned char addr[16];
+    int rejects;
+  } top[RATE_TOP] = {{{0}, 0}};
+  char ip[INET6_ADDRSTRLEN], *rows, *p;
+  int i, j, k, n;
+
+  if (!(rows = calloc(RATE_TOP, 128)))
+    return NULL;
+  if (!table)
+    return rows;
+  // no locks: this also runs from main()'s signal handler, and a client
+  // changing under our feet only garbles its own line
+  for (i = 0; i < CLIENT_BUCKETS; i++) {
+    for (j = 0; j < CLIENT_WAYS; j++) {
+      client_struct *c = &table[i].ways[j];
+      if (!c->used || c->rejects <= top[RATE_TOP - 1].rejects)
+        continue;
+      for (k = RATE_TOP - 1; k > 0 && c->rejects > top[k - 1].rejects; k--)
+        top[k] = top[k - 1];
+      memcpy(top[k].addr, c->addr, 16);
+      top[k].rejects = c->rejects;
+    }
+  }
+  for (i = 0, p = rows; i < RATE_TOP && top[i].rejects; i++) {
+    static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+    if (!memcmp(top[i].addr, v4mapped, 12))
+      inet_ntop(AF_INET, top[i].addr + 12, ip, sizeof(ip));
+    else
+      inet_ntop(AF_INET6, top[i].addr, ip, sizeof(ip));
+    if (html)
+      n = snprintf(p, 128, "<tr><td>rl%d</td><td>%s</td><td>%d connections and requests refused</td></tr>", i + 1, ip, top[i].rejects);
+    else
+      n = snprintf(p, 128, ", %s/%d rl%d", ip, top[i].rejects, i + 1);
+    p += (n < 128) ? n : 127;
+  }
+  return rows;
+}
@@ -0,0 +1,35 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#define CLIENT_WAYS         8        /* clients per bucket */
+#define CLIENT_BUCKETS      1024     /* power of 2 */
+#define RATE_TOP            5        /* offenders listed on the stats page */
+
+typedef enum {
+  RATE_OK,
+  RATE_CONN,                    /* new connections per second */
+  RATE_CONNS,                   /* open connections */
+  RATE_REQ                      /* requests per second */
+} rate_enum;
+
+// limits per client IP, as "CONNS_PER_SEC:REQS_PER_SEC:MAX_CONNS" with 0
+// for no limit. must be called before any worker is started. returns 0 on
+// success, -1 if spec is malformed or the table cannot be allocated
+int ratelimit_init(const char *spec);
+
+// account a new connection on fd against its client. on RATE_OK *client
+// is set for the calls below, 0 if the client is not tracked. otherwise
+// the connection is to be refused
+rate_enum ratelimit_conn(int fd, int *client);
+
+// the connection of client is closed
+void ratelimit_close(int client);
+
+// take a request of client from its budget. returns RATE_OK or RATE_REQ
+rate_enum ratelimit_request(int client);
+
+// the clients refused most, as table rows (html) or ", IP/REFUSED rlN" items
+// to append to the text stats. free() the result
+char *ratelimit_top(int html);
+
+#endif // RATELIMIT_H
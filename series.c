@@ -0,0 +1,282 @@
+#include "util.h" // _GNU_SOURCE
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#include <sys/mman.h>
+
+#include "series.h"
+#include "stats.h"
+#include "logger.h"
+
+/*
+ * Time series of the request counters, per second over the last hour and
+ * per minute over the last day, for the spikes which the lifetime totals
+ * of the stats pages average away. Once a second the counters of all
+ * threads are added up, scalars and one latency histogram each, which is
+ * a fraction of a full stats_collect(). What changed since the second
+ * before goes into the slot of this second and is added to the slot of
+ * this minute. Slots are indexed by clock second, so a reader tells those
+ * filled without locking: anything newer than the last second filled, or
+ * older than the ring, counts as nothing. With USE_PTHREAD a thread of its
+ * own fills the slots; without, main() does in its loop, which wakes for
+ * every count reported anyway. Slots are in shared memory for pre-forked
+ * workers to read.
+ */
+
+#define SPARK_WIDTH   240       /* pixels of a sparkline */
+#define SPARK_HEIGHT  16
+
+typedef struct {
+  unsigned int v[SERIES_NUM];   /* change over the slot */
+  float p50, p90, p99;          /* latency of requests served in it, msec */
+} series_slot_struct;
+
+typedef struct {
+  time_t sec;                   /* last second filled */
+  series_slot_struct secs[SERIES_SECS];
+  series_slot_struct mins[SERIES_MINS];
+} series_struct;
+
+static const char *names[SERIES_NUM] = {
+#define X(c, name) name,
+  SERIES_COUNTERS(X)
+#undef X
+};
+
+static series_struct *series = NULL;
+// the filler's own: totals as of the last second, latency of this minute
+static unsigned int last[SERIES_NUM];
+static unsigned int last_lat[LAT_BUCKETS];
+static unsigned int min_lat[LAT_BUCKETS];
+
+static void slot_latency(series_slot_struct *slot, const unsigned int *h) {
+  unsigned int n = 0;
+  int i;
+
+  for (i = 0; i < LAT_BUCKETS; i++)
+    n += h[i];
+  if (!n) {
+    slot->p50 = slot->p90 = slot->p99 = 0.0;
+    return;
+  }
+  slot->p50 = stats_lat_quantile(h, n, 0.5);
+  slot->p90 = stats_lat_quantile(h, n, 0.9);
+  slot->p99 = stats_lat_quantile(h, n, 0.99);
+}
+
+void series_tick(void) {
+  unsigned int cur[SERIES_NUM], lat[LAT_BUCKETS], v;
+  series_slot_struct *slot, *min;
+  struct timespec now;
+  time_t s, m;
+  int i;
+
+  if (!series)
+    return;
+  get_time(&now);
+  if (now.tv_sec <= series->sec)
+    return;
+  stats_series_sample(cur, lat);
+
+  // nothing was counted in seconds and minutes skipped, if any
+  s = series->sec + 1;
+  if (s < now.tv_sec - SERIES_SECS)
+    s = now.tv_sec - SERIES_SECS;
+  for (; s < now.tv_sec; s++)
+    memset(&series->secs[s % SERIES_SECS], 0, sizeof(series_slot_struct));
+  m = series->sec / 60;
+  if (m < now.tv_sec / 60) {
+    if (++m < now.tv_sec / 60 - SERIES_MINS)
+      m = now.tv_sec / 60 - SERIES_MINS;
+    for (; m <= now.tv_sec / 60; m++)
+      memset(&series->mins[m % SERIES_MINS], 0, sizeof(series_slot_struct));
+    memset(min_lat, 0, sizeof(min_lat));
+  }
+
+  slot = &series->secs[now.tv_sec % SERIES_SECS];
+  min = &series->mins[(now.tv_sec / 60) % SERIES_MINS];
+  for (i = 0; i < SERIES_NUM; i++) {
+    slot->v[i] = cur[i] - last[i];
+    min->v[i] += slot->v[i];
+    last[i] = cur[i];
+  }
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    v = lat[i];
+    lat[i] -= last_lat[i];
+    min_lat[i] += lat[i];
+    last_lat[i] = v;
+  }
+  slot_latency(slot, lat);
+  slot_latency(min, min_lat);
+  __atomic_store_n(&series->sec, now.tv_sec, __ATOMIC_RELEASE);
+}
+
+#ifdef USE_PTHREAD
+static void *series_thread(void *arg) {
+  struct timespec now, ts;
+  long nsec;
+
+  for (;;) {
+    // just past the next second
+    get_time(&now);
+    nsec = 1001000000L - now.tv_nsec;
+    ts.tv_sec = nsec / 1000000000L;
+    ts.tv_nsec = nsec % 1000000000L;
+    nanosleep(&ts, NULL);
+    series_tick();
+  }
+  return NULL;
+}
+#endif
+
+int series_init(size_t stack_size) {
+  struct timespec now;
+#ifdef USE_PTHREAD
+  pthread_attr_t attr;
+  pthread_t thread;
+  int err;
+#endif
+
+  series = mmap(NULL, sizeof(series_struct), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (series == MAP_FAILED) {
+    series = NULL;
+    return -1;
+  }
+  get_time(&now);
+  series->sec = now.tv_sec;
+  // the first slots get what is counted from now on, not since startup
+  stats_series_sample(last, last_lat);
+#ifdef USE_PTHREAD
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, stack_size);
+  if ((err = pthread_create(&thread, &attr, series_thread, NULL))) {
+    log_msg(LGG_ERR, "Failed to create time series thread. err: %d", err);
+    munmap(series, sizeof(series_struct));
+    series = NULL;
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/* slot of second s, or NULL if not filled. the clock may start at 0 */
+static const series_slot_struct *sec_slot(time_t s, time_t filled) {
+  if (s < 0 || s > filled || s <= filled - SERIES_SECS)
+    return NULL;
+  return &series->secs[s % SERIES_SECS];
+}
+
+/* slot of minute m, or NULL if not filled */
+static const series_slot_struct *min_slot(time_t m, time_t filled) {
+  if (m < 0 || m > filled / 60 || m <= filled / 60 - SERIES_MINS)
+    return NULL;
+  return &series->mins[m % SERIES_MINS];
+}
+
+/* points scaled to the highest as an inline SVG, drawn oldest first */
+static int sparkline(strbuf_struct *sb, const float *v, int n) {
+  float max = 0.0;
+  int i, rv;
+
+  for (i = 0; i < n; i++)
+    if (v[i] > max)
+      max = v[i];
+  rv = strbuf_printf(sb, " <svg width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" preserveAspectRatio=\"none\">"
+      "<polyline fill=\"none\" stroke=\"#4a7\" vector-effect=\"non-scaling-stroke\" points=\"",
+      SPARK_WIDTH, SPARK_HEIGHT, n - 1, SPARK_HEIGHT);
+  for (i = 0; i < n; i++)
+    rv |= strbuf_printf(sb, "%d,%d ", i, SPARK_HEIGHT - ((max > 0.0) ? (int)(v[i] * SPARK_HEIGHT / max + 0.5) : 0));
+  return rv | strbuf_printf(sb, "\"/></svg>");
+}
+
+/* the last SERIES_SPARK_SECS seconds and the last day of counter i, or of
+   the p99 latency if i is SERIES_NUM, as sparklines */
+static int sparklines(strbuf_struct *sb, int i, time_t now, time_t filled) {
+  float secs[SERIES_SPARK_SECS], mins[SERIES_MINS / SERIES_SPARK_STEP];
+  const series_slot_struct *slot;
+  int k, j;
+
+  for (k = 0; k < SERIES_SPARK_SECS; k++) {
+    slot = sec_slot(now - SERIES_SPARK_SECS + 1 + k, filled);
+    secs[k] = (!slot) ? 0.0 : (i < SERIES_NUM) ? slot->v[i] : slot->p99;
+  }
+  // the sum of each step, or the highest latency
+  for (k = 0; k < SERIES_MINS / SERIES_SPARK_STEP; k++) {
+    mins[k] = 0.0;
+    for (j = 0; j < SERIES_SPARK_STEP; j++) {
+      slot = min_slot(now / 60 - SERIES_MINS + 1 + k * SERIES_SPARK_STEP + j, filled);
+      if (!slot)
+        continue;
+      if (i < SERIES_NUM)
+        mins[k] += slot->v[i];
+      else if (slot->p99 > mins[k])
+        mins[k] = slot->p99;
+    }
+  }
+  return sparkline(sb, secs, SERIES_SPARK_SECS) | sparkline(sb, mins, SERIES_MINS / SERIES_SPARK_STEP);
+}
+
+char *series_stats(int html) {
+  unsigned int sec[SERIES_NUM] = {0}, min[SERIES_NUM] = {0};
+  unsigned int hour[SERIES_NUM] = {0}, day[SERIES_NUM] = {0};
+  const series_slot_struct *slot, *lat;
+  strbuf_struct sb = {0};
+  struct timespec now;
+  time_t filled, s;
+  int i, rv = 0;
+
+  if (!series)
+    return NULL;
+  get_time(&now);
+  filled = __atomic_load_n(&series->sec, __ATOMIC_ACQUIRE);
+  for (s = now.tv_sec - SERIES_SECS + 1; s <= now.tv_sec; s++) {
+    if (!(slot = sec_slot(s, filled)))
+      continue;
+    for (i = 0; i < SERIES_NUM; i++) {
+      hour[i] += slot->v[i];
+      if (s > now.tv_sec - 60)
+        min[i] += slot->v[i];
+      if (s == now.tv_sec)
+        sec[i] = slot->v[i];
+    }
+  }
+  for (s = now.tv_sec / 60 - SERIES_MINS + 1; s <= now.tv_sec / 60; s++)
+    if ((slot = min_slot(s, filled)))
+      for (i = 0; i < SERIES_NUM; i++)
+        day[i] += slot->v[i];
+  // latency of the last whole minute
+  lat = min_slot(now.tv_sec / 60 - 1, filled);
+  if (lat && lat->p99 <= 0.0)
+    lat = NULL;
+
+  if (html && (day[SERIES_count] || lat))
+    rv |= strbuf_printf(&sb, "<tr><th colspan=\"3\"></th></tr>");
+  for (i = 0; i < SERIES_NUM; i++) {
+    if (!day[i])
+      continue;
+    if (html) {
+      rv |= strbuf_printf(&sb, "<tr><td>ts%s</td><td>%u / %u / %u / %u</td><td>%s in the last second / minute / hour / day; last %d secs, last day:",
+          names[i], sec[i], min[i], hour[i], day[i], names[i], SERIES_SPARK_SECS);
+      rv |= sparklines(&sb, i, now.tv_sec, filled);
+      rv |= strbuf_printf(&sb, "</td></tr>");
+    } else
+      rv |= strbuf_printf(&sb, ", %u/%u/%u/%u ts%s", sec[i], min[i], hour[i], day[i], names[i]);
+  }
+  if (lat) {
+    if (html) {
+      rv |= strbuf_printf(&sb, "<tr><td>tslat</td><td>%.2f / %.2f / %.2f ms</td><td>p50 / p90 / p99 request served in the last whole minute; p99 last %d secs, last day:",
+          lat->p50, lat->p90, lat->p99, SERIES_SPARK_SECS);
+      rv |= sparklines(&sb, SERIES_NUM, now.tv_sec, filled);
+      rv |= strbuf_printf(&sb, "</td></tr>");
+    } else
+      rv |= strbuf_printf(&sb, ", %.2f/%.2f/%.2f tslat", lat->p50, lat->p90, lat->p99);
+  }
+  if (rv < 0) {
+    free(sb.buf);
+    return NULL;
+  }
+  return sb.buf;
+}
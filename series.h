@@ -0,0 +1,41 @@
+#ifndef SERIES_H
+#define SERIES_H
+
+#include <stddef.h>
+
+#define SERIES_SECS         3600     /* one second slots: the last hour */
+#define SERIES_MINS         1440     /* one minute slots: the last day */
+#define SERIES_SPARK_SECS   120      /* seconds drawn on the stats page */
+#define SERIES_SPARK_STEP   10       /* minutes per point drawn */
+
+/* counters kept per slot, with their names on the stats pages */
+#define SERIES_COUNTERS(X) \
+  X(count, "req") X(gif, "gif") X(ico, "ico") X(txt, "txt") X(jpg, "jpg") \
+  X(png, "png") X(swf, "swf") X(sta, "sta") X(stt, "stt") X(stm, "stm") \
+  X(sse, "sse") X(trc, "trc") X(nfe, "nfe") X(ufe, "ufe") X(opt, "opt") \
+  X(pst, "pst") X(hed, "hed") X(rdr, "rdr") X(nou, "nou") X(pth, "pth") \
+  X(noc, "204") X(bad, "bad") X(rlr, "rlr") X(tmo, "tmo") X(cls, "cls") \
+  X(cly, "cly") X(err, "err") X(slh, "slh") X(slm, "slm") X(sle, "sle") \
+  X(slc, "slc") X(slu, "slu")
+
+enum {
+#define X(c, name) SERIES_##c,
+  SERIES_COUNTERS(X)
+#undef X
+  SERIES_NUM
+};
+
+// set up the slots, in memory pre-forked workers see as well. with
+// USE_PTHREAD a thread of stack_size fills them every second, otherwise
+// main() calls series_tick(). returns 0 on success
+int series_init(size_t stack_size);
+
+// fill the slots up to the current second, once per second at most
+void series_tick(void);
+
+// requests per second, minute, hour and day of each counter, and latency
+// percentiles of the last minute, as entries of the text stats or rows of
+// the HTML stats table, there with sparklines. to be freed
+char *series_stats(int html);
+
+#endif // SERIES_H
@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #ifdef USE_PTHREAD
   #include <pthread.h>
 #endif
@@ -10,6 +11,14 @@
 #include <openssl/err.h>
 
 #include "socket_handler.h"
+#include "stats.h"
+#include "conn_timer.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "feed.h"
+#include "hitters.h"
+#include "trace.h"
+#include "probes.h"
 #include "certs.h"
 #include "logger.h"
  
@@ -56,6 +65,23 @@
   static const char txtstats3[] =
   "\r\n";
 
+  // headers put in front of metrics once their length is known
+  static const char metricshdr[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+  "Content-length: %d\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+#define METRICS_HDR_MAX 160
+
+  // stats feed: events follow for as long as the connection stays open
+  static const char feedhdr[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-type: text/event-stream\r\n"
+  "Cache-Control: no-cache\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
   static const char httpredirect[] =
   "HTTP/1.1 307 Temporary Redirect\r\n"
   "Location: %s\r\n"
@@ -222,6 +248,14 @@
   "\x00\x00\x00\x00" // XOR B G R
   "\x80\xF8\x9C\x41"; // AND ?
 
+  // client over its rate limit (see ratelimit.c)
+  static const char http429[] =
+  "HTTP/1.1 429 Too Many Requests\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
   static const char httpoptions[] =
   "HTTP/1.1 200 OK\r\n"
   "Content-type: text/html\r\n"
@@ -358,30 +392,12 @@ void child_signal_handler(int sig)
 
   return;
 }
-
-#define TIME_CHECK(x) {\
-  if (do_warning) {\
-    do_warning = 0;\
-    double time_msec = 0.0;\
-    time_msec = elapsed_time_msec(start_time);\
-    if (time_msec > warning_time) {\
-      log_msg(LGG_DEBUG, "Elapsed time %f msec exceeded warning_time=%d msec following operation: %s", time_msec, warning_time, x);\
-    }\
-  }\
-}
-
-#define ELAPSED_TIME(op) {\
-    double time_msec = 0.0;\
-    time_msec = elapsed_time_msec(start_time);\
-    log_msg(LGG_DEBUG, "Elapsed time %f msec following operation: %s", time_msec, op);\
-}
-#else
-#define TIME_CHECK(x,y...)
-#define ELAPSED_TIME(x,y...)
 #endif //DEBUG
 
 extern struct Global *g;
-static struct timespec start_time = {0, 0};
+extern SSL_CTX *sslctx;
+extern const char *tls_pem;
+extern STACK_OF(X509_INFO) *cachain;
 
 static int peek_socket(int fd, SSL *ssl) {
   char buf[10];
@@ -395,33 +411,47 @@ static int peek_socket(int fd, SSL *ssl) {
   return rv;
 }
 
-static int read_socket(int fd, char **msg, SSL *ssl) {
+/* read a request into *msg (NUL terminated) until its headers are complete.
+   partial reads do not restart anything; the caller's connection timer is
+   the deadline for all of it */
+/* stamps TRACE_FIRST_BYTE in trace as the first bytes come in */
+static int read_socket(int fd, char **msg, SSL *ssl, unsigned int *trace, const struct timespec *base) {
   *msg = realloc(*msg, CHAR_BUF_SIZE + 1);
   if (!(*msg)) {
     log_msg(LGG_ERR, "Out of memory. Cannot malloc receiver buffer.");
     return -1;
   }
-  int i, rv, msg_len = 0;
-  char *bufptr = *msg;
-  for (i=1; i<=MAX_CHAR_BUF_LOTS;) { /* 128K max with CHAR_BUF_SIZE == 4K */
+  int i = 1, rv, msg_len = 0;
+  char *tmp;
+  for (;;) {
+    if (msg_len == CHAR_BUF_SIZE * i) {
+      if (i == MAX_CHAR_BUF_LOTS) /* 128K max with CHAR_BUF_SIZE == 4K */
+        break;
+      if (!(tmp = realloc(*msg, CHAR_BUF_SIZE * (i + 1) + 1))) {
+        log_msg(LGG_ERR, "Out of memory. Cannot realloc receiver buffer. Size: %d", CHAR_BUF_SIZE * (i + 1));
+        break; /* start processing with whatever we received already */
+      }
+      *msg = tmp;
+      ++i;
+      log_msg(LGG_DEBUG, "Realloc receiver buffer. Size: %d", CHAR_BUF_SIZE * i);
+    }
     if (!ssl)
-      rv = recv(fd, bufptr, CHAR_BUF_SIZE, 0);
+      rv = recv(fd, *msg + msg_len, CHAR_BUF_SIZE * i - msg_len, 0);
     else {
-      rv = SSL_read(ssl, (char *)bufptr, CHAR_BUF_SIZE);
+      rv = SSL_read(ssl, *msg + msg_len, CHAR_BUF_SIZE * i - msg_len);
       TESTPRINT("SSL handshake. errno: %d rv: %d\n", SSL_get_error(ssl, rv), rv);
     }
-    msg_len += rv;
-    if (rv < CHAR_BUF_SIZE)
+    if (rv <= 0) {
+      if (!msg_len)
+        return rv;
       break;
-    else {
-      ++i;
-      if (!(*msg = realloc(*msg, CHAR_BUF_SIZE * i + 1))) {
-          log_msg(LGG_ERR, "Out of memory. Cannot realloc receiver buffer. Size: %d", CHAR_BUF_SIZE * i);
-          return -1; /* start processing with whatever we received already */
-      }
-      log_msg(LGG_DEBUG, "Realloc receiver buffer. Size: %d", CHAR_BUF_SIZE * i);
-      bufptr = *msg + CHAR_BUF_SIZE * (i - 1);
     }
+    if (!msg_len)
+      trace_mark(trace, TRACE_FIRST_BYTE, base);
+    msg_len += rv;
+    (*msg)[msg_len] = '\0';
+    if (http_header_end(*msg, msg_len))
+      break;
   }
   TESTPRINT("read_socket. fd:%d msg_len:%d\n", fd, msg_len);
   return msg_len;
@@ -437,59 +467,464 @@ static int write_socket(int fd, const char *msg, int msg_len, SSL *ssl) {
   return rv;
 }
 
-static int write_pipe(int fd, response_struct *pipedata) {
-  // note that the parent must not perform a blocking pipe read without checking
-  // for available data, or else it may deadlock when we don't write anything
-  int rv = write(fd, pipedata, sizeof(*pipedata));
-  if (rv < 0) {
-    log_msg(LGG_ERR, "write() to pipe reported error: %m");
-  } else if (rv == 0) {
-    log_msg(LGG_ERR, "write() to pipe reported no data written and no error");
-  } else if (rv != sizeof(*pipedata)) {
-    log_msg(LGG_ERR, "write() to pipe reported writing only %d bytes of expected %u",
-        rv, (unsigned int)sizeof(*pipedata));
+/* a blank line ends the headers, with or without CRs, and so does the
+   request line of HTTP/0.9, which has neither version nor headers */
+int http_header_end(const char *buf, int len) {
+  const char *end = buf + len, *p = memchr(buf, '\n', len);
+
+  if (!p)
+    return 0;
+  if (!memmem(buf, p - buf, " HTTP/", 6))
+    return p + 1 - buf;
+  for (; p; p = memchr(p + 1, '\n', end - p - 1)) {
+    if (p + 1 < end && p[1] == '\n')
+      return p + 2 - buf;
+    if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+      return p + 3 - buf;
   }
-  return rv;
+  return 0;
 }
 
-void* conn_handler( void *ptr )
+int http_post_length(const char *buf) {
+  const char *h;
+
+  if (strncmp(buf, "POST ", 5) || !(h = strstr(buf, "Content-Length: ")))
+    return 0;
+  return atoi(h + strlen("Content-Length: "));
+}
+
+/* read the rest of a POST body behind the msg_len bytes already in *msg,
+   giving the client MAX_HTTP_POST_WAIT secs for all of it. content beyond
+   MAX_HTTP_POST_LEN is received but discarded.
+   returns the number of bytes kept in *msg, or -1 if the deadline passed */
+static int read_post_body(int fd, char **msg, int msg_len, SSL *ssl, response_struct *pipedata,
+                          conn_timer_struct *timer) {
+  char *body = strstr(*msg, "\r\n\r\n");
+  int length = http_post_length(*msg);
+  int hdr_len, recv_len, keep_len, rv;
+  char *tmp;
+
+  if (!body || length <= 0)
+    return msg_len;
+
+  hdr_len = body + 4 - *msg;
+  recv_len = msg_len - hdr_len;
+  keep_len = (length < MAX_HTTP_POST_LEN) ? length : MAX_HTTP_POST_LEN;
+  if (recv_len >= length)
+    return msg_len;
+
+  log_msg(LGG_DEBUG, "POST socket: %d Content-Length: %d expect length: %d", fd, length, length - recv_len);
+
+  /* room for the kept content plus one chunk to receive discarded bytes into */
+  if (!(tmp = realloc(*msg, hdr_len + keep_len + CHAR_BUF_SIZE + 1))) {
+    log_msg(LGG_ERR, "Out of memory. Cannot malloc receiver buffer.");
+    return msg_len;
+  }
+  *msg = tmp;
+
+  conn_timer_arm(timer, fd, MAX_HTTP_POST_WAIT);
+
+  /* caputre POST content */
+  while (recv_len < length) {
+    char *dst = *msg + hdr_len + recv_len;
+    int want = keep_len - recv_len;
+    if (recv_len >= keep_len) {
+      dst = *msg + hdr_len + keep_len;
+      want = (length - recv_len < CHAR_BUF_SIZE) ? length - recv_len : CHAR_BUF_SIZE;
+    }
+    errno = 0;
+    if (ssl) {
+      rv = SSL_read(ssl, dst, want);
+      TESTPRINT("SSL handshake. errno: %d rv: %d\n", SSL_get_error(ssl, rv), rv);
+    } else
+      rv = recv(fd, dst, want, MSG_WAITALL);
+
+    log_msg(LGG_DEBUG, "POST socket:%d recv length:%d; errno:%d", fd, rv, errno);
+    if (rv <= 0)
+      break;
+    pipedata->rx_total += rv;
+    recv_len += rv;
+  }
+  if (conn_timer_disarm(timer) && recv_len < length)
+    return -1;
+
+  if (recv_len > keep_len)
+    recv_len = keep_len;
+  (*msg)[hdr_len + recv_len] = '\0';
+  return hdr_len + recv_len;
+}
+
+/*
+ * Metrics are scraped often, so they are rendered into a buffer each thread
+ * keeps for the next time. It is lent to one response until that is sent;
+ * an event worker may get to another scrape meanwhile, which then has to
+ * make do with a buffer of its own in aspbuf.
+ */
+static __thread strbuf_struct metrics_buf = { NULL, 0, 0 };
+static __thread int metrics_lent = 0;
+
+static void send_metrics(http_req_struct *req) {
+  strbuf_struct heap = { NULL, 0, 0 };
+  strbuf_struct *sb = (metrics_lent) ? &heap : &metrics_buf;
+  char hdr[METRICS_HDR_MAX], *p;
+  int n;
+
+  // render after room for the headers, then put them right in front
+  sb->len = METRICS_HDR_MAX;
+  if (get_metrics(sb, 1) < 0) {
+    log_msg(LGG_ERR, "Out of memory. Cannot render metrics");
+    free(heap.buf);
+    return;
+  }
+  n = snprintf(hdr, sizeof(hdr), metricshdr, sb->len - METRICS_HDR_MAX);
+  p = sb->buf + METRICS_HDR_MAX - n;
+  memcpy(p, hdr, n);
+  req->response = p;
+  req->rsize = sb->len - METRICS_HDR_MAX + n;
+  if (sb == &heap)
+    req->aspbuf = heap.buf;
+  else
+    metrics_lent = req->metrics_lent = 1;
+}
+
+void response_done(http_req_struct *req) {
+  if (req->metrics_lent)
+    metrics_lent = req->metrics_lent = 0;
+  free(req->aspbuf);
+  req->aspbuf = NULL;
+}
+
+void process_request(http_req_struct *req, char *buf, int len, response_struct *pipedata, int fd)
 {
   int argc = GLOBAL(g, argc);
   char **argv = GLOBAL(g, argv);
-  const int new_fd = CONN_TLSTOR(ptr, new_fd);
-  const int pipefd = GLOBAL(g, pipefd);
   const char* const stats_url = GLOBAL(g, stats_url);
   const char* const stats_text_url = GLOBAL(g, stats_text_url);
+  const char* const metrics_url = GLOBAL(g, metrics_url);
+  const char* const feed_url = GLOBAL(g, feed_url);
+  const char* const trace_url = GLOBAL(g, trace_url);
   const int do_204 = GLOBAL(g, do_204);
   const int do_redirect = GLOBAL(g, do_redirect);
-#ifdef DEBUG
-  const int warning_time = GLOBAL(g, warning_time);
+  char *bufptr = NULL;
+  char *url = NULL;
+  char* version_string = NULL;
+  char* stat_string = NULL;
+
+  req->response = httpnulltext;
+  req->rsize = sizeof httpnulltext - 1;
+  req->post_buf = NULL;
+  req->post_buf_len = 0;
+  req->log_verbose = log_get_verb();
+
+#ifdef HEX_DUMP
+  hex_dump(buf, len);
 #endif
+  char *body = strstr(buf, "\r\n\r\n");
+  char *req_line = strtok_r(buf, "\r\n", &bufptr);
+  /* locate Host, e.g. "Host: abc.com", counted whatever the log level */
+  char *tmph = (req_line) ? strstr(bufptr, "Host: ") : NULL;
+  if (tmph)
+    hitters_count(HIT_HOST, tmph + 6, strcspn(tmph + 6, "\r\n"));
+  if (req->log_verbose >= LGG_INFO) {
+    if (req_line) {
+      req->host[0] = '\0';
+      if (strlen(req_line) > req->req_len) {
+        req->req_len = strlen(req_line);
+        req->req_url = realloc(req->req_url, req->req_len + 1);
+        req->req_url[0] = '\0';
+      }
+      strcpy(req->req_url, req_line);
+      /* copy Host */
+      if (tmph) {
+        req->host[HOST_LEN_MAX] = '\0';
+        strncpy(req->host, tmph + 6 /* strlen("Host: ") */, HOST_LEN_MAX);
+        strtok(req->host, "\r\n");
+        TESTPRINT("socket:%d host:%s\n", fd, req->host);
+      }
+    }
+  }
+  char *method = strtok(req_line, " ");
+
+  if (method == NULL) {
+    log_msg(LGG_DEBUG, "client did not specify method");
+  } else {
+    TESTPRINT("method: '%s'\n", method);
+    if (!strcmp(method, "OPTIONS")) {
+      pipedata->status = SEND_OPTIONS;
+      req->response = httpoptions;
+      req->rsize = sizeof httpoptions - 1;
+    } else if (!strcmp(method, "POST")) {
+      /* body points to "\r\n\r\n"; content was received by the caller */
+      if (body && len > body + 4 - buf) {
+        req->post_buf = body + 4;
+        req->post_buf_len = len - (body + 4 - buf);
+      }
+      pipedata->status = SEND_POST;
+      req->response = http204;
+      req->rsize = sizeof http204 - 1;
+    } else if (!strcmp(method, "GET")) {
+      // send default from here, no matter what happens
+      pipedata->status = DEFAULT_REPLY;
+      // trim up to non path chars
+      char *path = strtok(NULL, " ");//, " ?#;=");     // "?;#:*<>[]='\"\\,|!~()"
+      if (path == NULL) {
+        pipedata->status = SEND_NO_URL;
+        log_msg(LGG_DEBUG, "client did not specify URL for GET request");
+      } else if (!strncmp(path, "/log=", strlen("/log="))) {
+        int v = atoi(path + strlen("/log="));
+        if (v > LGG_DEBUG || v < 0)
+          pipedata->status = SEND_BAD;
+        else {
+          pipedata->status = ACTION_LOG_VERB;
+          pipedata->verb = v;
+        }
+      } else if (!strcmp(path, stats_url)) {
+        pipedata->status = SEND_STATS;
+        version_string = get_version(argc, argv);
+        stat_string = get_stats(1, 0);
+        req->rsize = asprintf(&req->aspbuf,
+                         "%s%u%s%s%s<br>%s%s",
+                         httpstats1,
+                         (unsigned int)(statsbaselen + strlen(version_string) + 4 + strlen(stat_string)),
+                         httpstats2,
+                         httpstats3,
+                         version_string,
+                         stat_string,
+                         httpstats4);
+        free(version_string);
+        free(stat_string);
+        req->response = req->aspbuf;
+      } else if (!strcmp(path, stats_text_url)) {
+        pipedata->status = SEND_STATSTEXT;
+        version_string = get_version(argc, argv);
+        stat_string = get_stats(0, 1);
+        req->rsize = asprintf(&req->aspbuf,
+                         "%s%u%s%s\n%s%s",
+                         txtstats1,
+                         (unsigned int)(strlen(version_string) + 1 + strlen(stat_string) + 2),
+                         txtstats2,
+                         version_string,
+                         stat_string,
+                         txtstats3);
+        free(version_string);
+        free(stat_string);
+        req->response = req->aspbuf;
+      } else if (!strcmp(path, metrics_url)) {
+        pipedata->status = SEND_METRICS;
+        send_metrics(req);
+      } else if (!strcmp(path, feed_url)) {
+        strbuf_struct sb = {0};
+        if (strbuf_printf(&sb, "%s", feedhdr) < 0 || feed_open(&sb, &req->feed_seq) < 0) {
+          log_msg(LGG_ERR, "Out of memory. Cannot open stats feed");
+          free(sb.buf);
+        } else {
+          pipedata->status = SEND_FEED;
+          req->aspbuf = sb.buf;
+          req->response = req->aspbuf;
+          req->rsize = sb.len;
+        }
+      } else if (!strcmp(path, trace_url)) {
+        pipedata->status = SEND_TRACE;
+        stat_string = trace_dump();
+        if (stat_string) {
+          req->rsize = asprintf(&req->aspbuf, "%s%u%s%s",
+                           txtstats1, (unsigned int)strlen(stat_string), txtstats2, stat_string);
+          free(stat_string);
+          req->response = req->aspbuf;
+        } else
+          log_msg(LGG_ERR, "Out of memory. Cannot dump request traces");
+      } else if (do_204 && !strcasecmp(path, "/generate_204")) {
+        pipedata->status = SEND_204;
+        req->response = http204;
+        req->rsize = sizeof http204 - 1;
+      } else {
+        // pick out encoded urls (usually advert redirects)
+        if (do_redirect && strcasestr(path, "=http")) {
+          char *decoded = malloc(strlen(path)+1);
+          urldecode(decoded, path);
+
+          // double decode
+          urldecode(path, decoded);
+          free(decoded);
+          url = strstr_last(path, "http://");
+          if (url == NULL) {
+            url = strstr_last(path, "https://");
+          }
+          // WORKAROUND: google analytics block - request bomb on pages with conversion callbacks (see in chrome)
+          if (url) {
+            char *tok = NULL;
+            for (tok = strtok_r(NULL, "\r\n", &bufptr); tok; tok = strtok_r(NULL, "\r\n", &bufptr)) {
+              char *hkey = strtok(tok, ":");
+              char *hvalue = strtok(NULL, "\r\n");
+              if (strstr(hkey, "Referer") && strstr(hvalue, url)) {
+                url = NULL;
+                TESTPRINT("Not redirecting likely callback URL: %s:%s\n", hkey, hvalue);
+                break;
+              }
+            }
+          }
+        }
+        if (do_redirect && url) {
+          pipedata->status = SEND_REDIRECT;
+          req->rsize = asprintf(&req->aspbuf, httpredirect, url);
+          req->response = req->aspbuf;
+          TESTPRINT("Sending redirect: %s\n", url);
+          url = NULL;
+        } else {
+          char *file = strrchr(strtok(path, "?#;="), '/');
+          if (file == NULL) {
+            pipedata->status = SEND_BAD_PATH;
+            log_msg(LGG_DEBUG, "URL contains invalid file path %s", path);
+          } else {
+            TESTPRINT("file: '%s'\n", file);
+            char *ext = strrchr(file, '.');
+            if (ext == NULL) {
+              pipedata->status = SEND_NO_EXT;
+              log_msg(LGG_DEBUG, "no file extension %s from path %s", file, path);
+            } else {
+              TESTPRINT("ext: '%s'\n", ext);
+              if (!strcasecmp(ext, ".gif")) {
+                TESTPRINT("Sending gif response\n");
+                pipedata->status = SEND_GIF;
+                req->response = httpnullpixel;
+                req->rsize = sizeof httpnullpixel - 1;
+              } else if (!strcasecmp(ext, ".png")) {
+                TESTPRINT("Sending png response\n");
+                pipedata->status = SEND_PNG;
+                req->response = httpnull_png;
+                req->rsize = sizeof httpnull_png - 1;
+              } else if (!strncasecmp(ext, ".jp", 3)) {
+                TESTPRINT("Sending jpg response\n");
+                pipedata->status = SEND_JPG;
+                req->response = httpnull_jpg;
+                req->rsize = sizeof httpnull_jpg - 1;
+              } else if (!strcasecmp(ext, ".swf")) {
+                TESTPRINT("Sending swf response\n");
+                pipedata->status = SEND_SWF;
+                req->response = httpnull_swf;
+                req->rsize = sizeof httpnull_swf - 1;
+              } else if (!strcasecmp(ext, ".ico")) {
+                TESTPRINT("Sending ico response\n");
+                pipedata->status = SEND_ICO;
+                req->response = httpnull_ico;
+                req->rsize = sizeof httpnull_ico - 1;
+              } else if (!strncasecmp(ext, ".js", 3)) {  // .jsx ?
+                pipedata->status = SEND_TXT;
+                TESTPRINT("Sending txt response\n");
+                req->response = httpnulltext;
+                req->rsize = sizeof httpnulltext - 1;
+              } else {
+                TESTPRINT("Sending ufe response\n");
+                pipedata->status = SEND_UNK_EXT;
+                log_msg(LOG_DEBUG, "unrecognized file extension %s from path %s", ext, path);
+              }
+            }
+          }
+        }
+      }
+      // end of GET
+    } else {
+      if (!strcmp(method, "HEAD")) {
+        // HEAD (TODO: send header of what the actual response type would be?)
+        pipedata->status = SEND_HEAD;
+      } else {
+        // something else, possibly even non-HTTP
+        log_msg(LGG_DEBUG, "Sending HTTP 501 response for unknown HTTP method: %s", method);
+        pipedata->status = SEND_BAD;
+      }
+      TESTPRINT("Sending 501 response\n");
+      req->response = http501;
+      req->rsize = sizeof http501 - 1;
+    }
+  }
+}
+
+void process_refused(http_req_struct *req, response_struct *pipedata)
+{
+  pipedata->status = SEND_RATE;
+  req->response = http429;
+  req->rsize = sizeof http429 - 1;
+  // whoever is over the limit is not worth an access log line each
+  req->log_verbose = LGG_CRIT;
+}
+
+void log_request(int fd, http_req_struct *req, int tls)
+{
+  struct sockaddr_storage sin_addr;
+  socklen_t sin_addr_len = sizeof(sin_addr);
+  char client_ip[INET6_ADDRSTRLEN]= {'\0'};
+
+  if (req->log_verbose < LGG_INFO)
+    return;
+  getpeername(fd, (struct sockaddr*)&sin_addr, &sin_addr_len);
+  if(getnameinfo((struct sockaddr *)&sin_addr,
+                 sin_addr_len,
+                 client_ip,
+                 sizeof client_ip,
+                 NULL, 0, NI_NUMERICHOST) != 0)
+    perror("getnameinfo");
+  log_xcs(LGG_INFO, client_ip, req->host, tls, req->req_url, req->post_buf, req->post_buf_len);
+}
+
+/* report a keep-alive connection closed to make room */
+static void shed_idle(void) {
+  response_struct pipedata = {0};
+
+  pipedata.status = ACTION_SHED_IDLE;
+  pipedata.krq = 1;
+  stats_report(&pipedata);
+}
+
+/* keep sending stats feed events on a connection until its client goes
+   away or, under load, the thread is better spent elsewhere */
+static void feed_serve(int fd, SSL *ssl, unsigned int seq) {
+  strbuf_struct sb = {0};
+  struct timeval tv = { GLOBAL(g, select_timeout), 0 };
+  struct timespec now;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  long msec;
+  int rv;
+
+  /* a client which stops reading must not keep the thread for good */
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  for (;;) {
+    get_time(&now);
+    msec = (feed_due() - now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+    /* a feed client has nothing to say; anything, even EOF, ends it.
+       poll() as fds of event mode go well beyond FD_SETSIZE */
+    if (msec > 0 && TEMP_FAILURE_RETRY(poll(&pfd, 1, msec)) != 0)
+      break;
+    if (admission_level() >= ADM_SHED_IDLE) {
+      shed_idle();
+      break;
+    }
+    rv = feed_event(&sb, &seq);
+    if (rv < 0 || (rv > 0 && write_socket(fd, sb.buf, rv, ssl) != rv))
+      break;
+  }
+  free(sb.buf);
+}
+
+void* conn_handler( void *ptr )
+{
+  const int new_fd = CONN_TLSTOR(ptr, new_fd);
   // NOTES:
   // - from here on, all exit points should be counted or at least logged
   // - exit() should not be called from the child process
   response_struct pipedata = {0};
-  struct timeval timeout = {GLOBAL(g, select_timeout), 0};
+  conn_timer_struct timer = {0};
   int rv = 0;
-  char *buf = NULL, *bufptr = NULL;
-  char *url = NULL;
-  char* aspbuf = NULL;
-  const char* response = httpnulltext;
-  int rsize = sizeof httpnulltext - 1;
-  char* version_string = NULL;
-  char* stat_string = NULL;
+  int timed_out;
+  char *buf = NULL;
+  http_req_struct req = {0};
   int num_req = 0; // number of requests processed by this thread
-  char *req_url = NULL;
-  int req_len = 0;
-  #define HOST_LEN_MAX 80
-  char host[HOST_LEN_MAX + 1];
-  char *post_buf = NULL;
-  int post_buf_len = 0;
-  int wait_cnt;
   unsigned int total_bytes = 0; /* number of bytes received by this thread */
 
+  struct timespec start_time = {0, 0};
+  /* marks of the trace count from the accept until the first request */
+  struct timespec trace_base = CONN_TLSTOR(ptr, accept_time);
+
 #ifdef DEBUG
-  int do_warning = (warning_time > 0);
   // set up signal handling
   {
     struct sigaction sa;
@@ -511,318 +946,102 @@ void* conn_handler( void *ptr )
 #endif
 #endif
 
-  // the socket is connected, but we need to perform a check for incoming data
-  // since we're using blocking checks, we first want to set a timeout
-  if (setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(struct timeval)) < 0) {
-    log_msg(LGG_DEBUG, "setsockopt(timeout) reported error: %m");
+  // all reads below block; the connection timer bounds how long for
+  if (CONN_TLSTOR(ptr, tls)) {
+    ssl_enum ssl_status;
+    struct timespec hs_time;
+    get_time(&hs_time);
+    trace_mark(pipedata.trace, TRACE_HANDSHAKE, &trace_base);
+    conn_timer_arm(&timer, new_fd, GLOBAL(g, select_timeout));
+    rv = ssl_handshake(sslctx, (conn_tlstor_struct*)ptr, tls_pem, cachain, &ssl_status);
+    PROBE3(handshake, new_fd, (rv != 0), ssl_status);
+    timed_out = conn_timer_disarm(&timer);
+    if (!rv) {
+      if (timed_out)
+        stats_deadline(DEADLINE_HANDSHAKE);
+      pipedata.status = ACTION_SSL_FAIL;
+      pipedata.ssl = ssl_status;
+      pipedata.tls = 1;
+      stats_report(&pipedata);
+      shutdown(new_fd, SHUT_RDWR);
+      close(new_fd);
+      ratelimit_close(CONN_TLSTOR(ptr, client));
+      free(ptr);
+      return NULL;
+    }
+    // the accept counts towards the handshake, reported with the first request
+    pipedata.phase_time[PHASE_HANDSHAKE] = CONN_TLSTOR(ptr, init_time) + elapsed_time_msec(hs_time);
+    trace_mark(pipedata.trace, TRACE_HANDSHAKEN, &trace_base);
   }
-  pipedata.run_time = CONN_TLSTOR(ptr, init_time);
 
   /* main event loop */
   while(1) {
 
     get_time(&start_time);
+    pipedata.trace_accept = !num_req;
+    if (num_req)
+      trace_base = start_time;
 
-    int log_verbose = log_get_verb();
-    response = httpnulltext;
-    rsize = sizeof httpnulltext - 1;
-    post_buf_len = 0;
+    req.response = NULL;
+    req.post_buf_len = 0;
+    req.log_verbose = log_get_verb();
 
     errno = 0;
-    rv = read_socket(new_fd, &buf, CONN_TLSTOR(ptr, ssl));
+    conn_timer_arm(&timer, new_fd, GLOBAL(g, select_timeout));
+    rv = read_socket(new_fd, &buf, CONN_TLSTOR(ptr, ssl), pipedata.trace, &trace_base);
+    PROBE2(request_read, new_fd, rv);
+    timed_out = conn_timer_disarm(&timer);
     if (rv <= 0) {
-      if (errno == ECONNRESET || rv == 0) {
+      if (timed_out) {
+        log_msg(LGG_DEBUG, "recv() timed out");
+        pipedata.status = FAIL_TIMEOUT;
+      } else if (errno == ECONNRESET || rv == 0) {
         log_msg(LGG_DEBUG, "recv() ECONNRESET: %m");
         pipedata.status = FAIL_CLOSED;
-      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        log_msg(LGG_DEBUG, "recv() EAGAIN: %m");
-        pipedata.status = FAIL_TIMEOUT;
       } else {
         log_msg(LGG_DEBUG, "recv() error: %m");
         pipedata.status = FAIL_GENERAL;
       }
       if (CONN_TLSTOR(ptr, ssl))
         pipedata.ssl = SSL_HIT_CLS; /* ssl client disconnects without sending any data */
+    } else if (timed_out && !strstr(buf, "\r\n\r\n")) {
+      log_msg(LGG_DEBUG, "request headers not complete in time socket:%d", new_fd);
+      stats_deadline(DEADLINE_HEADER);
+      goto done_with_this_thread;
     } else {                    // got some data
+      pipedata.phase_time[PHASE_HEADER] = elapsed_time_msec(start_time);
       pipedata.ssl = (CONN_TLSTOR(ptr, ssl)) ? SSL_HIT : SSL_NOT_TLS;
 
-      TIME_CHECK("initial recv()");
-      buf[rv] = '\0';
       TESTPRINT("\nreceived %d bytes\n'%s'\n", rv, buf);
       pipedata.rx_total = rv;
       total_bytes += rv;
 
-#ifdef HEX_DUMP
-      hex_dump(buf, rv);
-#endif
-      char *body = strstr(buf, "\r\n\r\n");
-      int body_len = (body) ? (rv + buf - body) : 0;
-      char *req = strtok_r(buf, "\r\n", &bufptr);
-      if (log_verbose >= LGG_INFO) {
-        if (req) {
-          host[0] = '\0';
-          if (strlen(req) > req_len) {
-            req_len = strlen(req);
-            req_url = realloc(req_url, req_len + 1);
-            req_url[0] = '\0';
-          }
-          strcpy(req_url, req);
-          /* locate and copy Host */
-          char *tmph = strstr(bufptr, "Host: "); // e.g. "Host: abc.com"
-          if (tmph) {
-            host[HOST_LEN_MAX] = '\0';
-            strncpy(host, tmph + 6 /* strlen("Host: ") */, HOST_LEN_MAX);
-            strtok(host, "\r\n");
-            TESTPRINT("socket:%d host:%s\n", new_fd, host);
-          }
-        }
-      }
-      char *method = strtok(req, " ");
-
-      if (method == NULL) {
-        log_msg(LGG_DEBUG, "client did not specify method");
+      if (ratelimit_request(CONN_TLSTOR(ptr, client)) != RATE_OK) {
+        process_refused(&req, &pipedata);
       } else {
-        TESTPRINT("method: '%s'\n", method);
-        if (!strcmp(method, "OPTIONS")) {
-          pipedata.status = SEND_OPTIONS;
-          response = httpoptions;
-          rsize = sizeof httpoptions - 1;
-        } else if (!strcmp(method, "POST")) {
-            int recv_len = 0;
-            int length = 0;
-            int post_buf_size = 0;
-            int wait_cnt = 0;
-            char *h = strstr(bufptr, "Content-Length: ");
-
-            h += strlen("Content-Length: ");
-            length = atoi(strtok(h, "\r\n"));
-
-            log_msg(LGG_DEBUG, "POST socket: %d Content-Length: %d", new_fd, length);
-
-            if (length < MAX_HTTP_POST_LEN)
-              post_buf_size = length;
-            else
-              post_buf_size = MAX_HTTP_POST_LEN;
-            post_buf = realloc(post_buf, post_buf_size + 1);
-            if (!post_buf) {
-              log_msg(LGG_ERR, "Out of memory. Cannot malloc receiver buffer.");
-              goto end_post;
-            }
-            post_buf[post_buf_size] = '\0';
-
-            /* body points to "\r\n\r\n" */
-            if (body && body_len > 4) {
-              recv_len = body_len - 4;
-              memcpy(post_buf, body + 4, recv_len);
-              length -= recv_len;
-              post_buf_size -= recv_len;
-            }
-
-            log_msg(LGG_DEBUG, "POST socket: %d expect length: %d\n", new_fd, length);
-
-            wait_cnt = MAX_HTTP_POST_WAIT / GLOBAL(g, select_timeout);
-            if (wait_cnt < 1) wait_cnt = 1;
-
-            /* caputre POST content */
-            for (; length > 0 && wait_cnt > 0;) {
-              errno = 0;
-              if (CONN_TLSTOR(ptr, ssl)) {
-                rv = SSL_read(CONN_TLSTOR(ptr, ssl), (char *)(post_buf + recv_len), post_buf_size);
-                TESTPRINT("SSL handshake. errno: %d rv: %d\n", SSL_get_error(CONN_TLSTOR(ptr, ssl), rv), rv);
-              }else
-                rv = recv(new_fd, post_buf + recv_len, post_buf_size, MSG_WAITALL);
-
-              log_msg(LGG_DEBUG, "POST socket:%d recv length:%d; errno:%d", new_fd, rv, errno);
-              if (rv > 0) {
-                pipedata.rx_total += rv;
-                length -= rv;
-                if ((recv_len + rv) < MAX_HTTP_POST_LEN) {
-                  recv_len += rv;
-                  post_buf_size -= rv;
-                  post_buf[recv_len] = '\0';
-                } else {
-                  if (length > CHAR_BUF_SIZE) {
-                    /* discard bytes from 'MAX_HTTP_POST_LEN - CHAR_BUF_SIZE'
-                    to 'Content-Length - CHAR_BUF_SIZE' */
-                    recv_len += rv - CHAR_BUF_SIZE;
-                    post_buf_size = CHAR_BUF_SIZE;
-                  } else {
-                      recv_len += rv - length;
-                      post_buf_size = length;
-                  }
-                }
-              } else
-                --wait_cnt;
-            }
-
-          end_post:
-            post_buf_len = recv_len;
-            pipedata.status = SEND_POST;
-            response = http204;
-            rsize = sizeof http204 - 1;
-        } else if (!strcmp(method, "GET")) {
-          // send default from here, no matter what happens
-          pipedata.status = DEFAULT_REPLY;
-          // trim up to non path chars
-          char *path = strtok(NULL, " ");//, " ?#;=");     // "?;#:*<>[]='\"\\,|!~()"
-          if (path == NULL) {
-            pipedata.status = SEND_NO_URL;
-            log_msg(LGG_DEBUG, "client did not specify URL for GET request");
-          } else if (!strncmp(path, "/log=", strlen("/log="))) {
-            int v = atoi(path + strlen("/log="));
-            if (v > LGG_DEBUG || v < 0)
-              pipedata.status = SEND_BAD;
-            else {
-              pipedata.status = ACTION_LOG_VERB;
-              pipedata.verb = v;
-            }
-          } else if (!strcmp(path, stats_url)) {
-            pipedata.status = SEND_STATS;
-            version_string = get_version(argc, argv);
-            stat_string = get_stats(1, 0);
-            rsize = asprintf(&aspbuf,
-                             "%s%u%s%s%s<br>%s%s",
-                             httpstats1,
-                             (unsigned int)(statsbaselen + strlen(version_string) + 4 + strlen(stat_string)),
-                             httpstats2,
-                             httpstats3,
-                             version_string,
-                             stat_string,
-                             httpstats4);
-            free(version_string);
-            free(stat_string);
-            response = aspbuf;
-          } else if (!strcmp(path, stats_text_url)) {
-            pipedata.status = SEND_STATSTEXT;
-            version_string = get_version(argc, argv);
-            stat_string = get_stats(0, 1);
-            rsize = asprintf(&aspbuf,
-                             "%s%u%s%s\n%s%s",
-                             txtstats1,
-                             (unsigned int)(strlen(version_string) + 1 + strlen(stat_string) + 2),
-                             txtstats2,
-                             version_string,
-                             stat_string,
-                             txtstats3);
-            free(version_string);
-            free(stat_string);
-            response = aspbuf;
-          } else if (do_204 && !strcasecmp(path, "/generate_204")) {
-            pipedata.status = SEND_204;
-            response = http204;
-            rsize = sizeof http204 - 1;
-          } else {
-            // pick out encoded urls (usually advert redirects)
-            if (do_redirect && strcasestr(path, "=http")) {
-              char *decoded = malloc(strlen(path)+1);
-              urldecode(decoded, path);
-
-              // double decode
-              urldecode(path, decoded);
-              free(decoded);
-              url = strstr_last(path, "http://");
-              if (url == NULL) {
-                url = strstr_last(path, "https://");
-              }
-              // WORKAROUND: google analytics block - request bomb on pages with conversion callbacks (see in chrome)
-              if (url) {
-                char *tok = NULL;
-                for (tok = strtok_r(NULL, "\r\n", &bufptr); tok; tok = strtok_r(NULL, "\r\n", &bufptr)) {
-                  char *hkey = strtok(tok, ":");
-                  char *hvalue = strtok(NULL, "\r\n");
-                  if (strstr(hkey, "Referer") && strstr(hvalue, url)) {
-                    url = NULL;
-                    TESTPRINT("Not redirecting likely callback URL: %s:%s\n", hkey, hvalue);
-                    break;
-                  }
-                }
-              }
-            }
-            if (do_redirect && url) {
-              pipedata.status = SEND_REDIRECT;
-              rsize = asprintf(&aspbuf, httpredirect, url);
-              response = aspbuf;
-              TESTPRINT("Sending redirect: %s\n", url);
-              url = NULL;
-            } else {
-              char *file = strrchr(strtok(path, "?#;="), '/');
-              if (file == NULL) {
-                pipedata.status = SEND_BAD_PATH;
-                log_msg(LGG_DEBUG, "URL contains invalid file path %s", path);
-              } else {
-                TESTPRINT("file: '%s'\n", file);
-                char *ext = strrchr(file, '.');
-                if (ext == NULL) {
-                  pipedata.status = SEND_NO_EXT;
-                  log_msg(LGG_DEBUG, "no file extension %s from path %s", file, path);
-                } else {
-                  TESTPRINT("ext: '%s'\n", ext);
-                  if (!strcasecmp(ext, ".gif")) {
-                    TESTPRINT("Sending gif response\n");
-                    pipedata.status = SEND_GIF;
-                    response = httpnullpixel;
-                    rsize = sizeof httpnullpixel - 1;
-                  } else if (!strcasecmp(ext, ".png")) {
-                    TESTPRINT("Sending png response\n");
-                    pipedata.status = SEND_PNG;
-                    response = httpnull_png;
-                    rsize = sizeof httpnull_png - 1;
-                  } else if (!strncasecmp(ext, ".jp", 3)) {
-                    TESTPRINT("Sending jpg response\n");
-                    pipedata.status = SEND_JPG;
-                    response = httpnull_jpg;
-                    rsize = sizeof httpnull_jpg - 1;
-                  } else if (!strcasecmp(ext, ".swf")) {
-                    TESTPRINT("Sending swf response\n");
-                    pipedata.status = SEND_SWF;
-                    response = httpnull_swf;
-                    rsize = sizeof httpnull_swf - 1;
-                  } else if (!strcasecmp(ext, ".ico")) {
-                    TESTPRINT("Sending ico response\n");
-                    pipedata.status = SEND_ICO;
-                    response = httpnull_ico;
-                    rsize = sizeof httpnull_ico - 1;
-                  } else if (!strncasecmp(ext, ".js", 3)) {  // .jsx ?
-                    pipedata.status = SEND_TXT;
-                    TESTPRINT("Sending txt response\n");
-                    response = httpnulltext;
-                    rsize = sizeof httpnulltext - 1;
-                  } else {
-                    TESTPRINT("Sending ufe response\n");
-                    pipedata.status = SEND_UNK_EXT;
-                    log_msg(LOG_DEBUG, "unrecognized file extension %s from path %s", ext, path);
-                  }
-                }
-              }
-            }
-          }
-          // end of GET
-        } else {
-          if (!strcmp(method, "HEAD")) {
-            // HEAD (TODO: send header of what the actual response type would be?)
-            pipedata.status = SEND_HEAD;
-          } else {
-            // something else, possibly even non-HTTP
-            log_msg(LGG_DEBUG, "Sending HTTP 501 response for unknown HTTP method: %s", method);
-            pipedata.status = SEND_BAD;
-          }
-          TESTPRINT("Sending 501 response\n");
-          response = http501;
-          rsize = sizeof http501 - 1;
+        rv = read_post_body(new_fd, &buf, rv, CONN_TLSTOR(ptr, ssl), &pipedata, &timer);
+        if (rv < 0) {
+          log_msg(LGG_DEBUG, "POST content not complete in time socket:%d", new_fd);
+          stats_deadline(DEADLINE_BODY);
+          goto done_with_this_thread;
         }
+        process_request(&req, buf, rv, &pipedata, new_fd);
       }
+      trace_mark(pipedata.trace, TRACE_PARSED, &trace_base);
+      PROBE2(response, new_fd, pipedata.status);
     }
-#ifdef DEBUG
-    if (pipedata.status != FAIL_TIMEOUT)
-      TIME_CHECK("response selection");
-#endif
 
     // done processing socket connection; now handle selected result action
     if (pipedata.status == FAIL_GENERAL) {
       log_msg(LGG_DEBUG, "Client request processing completed with FAIL_GENERAL status");
     } else if (pipedata.status != FAIL_TIMEOUT && pipedata.status != FAIL_CLOSED) {
       // only attempt to send response if we've chosen a valid response type
-      rv = write_socket(new_fd, response, rsize, CONN_TLSTOR(ptr, ssl));
+      struct timespec wr_time;
+      get_time(&wr_time);
+      rv = write_socket(new_fd, req.response, req.rsize, CONN_TLSTOR(ptr, ssl));
+      pipedata.phase_time[PHASE_WRITE] = elapsed_time_msec(wr_time);
+      trace_mark(pipedata.trace, TRACE_WRITTEN, &trace_base);
+      PROBE2(response_sent, new_fd, rv);
       if (rv < 0) { // check for error message, but don't bother checking that all bytes sent
         if (errno == EPIPE || errno == ECONNRESET) {
           // client closed socket sometime after initial check
@@ -833,90 +1052,67 @@ void* conn_handler( void *ptr )
           log_msg(LGG_ERR, "attempt to send response for status=%d resulted in send() error: %m", pipedata.status);
           pipedata.status = FAIL_GENERAL;
         }
-      } else if (rv != rsize) {
-        log_msg(LGG_ERR, "send() reported only %d of %d bytes sent; status=%d", rv, rsize, pipedata.status);
-      }
-      if (log_verbose >= LGG_INFO) {
-        struct sockaddr_storage sin_addr;
-        socklen_t sin_addr_len = sizeof(sin_addr);
-        char client_ip[INET6_ADDRSTRLEN]= {'\0'};    
-
-        getpeername(new_fd, (struct sockaddr*)&sin_addr, &sin_addr_len);
-        if(getnameinfo((struct sockaddr *)&sin_addr,
-                       sin_addr_len,
-                       client_ip,
-                       sizeof client_ip,
-                       NULL, 0, NI_NUMERICHOST) != 0)
-          perror("getnameinfo");
-        log_xcs(LGG_INFO, client_ip, host, (CONN_TLSTOR(ptr, ssl) != NULL), req_url, post_buf, post_buf_len);
+      } else if (rv != req.rsize) {
+        log_msg(LGG_ERR, "send() reported only %d of %d bytes sent; status=%d", rv, req.rsize, pipedata.status);
       }
+      log_request(new_fd, &req, (CONN_TLSTOR(ptr, ssl) != NULL));
       // free memory allocated by asprintf() if any
-      free(aspbuf);
-      aspbuf = NULL;
+      response_done(&req);
     }
 
     /*** NOTE: pipedata.status should not be altered after this point ***/
 
-    TIME_CHECK("response send()");
-
     // store time delta in milliseconds
     pipedata.run_time += elapsed_time_msec(start_time);
-    write_pipe(pipefd, &pipedata);
+    stats_report(&pipedata);
     num_req++;
 
     TESTPRINT("run_time %.2f\n", pipedata.run_time);
     pipedata.run_time = 0.0;
+    memset(pipedata.phase_time, 0, sizeof(pipedata.phase_time));
+    memset(pipedata.trace, 0, sizeof(pipedata.trace));
+
+    /* nothing to wait for on a connection that already failed or was refused */
+    if (pipedata.status == FAIL_TIMEOUT || pipedata.status == FAIL_CLOSED
+        || pipedata.status == SEND_RATE)
+      goto done_with_this_thread;
+
+    /* the stats feed keeps the connection to itself */
+    if (pipedata.status == SEND_FEED) {
+      feed_serve(new_fd, CONN_TLSTOR(ptr, ssl), req.feed_seq);
+      goto done_with_this_thread;
+    }
 
-    TIME_CHECK("pipe write()");
+    /* under load the thread is better spent on a new connection */
+    if (admission_level() >= ADM_SHED_IDLE) {
+      shed_idle();
+      goto done_with_this_thread;
+    }
 
-    /* wait for next request */
-    wait_cnt = GLOBAL(g, http_keepalive) / GLOBAL(g, select_timeout);
-    if (wait_cnt < 1) wait_cnt = 1;
+    /* wait up to http_keepalive for the next request */
     fd_set rfds;
     FD_ZERO(&rfds);
-
-    while (wait_cnt > 0) {
-      /* note that some implementations of select() clears timeout */
-      struct timeval timeout = {GLOBAL(g, select_timeout), 0};
-      FD_SET(new_fd, &rfds);
-      errno = 0;
-      int selrv = TEMP_FAILURE_RETRY(select(new_fd + 1, &rfds, NULL, NULL, &timeout));
-      TESTPRINT("socket:%d selrv:%d errno:%d\n", new_fd, selrv, errno);
-      if (selrv > 0) {
-        errno = 0;
-        rv = peek_socket(new_fd, CONN_TLSTOR(ptr, ssl));
-        if (rv == 0 || errno == ECONNRESET) {
-          if (total_bytes == 0) {
-            /* client disconnects w/o sending any request; run_time is ignorable */
-            pipedata.status = FAIL_CLOSED;
-            pipedata.rx_total = 0;
-            write_pipe(pipefd, &pipedata);
-            num_req++;
-          }
-          goto done_with_this_thread;
-        } else
-          break;
-      } else { /* error: -1, no data within timeout: < -1 */
-        if (rv == 0 || errno == ECONNRESET || errno == ETIMEDOUT || wait_cnt == 1) {
-          if (wait_cnt > 1 && total_bytes == 0) {
-            /* client disconnects w/o sending any request; run_time is ignorable */
-            pipedata.status = FAIL_CLOSED;
-            pipedata.rx_total = 0;
-            write_pipe(pipefd, &pipedata);
-            num_req++;
-          }
-          goto done_with_this_thread;
-        }
-      }
-      --wait_cnt;
+    FD_SET(new_fd, &rfds);
+    conn_timer_arm_idle(&timer, new_fd, GLOBAL(g, http_keepalive));
+    errno = 0;
+    int selrv = TEMP_FAILURE_RETRY(select(new_fd + 1, &rfds, NULL, NULL, NULL));
+    TESTPRINT("socket:%d selrv:%d errno:%d\n", new_fd, selrv, errno);
+    if ((timed_out = conn_timer_disarm(&timer)) || selrv < 0) {
+      if (timed_out == CONN_TIMER_SHED)
+        shed_idle();
+      goto done_with_this_thread;
     }
+    errno = 0;
+    rv = peek_socket(new_fd, CONN_TLSTOR(ptr, ssl));
+    if (rv == 0 || errno == ECONNRESET)
+      goto done_with_this_thread;
     pipedata.run_time = 0.0;
   } /* end of main event loop */
 
 done_with_this_thread:
   /* done with the thread and let's finish with some house keeping */
-  log_msg(LGG_DEBUG, "Exit recv loop socket:%d rv:%d errno:%d wait_cnt:%d num_req:%d\n",
-      new_fd, rv, errno, wait_cnt, num_req);
+  log_msg(LGG_DEBUG, "Exit recv loop socket:%d rv:%d errno:%d num_req:%d\n",
+      new_fd, rv, errno, num_req);
 
   // signal the socket connection that we're done read-write
   if(CONN_TLSTOR(ptr, ssl)){
@@ -934,31 +1130,23 @@ done_with_this_thread:
   if (close(new_fd) < 0)
     log_msg(LGG_DEBUG, "close() socket in thread or child process reported error: %m");
 
-  TIME_CHECK("socket close()");
-  
   // decrement number of service threads/processes by one before we exit
-  // don't check for write errors
   memset(&pipedata, 0, sizeof(pipedata));
   pipedata.status = ACTION_DEC_KCC;
   pipedata.krq = num_req;
-  rv = write(pipefd, &pipedata, sizeof(pipedata));
+  pipedata.tls = CONN_TLSTOR(ptr, tls);
+  stats_report(&pipedata);
+  ratelimit_close(CONN_TLSTOR(ptr, client));
 
 #ifndef USE_PTHREAD
-  // child no longer needs write pipe, so close descriptor
-  // this is probably redundant since we are about to exit() anyway
-  if (close(pipefd) < 0)
-    log_msg(LGG_DEBUG, "close() pipe in child process reported error: %m");
-
-  TIME_CHECK("pipe close()");
-
+  // the write pipe stays open: pre-forked workers serve more connections
   if (pipedata.status == FAIL_GENERAL)
     log_msg(LGG_ERR, "conn_handler exiting child process with FAIL_GENERAL status");
 #endif
 
   free(ptr);
   free(buf);
-  free(req_url);
-  free(post_buf);
-  free(aspbuf);
+  free(req.req_url);
+  response_done(&req);
   return NULL;
 }
@@ -9,6 +9,7 @@
 #define MAX_CHAR_BUF_LOTS   32       /* max msg buffer size in unit of CHAR_BUF_SIZE */
 #define MAX_HTTP_POST_LEN   262143   /* max POST Content-Length before discarding */
 #define MAX_HTTP_POST_WAIT  5        /* 5 second */
+#define HOST_LEN_MAX        80
 
 typedef enum {
   FAIL_GENERAL,
@@ -24,6 +25,9 @@ typedef enum {
   SEND_BAD,
   SEND_STATS,
   SEND_STATSTEXT,
+  SEND_METRICS,
+  SEND_FEED,
+  SEND_TRACE,
   SEND_204,
   SEND_REDIRECT,
   SEND_NO_EXT,
@@ -33,21 +37,98 @@ typedef enum {
   SEND_POST,
   SEND_HEAD,
   SEND_OPTIONS,
+  SEND_RATE,
   ACTION_LOG_VERB,
-  ACTION_DEC_KCC
+  ACTION_DEC_KCC,
+  ACTION_INC_KCC,
+  ACTION_INC_CLT,
+  ACTION_SSL_FAIL,
+  ACTION_ACC_BATCH,
+  ACTION_SHED_IDLE,
+  ACTION_SHED_TLS,
+  ACTION_QUOTA,
+  ACTION_RATE,
+  ACTION_DEADLINE
 } response_enum;
 
+/* absolute deadlines a connection is killed at, counted by kind. the TLS
+   handshake and the request headers get select_timeout, POST content
+   MAX_HTTP_POST_WAIT once the headers are in */
+typedef enum {
+  DEADLINE_HANDSHAKE,
+  DEADLINE_HEADER,
+  DEADLINE_BODY
+} deadline_enum;
+
+/* phases of a request timed into latency histograms. the handshake is
+   that of a TLS connection, reported along with its first request */
+typedef enum {
+  PHASE_HANDSHAKE,
+  PHASE_HEADER,       /* waiting for the request headers */
+  PHASE_WRITE,        /* sending the response */
+  PHASE_TOTAL,        /* the whole request, run_time */
+  PHASE_NUM
+} phase_enum;
+
+/* points a request passes, stamped for its trace. the first request of a
+   connection counts from the accept, any later one from its own start */
+typedef enum {
+  TRACE_HANDSHAKE,    /* TLS handshake begun */
+  TRACE_HANDSHAKEN,   /* and done */
+  TRACE_FIRST_BYTE,   /* first bytes of the request in */
+  TRACE_PARSED,       /* request complete, response selected */
+  TRACE_WRITTEN,      /* response sent */
+  TRACE_MARKS
+} trace_enum;
+
 typedef struct {
     response_enum status;
     union {
         int rx_total;
         int krq;
         logger_level verb;
+        int rate;           /* ACTION_RATE: rate_enum limit hit */
+        deadline_enum deadline;
     };
     double run_time;
+    float phase_time[PHASE_TOTAL];  /* msec per phase, 0 if not gone through */
+    unsigned int trace[TRACE_MARKS];  /* usec at each mark, 0 if not reached */
+    int trace_accept;       /* trace counts from the accept */
     ssl_enum ssl;
+    int tls;                /* ACTION_*_KCC, ACTION_QUOTA: connection over TLS */
 } response_struct;
 
+typedef struct {
+    const char *response;   /* response selected for the request */
+    int rsize;
+    char *aspbuf;           /* heap buffer backing response if not static */
+    char *req_url;          /* copy of request line for access log */
+    int req_len;
+    char host[HOST_LEN_MAX + 1];
+    char *post_buf;         /* POST content within the receive buffer */
+    int post_buf_len;
+    int log_verbose;
+    int metrics_lent;       /* response is in the thread's metrics buffer */
+    unsigned int feed_seq;  /* SEND_FEED: last event sent */
+} http_req_struct;
+
+// Content-Length of a POST request in buf, or 0 for any other request
+int http_post_length(const char *buf);
+// length of the headers at the start of the len bytes in buf, blank line
+// included, or 0 if not all in yet
+int http_header_end(const char *buf, int len);
+// parse the complete request in buf (NUL terminated; modified in place) and
+// select a response. status is returned in pipedata
+void process_request(http_req_struct *req, char *buf, int len, response_struct *pipedata, int fd);
+// answer a request over its client's rate limit with a 429, without even
+// parsing it. the connection is to be closed once the response is out
+void process_refused(http_req_struct *req, response_struct *pipedata);
+// done sending the response of req; lets go of what it was kept in besides
+// aspbuf. to be called by the thread that processed req
+void response_done(http_req_struct *req);
+// access log of a processed request when log level >= LGG_INFO
+void log_request(int fd, http_req_struct *req, int tls);
+
 void* conn_handler(void *ptr);
 
 #endif // SOCKET_HANDLER_H
@@ -0,0 +1,439 @@
+#include "util.h" // _GNU_SOURCE
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "stats.h"
+#include "series.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "logger.h"
+
+/*
+ * Statistics are counted per thread, each in its own block of cache lines
+ * so that no two threads write to the same line, and added up only when
+ * they are read. Blocks are never freed: a thread going away leaves its
+ * counts in its block for the next new thread to carry on with. Connections
+ * in service (kcc, tcc, hcc) are needed up to date for admission and are
+ * kept in shared counters instead. Without thread support, handler
+ * processes still report over the stats pipe and main() alone counts.
+ */
+
+extern struct Global *g;
+
+/* short names of the responses timed, as on the stats pages */
+static const char *lat_names[LAT_STATUSES] = {
+  [FAIL_GENERAL] = "err", [FAIL_TIMEOUT] = "tmo", [FAIL_CLOSED] = "cls",
+  [FAIL_REPLY] = "cly", [SEND_GIF] = "gif", [SEND_TXT] = "txt",
+  [SEND_JPG] = "jpg", [SEND_PNG] = "png", [SEND_SWF] = "swf",
+  [SEND_ICO] = "ico", [SEND_BAD] = "bad", [SEND_STATS] = "sta",
+  [SEND_STATSTEXT] = "stt", [SEND_METRICS] = "stm", [SEND_FEED] = "sse",
+  [SEND_TRACE] = "trc", [SEND_204] = "204", [SEND_REDIRECT] = "rdr",
+  [SEND_NO_EXT] = "nfe", [SEND_UNK_EXT] = "ufe", [SEND_NO_URL] = "nou",
+  [SEND_BAD_PATH] = "pth", [SEND_POST] = "pst", [SEND_HEAD] = "hed",
+  [SEND_OPTIONS] = "opt", [SEND_RATE] = "rlr"
+};
+static const char *phase_names[PHASE_NUM] = { "hsk", "hdr", "wri", "tot" };
+static const char *phase_labels[PHASE_NUM] = { "handshake", "header", "write", "total" };
+static const char *phase_texts[PHASE_NUM] = {
+  "TLS handshake", "request headers in", "response out", "request served"
+};
+
+static stats_block_struct spare = { .in_use = 1 };  /* if out of memory */
+static stats_block_struct *blocks = &spare;
+static __thread stats_block_struct *local = NULL;
+#ifdef USE_PTHREAD
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+static void local_release(void *b) {
+  __atomic_store_n(&((stats_block_struct *)b)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void local_key_init(void) {
+  pthread_key_create(&local_key, local_release);
+}
+#endif
+
+stats_block_struct *stats_local(void) {
+  stats_block_struct *b;
+  int idle;
+
+  if (local)
+    return local;
+  // carry on with the block of a thread that has gone, or add one
+  for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+    idle = 0;
+    if (__atomic_compare_exchange_n(&b->in_use, &idle, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (!b) {
+    if (posix_memalign((void **)&b, CACHE_LINE, sizeof(*b)))
+      return &spare;
+    memset(b, 0, sizeof(*b));
+    b->in_use = 1;
+    b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&blocks, &b->next, b, 0,
+             __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+#ifdef USE_PTHREAD
+  pthread_once(&local_once, local_key_init);
+  pthread_setspecific(local_key, b);
+#endif
+  return local = b;
+}
+
+stats_block_struct *stats_blocks(void) {
+  return __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+}
+
+void stats_conn_open(int tls) {
+  int n = __atomic_add_fetch(&kcc, 1, __ATOMIC_RELAXED);
+  int m = __atomic_load_n(&kmx, __ATOMIC_RELAXED);
+
+  while (n > m && !__atomic_compare_exchange_n(&kmx, &m, n, 0,
+           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  __atomic_add_fetch((tls) ? &tcc : &hcc, 1, __ATOMIC_RELAXED);
+}
+
+void stats_conn_close(int tls) {
+  __atomic_sub_fetch(&kcc, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch((tls) ? &tcc : &hcc, 1, __ATOMIC_RELAXED);
+}
+
+void stats_accept_batch(int n) {
+  stats_block_struct *b = stats_local();
+
+  if (n <= 0)
+    return;
+  ++b->abw;
+  b->abn += n;
+  if (n > b->abx)
+    b->abx = n;
+}
+
+static int lat_bucket(float msec) {
+  unsigned int v;
+  int k;
+
+  if (msec * 1000 >= (1U << LAT_MAX_BITS))
+    return LAT_BUCKETS - 1;
+  v = msec * 1000;
+  if (v < LAT_LINEAR)
+    return v;
+  k = 31 - __builtin_clz(v);
+  return LAT_LINEAR + ((k - LAT_SUB_BITS - 1) << LAT_SUB_BITS)
+      + ((v >> (k - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+unsigned int stats_lat_bound(int i) {
+  int k;
+
+  if (i < LAT_LINEAR)
+    return i;
+  k = ((i - LAT_LINEAR) >> LAT_SUB_BITS) + LAT_SUB_BITS + 1;
+  return (((unsigned int)(i & ((1 << LAT_SUB_BITS) - 1)) + (1 << LAT_SUB_BITS) + 1)
+      << (k - LAT_SUB_BITS)) - 1;
+}
+
+static void lat_add(stats_block_struct *b, int i, float msec) {
+  ++b->lat[i][lat_bucket(msec)];
+  b->lat_usec[i] += msec * 1000;
+}
+
+static void lat_record(stats_block_struct *b, const response_struct *r) {
+  int p;
+
+  for (p = 0; p < PHASE_TOTAL; p++)
+    if (r->phase_time[p] > 0)
+      lat_add(b, LAT_HIST(p, r->status), r->phase_time[p]);
+  if (r->status != FAIL_TIMEOUT) {
+    lat_add(b, LAT_HIST(PHASE_TOTAL, r->status), r->run_time);
+    ++b->lat_all[lat_bucket(r->run_time)];
+  }
+}
+
+void stats_account(const response_struct *r) {
+  stats_block_struct *b = stats_local();
+
+  switch (r->status) {
+    case FAIL_GENERAL:   ++b->err; break;
+    case FAIL_TIMEOUT:   ++b->tmo; break;
+    case FAIL_CLOSED:    ++b->cls; break;
+    case FAIL_REPLY:     ++b->cly; break;
+    case SEND_GIF:       ++b->gif; break;
+    case SEND_TXT:       ++b->txt; break;
+    case SEND_JPG:       ++b->jpg; break;
+    case SEND_PNG:       ++b->png; break;
+    case SEND_SWF:       ++b->swf; break;
+    case SEND_ICO:       ++b->ico; break;
+    case SEND_BAD:       ++b->bad; break;
+    case SEND_STATS:     ++b->sta; break;
+    case SEND_STATSTEXT: ++b->stt; break;
+    case SEND_METRICS:   ++b->stm; break;
+    case SEND_FEED:      ++b->sse; break;
+    case SEND_TRACE:     ++b->trc; break;
+    case SEND_204:       ++b->noc; break;
+    case SEND_REDIRECT:  ++b->rdr; break;
+    case SEND_NO_EXT:    ++b->nfe; break;
+    case SEND_UNK_EXT:   ++b->ufe; break;
+    case SEND_NO_URL:    ++b->nou; break;
+    case SEND_BAD_PATH:  ++b->pth; break;
+    case SEND_POST:      ++b->pst; break;
+    case SEND_HEAD:      ++b->hed; break;
+    case SEND_OPTIONS:   ++b->opt; break;
+    case SEND_RATE:      ++b->rlr; break;
+    case ACTION_LOG_VERB:  log_set_verb(r->verb); break;
+    case ACTION_DEC_KCC: stats_conn_close(r->tls); break;
+    case ACTION_INC_KCC: stats_conn_open(r->tls); break;
+    case ACTION_INC_CLT: ++b->clt; break;
+    case ACTION_SSL_FAIL: ++b->count; stats_conn_close(1); break;
+    case ACTION_ACC_BATCH: stats_accept_batch(r->krq); break;
+    case ACTION_SHED_IDLE: b->shi += r->krq; break;
+    case ACTION_SHED_TLS: ++b->sht; ++b->clt; break;
+    case ACTION_QUOTA: if (r->tls) ++b->trj; else ++b->hrj; ++b->clt; break;
+    case ACTION_RATE: if (r->rate == RATE_CONNS) ++b->rln; else ++b->rlc; break;
+    case ACTION_DEADLINE:
+      switch (r->deadline) {
+        case DEADLINE_HANDSHAKE: ++b->dlh; break;
+        case DEADLINE_HEADER:    ++b->dlr; break;
+        case DEADLINE_BODY:      ++b->dlb; break;
+      }
+      break;
+    default:
+      log_msg(LOG_DEBUG, "conn_handler reported unknown response value: %d", r->status);
+  }
+  switch (r->ssl) {
+    case SSL_HIT:        ++b->slh; break;
+    case SSL_HIT_CLS:    ++b->slc; break;
+    case SSL_MISS:       ++b->slm; break;
+    case SSL_ERR:        ++b->sle; break;
+    case SSL_UNKNOWN:    ++b->slu; break;
+    default:             ;
+  }
+  if (r->status < ACTION_LOG_VERB) {
+    b->count++;
+    // count only positive receive sizes
+    if (r->rx_total <= 0) {
+      log_msg(LOG_DEBUG, "nonsensical rx_total data value %d - ignoring", r->rx_total);
+    } else {
+      b->favg = ema(b->favg, r->rx_total, &b->favg_cnt);
+      if (r->rx_total > b->rmx)
+        b->rmx = r->rx_total;
+    }
+
+    lat_record(b, r);
+    trace_record(&b->trace, r);
+    if (r->status != FAIL_TIMEOUT) {
+      b->ftav = ema(b->ftav, r->run_time, &b->ftav_cnt);
+      // as before the handshake had a phase of its own
+      admission_sample(r->run_time + r->phase_time[PHASE_HANDSHAKE]);
+      // adding 0.5 for rounding
+      if (r->run_time + 0.5 > b->tmx)
+        b->tmx = (r->run_time + 0.5);
+    }
+  } else if (r->status == ACTION_DEC_KCC) {
+    b->fkvg = ema(b->fkvg, r->krq, &b->fkvg_cnt);
+    if (r->krq > b->krq)
+      b->krq = r->krq;
+  }
+}
+
+void stats_report(response_struct *r) {
+#ifdef USE_PTHREAD
+  stats_account(r);
+#else
+  // note that the parent must not perform a blocking pipe read without checking
+  // for available data, or else it may deadlock when we don't write anything
+  int rv = write(GLOBAL(g, pipefd), r, sizeof(*r));
+  if (rv < 0) {
+    log_msg(LGG_ERR, "write() to pipe reported error: %m");
+  } else if (rv == 0) {
+    log_msg(LGG_ERR, "write() to pipe reported no data written and no error");
+  } else if (rv != sizeof(*r)) {
+    log_msg(LGG_ERR, "write() to pipe reported writing only %d bytes of expected %u",
+        rv, (unsigned int)sizeof(*r));
+  }
+#endif
+}
+
+void stats_deadline(deadline_enum kind) {
+  response_struct r = {0};
+
+  r.status = ACTION_DEADLINE;
+  r.deadline = kind;
+  stats_report(&r);
+}
+
+void stats_sum(stats_sum_struct *s) {
+  stats_block_struct *b;
+  float favg = 0.0, ftav = 0.0, fkvg = 0.0;
+  long navg = 0, ntav = 0, nkvg = 0;
+
+  memset(s, 0, sizeof(*s));
+  // moving averages weighed by the samples behind them
+  for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+#define X(c) s->c += b->c;
+    STATS_SUMS(X)
+#undef X
+#define X(c) if (b->c > s->c) s->c = b->c;
+    STATS_MAXES(X)
+#undef X
+    favg += b->favg * b->favg_cnt;
+    navg += b->favg_cnt;
+    ftav += b->ftav * b->ftav_cnt;
+    ntav += b->ftav_cnt;
+    fkvg += b->fkvg * b->fkvg_cnt;
+    nkvg += b->fkvg_cnt;
+  }
+  s->avg = (navg) ? favg / navg + 0.5 : 0;
+  s->tav = (ntav) ? ftav / ntav + 0.5 : 0;
+  s->kvg = (nkvg) ? fkvg / nkvg : 0.0;
+}
+
+void stats_collect(void) {
+  stats_sum_struct s;
+
+  stats_sum(&s);
+#define X(c) c = s.c;
+  STATS_SUMS(X)
+  STATS_MAXES(X)
+#undef X
+  avg = s.avg;
+  tav = s.tav;
+  kvg = s.kvg;
+}
+
+void stats_series_sample(unsigned int *values, unsigned int *lat) {
+  stats_block_struct *b;
+  int i;
+
+  memset(values, 0, SERIES_NUM * sizeof(*values));
+  memset(lat, 0, LAT_BUCKETS * sizeof(*lat));
+  for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+#define X(c, name) values[SERIES_##c] += b->c;
+    SERIES_COUNTERS(X)
+#undef X
+    for (i = 0; i < LAT_BUCKETS; i++)
+      lat[i] += b->lat_all[i];
+  }
+}
+
+void stats_lat_sample(lat_sample_struct *s) {
+  stats_block_struct *b;
+  unsigned int *h = &s->lat[0][0];
+  unsigned long long *u = &s->usec[0];
+  int i;
+
+  memset(s, 0, sizeof(*s));
+  for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+    for (i = 0; i < sizeof(lat_hist_type) / sizeof(*h); i++)
+      h[i] += (&b->lat[0][0])[i];
+    for (i = 0; i < sizeof(lat_sum_type) / sizeof(*u); i++)
+      u[i] += b->lat_usec[i];
+  }
+}
+
+const char *stats_response_name(int st) {
+  return (st >= 0 && st < LAT_STATUSES && lat_names[st]) ? lat_names[st] : "";
+}
+
+void stats_lat_name(int i, char *name, size_t len) {
+  if (i < PHASE_TOTAL)
+    snprintf(name, len, "%s", phase_names[i]);
+  else
+    snprintf(name, len, "%s%s", phase_names[PHASE_TOTAL], stats_response_name(i - PHASE_TOTAL));
+}
+
+float stats_lat_quantile(const unsigned int *h, unsigned int n, double q) {
+  unsigned int want = q * n + 0.999, seen = 0;
+  int i;
+
+  for (i = 0; i < LAT_BUCKETS - 1; i++)
+    if ((seen += h[i]) >= want)
+      break;
+  return stats_lat_bound(i) / 1000.0;
+}
+
+#define LAT_ROW_LEN 192
+
+char *stats_latency(const lat_sample_struct *s, int html) {
+  unsigned int all[LAT_BUCKETS], n, total;
+  const unsigned int *h;
+  char *rows, *p, name[8];
+  int ph, st, i, len;
+
+  if (!(rows = calloc(PHASE_NUM + LAT_STATUSES, LAT_ROW_LEN)))
+    return NULL;
+  p = rows;
+  for (ph = 0; ph < PHASE_NUM; ph++) {
+    // all responses first, then each on its own where kept apart
+    memset(all, 0, sizeof(all));
+    for (st = 0; st < ((ph < PHASE_TOTAL) ? 1 : LAT_STATUSES); st++)
+      for (i = 0; i < LAT_BUCKETS; i++)
+        all[i] += s->lat[LAT_HIST(ph, st)][i];
+    for (total = 0, i = 0; i < LAT_BUCKETS; i++)
+      total += all[i];
+    if (!total)
+      continue;
+    for (st = -1; st < ((ph < PHASE_TOTAL) ? 0 : LAT_STATUSES); st++) {
+      h = (st < 0) ? all : s->lat[LAT_HIST(ph, st)];
+      for (n = 0, i = 0; i < LAT_BUCKETS; i++)
+        n += h[i];
+      if (!n || (st >= 0 && n == total))
+        continue;       /* nothing to show, or the same as all */
+      snprintf(name, sizeof(name), "%s%s", phase_names[ph], (st < 0) ? "" : lat_names[st]);
+      if (html)
+        len = snprintf(p, LAT_ROW_LEN, "%s<tr><td>%s</td><td>%.2f / %.2f / %.2f / %.2f ms</td><td>p50 / p90 / p99 / p99.9 %s (%u %s)</td></tr>",
+            (st < 0) ? "<tr><th colspan=\"3\"></th></tr>" : "", name, stats_lat_quantile(h, n, 0.5), stats_lat_quantile(h, n, 0.9), stats_lat_quantile(h, n, 0.99), stats_lat_quantile(h, n, 0.999),
+            phase_texts[ph], n, (st < 0) ? "all" : lat_names[st]);
+      else
+        len = snprintf(p, LAT_ROW_LEN, ", %.2f/%.2f/%.2f/%.2f %s",
+            stats_lat_quantile(h, n, 0.5), stats_lat_quantile(h, n, 0.9), stats_lat_quantile(h, n, 0.99), stats_lat_quantile(h, n, 0.999), name);
+      p += (len < LAT_ROW_LEN) ? len : LAT_ROW_LEN - 1;
+    }
+  }
+  return rows;
+}
+
+int stats_latency_metrics(strbuf_struct *sb, const lat_sample_struct *s) {
+  const unsigned int *h;
+  unsigned int n, buckets[LAT_MAX_BITS - LAT_SUB_BITS - 1];
+  char labels[48];
+  int ph, i, j, k, rv;
+
+  rv = strbuf_printf(sb, "# TYPE pixelserv_latency_seconds histogram\n"
+      "# HELP pixelserv_latency_seconds Time spent per request phase, whole requests by response\n");
+  for (j = 0; j < LAT_HISTS; j++) {
+    h = s->lat[j];
+    // buckets end where the powers of two start, from LAT_LINEAR usec
+    for (n = 0, i = 0, k = LAT_SUB_BITS + 1; i < LAT_BUCKETS; i++) {
+      if (i == LAT_LINEAR + ((k - LAT_SUB_BITS - 1) << LAT_SUB_BITS)) {
+        buckets[k - LAT_SUB_BITS - 1] = n;
+        k++;
+      }
+      n += h[i];
+    }
+    if (!n)
+      continue;
+    ph = (j < PHASE_TOTAL) ? j : PHASE_TOTAL;
+    if (ph < PHASE_TOTAL)
+      snprintf(labels, sizeof(labels), "phase=\"%s\"", phase_labels[ph]);
+    else
+      snprintf(labels, sizeof(labels), "phase=\"%s\",response=\"%s\"",
+          phase_labels[ph], lat_names[j - PHASE_TOTAL]);
+    // the same buckets every time, as collectors expect
+    for (k = LAT_SUB_BITS + 1; k < LAT_MAX_BITS; k++)
+      rv |= strbuf_printf(sb, "pixelserv_latency_seconds_bucket{%s,le=\"%.6f\"} %u\n",
+          labels, (1U << k) / 1e6, buckets[k - LAT_SUB_BITS - 1]);
+    rv |= strbuf_printf(sb, "pixelserv_latency_seconds_bucket{%s,le=\"+Inf\"} %u\n"
+        "pixelserv_latency_seconds_count{%s} %u\n"
+        "pixelserv_latency_seconds_sum{%s} %.6f\n",
+        labels, n, labels, n, labels, s->usec[j] / 1e6);
+  }
+  return rv;
+}
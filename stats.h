@@ -0,0 +1,118 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "util.h"
+#include "socket_handler.h"
+#include "hitters.h"
+#include "trace.h"
+
+/* counters summed over threads, and those of which the highest is shown */
+#define STATS_SUMS(X) \
+  X(count) X(err) X(tmo) X(cls) X(nou) X(pth) X(nfe) X(ufe) X(gif) X(bad) \
+  X(txt) X(jpg) X(png) X(swf) X(ico) X(sta) X(stt) X(stm) X(sse) X(trc) \
+  X(noc) X(rdr) X(pst) X(hed) X(opt) X(cly) X(slh) X(slm) X(sle) X(slc) \
+  X(slu) X(clt) X(shi) X(sht) X(shh) X(hrj) X(trj) X(rlc) X(rln) X(rlr) \
+  X(dlh) X(dlr) X(dlb) X(abw) X(abn)
+#define STATS_MAXES(X) \
+  X(rmx) X(tmx) X(krq) X(abx)
+
+/* log-linear latency histograms in usec, HDR style: exact below LAT_LINEAR,
+   then 2^LAT_SUB_BITS buckets per power of two up to 2^LAT_MAX_BITS usec
+   (67 s), so any value is off by at most 12.5% */
+#define LAT_SUB_BITS  3
+#define LAT_MAX_BITS  26
+#define LAT_LINEAR    (2 << LAT_SUB_BITS)
+#define LAT_BUCKETS   (LAT_LINEAR + (LAT_MAX_BITS - LAT_SUB_BITS - 1) * (1 << LAT_SUB_BITS))
+/* responses timed: all below ACTION_LOG_VERB */
+#define LAT_STATUSES  ACTION_LOG_VERB
+/* whole requests are timed per response, the phases within them over all
+   responses, which keeps the histograms of a thread under a third of the
+   size per-response phases would take */
+#define LAT_HISTS     (PHASE_TOTAL + LAT_STATUSES)
+#define LAT_HIST(ph, st)  (((ph) < PHASE_TOTAL) ? (ph) : PHASE_TOTAL + (st))
+
+typedef unsigned int lat_hist_type[LAT_HISTS][LAT_BUCKETS];
+typedef unsigned long long lat_sum_type[LAT_HISTS];
+
+// latency histograms added up over all threads, for readers of their own
+typedef struct {
+  lat_hist_type lat;
+  lat_sum_type usec;            /* sums behind the histograms */
+} lat_sample_struct;
+
+// counters of one thread, written by it alone
+typedef struct stats_block_struct {
+#define X(c) int c;
+  STATS_SUMS(X)
+  STATS_MAXES(X)
+#undef X
+  float favg, ftav, fkvg;       /* moving averages behind avg, tav and kvg */
+  int favg_cnt, ftav_cnt, fkvg_cnt;
+  lat_hist_type lat;
+  lat_sum_type lat_usec;        /* sums behind the histograms */
+  unsigned int lat_all[LAT_BUCKETS];  /* whole requests of any response */
+  hitters_struct hit;
+  trace_struct trace;
+  int in_use;                   /* owned by a live thread */
+  struct stats_block_struct *next;
+} __attribute__((aligned(CACHE_LINE))) stats_block_struct;
+
+// the counters of the calling thread
+stats_block_struct *stats_local(void);
+
+#define STATS_INC(c)  (++stats_local()->c)
+
+// the first of all blocks, linked by next, for readers of their own
+stats_block_struct *stats_blocks(void);
+
+// account what a handler reports. with USE_PTHREAD straight into the
+// counters of the calling thread, otherwise through the stats pipe to
+// main(), which passes it on to stats_account()
+void stats_report(response_struct *r);
+void stats_account(const response_struct *r);
+// report a connection killed at a deadline
+void stats_deadline(deadline_enum kind);
+// count n connections accepted in one listener wakeup
+void stats_accept_batch(int n);
+
+// a connection goes into or out of service. safe from any thread
+void stats_conn_open(int tls);
+void stats_conn_close(int tls);
+
+// counters of all threads added up
+typedef struct {
+#define X(c) int c;
+  STATS_SUMS(X)
+  STATS_MAXES(X)
+#undef X
+  int avg, tav;
+  float kvg;
+} stats_sum_struct;
+
+// add up the counters of all threads into s, for readers of their own
+void stats_sum(stats_sum_struct *s);
+// the same into the globals get_stats() prints
+void stats_collect(void);
+
+// the counters of SERIES_COUNTERS into values and lat_all into lat, each
+// added up over all threads. cheaper than stats_collect() by far
+void stats_series_sample(unsigned int *values, unsigned int *lat);
+// the latency histograms of all threads added up into s
+void stats_lat_sample(lat_sample_struct *s);
+// short name of response st below LAT_STATUSES, as on the stats pages
+const char *stats_response_name(int st);
+// name of histogram i, e.g. "hdr" or "totgif"
+void stats_lat_name(int i, char *name, size_t len);
+// highest value in usec falling into bucket i
+unsigned int stats_lat_bound(int i);
+// value in msec below which fraction q of the n samples in histogram h fall
+float stats_lat_quantile(const unsigned int *h, unsigned int n, double q);
+
+// p50/p90/p99/p99.9 of each phase and response seen in s, as rows of the
+// HTML stats table or entries of the text one. to be freed
+char *stats_latency(const lat_sample_struct *s, int html);
+// s as OpenMetrics histograms, bucketed by powers of two. returns -1 if out
+// of memory
+int stats_latency_metrics(strbuf_struct *sb, const lat_sample_struct *s);
+
+#endif // STATS_H
@@ -0,0 +1,173 @@
+#include "util.h" // _GNU_SOURCE
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "statseg.h"
+#include "stats.h"
+#include "logger.h"
+
+/*
+ * The stats segment, laid out in statseg.h. Once a second the counters and
+ * latency histograms of all threads are added up into a copy of our own,
+ * which then goes into the segment in one memcpy() between two increments
+ * of seq. Readers never make the server do anything, however often they
+ * poll. Values are those of the plain text stats, in the same order.
+ */
+
+#define STATSEG_HISTS  LAT_HISTS
+#define HIST_SIZE      ((sizeof(statseg_hist_struct) + LAT_BUCKETS * sizeof(uint32_t) + 7) & ~7)
+
+static statseg_header_struct *seg = NULL;
+static unsigned char *copy = NULL;      /* the next update, header aside */
+static size_t seg_size;
+static pid_t owner;
+static char *seg_name;
+static ino_t seg_ino;
+static time_t last;
+static lat_sample_struct sample;
+
+/* leave the name to an instance which took over, if any */
+static void statseg_close(void) {
+  struct stat st;
+  int fd;
+
+  if (getpid() != owner)
+    return;
+  if ((fd = shm_open(seg_name, O_RDONLY, 0)) < 0)
+    return;
+  if (fstat(fd, &st) == 0 && st.st_ino == seg_ino)
+    shm_unlink(seg_name);
+  close(fd);
+}
+
+void statseg_update(void) {
+  statseg_value_struct *v;
+  statseg_hist_struct *h;
+  const char *names[FEED_VALUES];
+  int values[FEED_VALUES];
+  struct timespec now;
+  int i, j, num;
+
+  if (!seg)
+    return;
+  get_time(&now);
+  if (now.tv_sec == last)
+    return;
+  last = now.tv_sec;
+
+  num = get_feed_sample(names, values);
+  v = (statseg_value_struct *)(copy + seg->values_off - sizeof(*seg));
+  for (i = 0; i < num; i++) {
+    strncpy(v[i].name, names[i], STATSEG_NAME_LEN);
+    v[i].value = values[i];
+  }
+  stats_lat_sample(&sample);
+  for (j = 0; j < STATSEG_HISTS; j++) {
+    h = (statseg_hist_struct *)(copy + seg->hists_off - sizeof(*seg) + j * HIST_SIZE);
+    for (h->count = 0, i = 0; i < LAT_BUCKETS; i++)
+      h->count += (h->buckets[i] = sample.lat[j][i]);
+    h->usec = sample.usec[j];
+  }
+
+  __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  seg->num_values = num;
+  seg->updated = time(NULL);
+  memcpy(seg + 1, copy, seg_size - sizeof(*seg));
+  __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef USE_PTHREAD
+static void *statseg_thread(void *arg) {
+  struct timespec now, ts;
+  long nsec;
+
+  for (;;) {
+    get_time(&now);
+    nsec = 1001000000L - now.tv_nsec;
+    ts.tv_sec = nsec / 1000000000L;
+    ts.tv_nsec = nsec % 1000000000L;
+    nanosleep(&ts, NULL);
+    statseg_update();
+  }
+  return NULL;
+}
+#endif
+
+int statseg_init(const char *name, size_t stack_size) {
+  statseg_hist_struct *h;
+  uint32_t *bounds;
+  struct stat st;
+  int fd, i;
+#ifdef USE_PTHREAD
+  pthread_attr_t attr;
+  pthread_t thread;
+  int err;
+#endif
+
+  seg_size = sizeof(statseg_header_struct) + FEED_VALUES * sizeof(statseg_value_struct)
+      + STATSEG_HISTS * HIST_SIZE + LAT_BUCKETS * sizeof(uint32_t);
+  if (!(copy = calloc(1, seg_size - sizeof(statseg_header_struct)))
+      || !(seg_name = strdup(name)))
+    goto fail;
+  // a new object under the name: readers of the one before keep theirs
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+    log_msg(LGG_ERR, "shm_open %s: %m", name);
+    goto fail;
+  }
+  if (ftruncate(fd, seg_size) < 0 || fstat(fd, &st) < 0
+      || (seg = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    log_msg(LGG_ERR, "stats segment %s: %m", name);
+    seg = NULL;
+    close(fd);
+    shm_unlink(name);
+    goto fail;
+  }
+  close(fd);
+  seg_ino = st.st_ino;
+  owner = getpid();
+  atexit(statseg_close);
+
+  seg->magic = STATSEG_MAGIC;
+  seg->version = STATSEG_VERSION;
+  seg->size = seg_size;
+  seg->pid = owner;
+  seg->interval = 1000;
+  seg->started = time(NULL);
+  seg->values_off = sizeof(*seg);
+  seg->num_hists = STATSEG_HISTS;
+  seg->hists_off = seg->values_off + FEED_VALUES * sizeof(statseg_value_struct);
+  seg->hist_size = HIST_SIZE;
+  seg->num_buckets = LAT_BUCKETS;
+  seg->bounds_off = seg->hists_off + STATSEG_HISTS * HIST_SIZE;
+  for (i = 0; i < STATSEG_HISTS; i++) {
+    h = (statseg_hist_struct *)(copy + seg->hists_off - sizeof(*seg) + i * HIST_SIZE);
+    stats_lat_name(i, h->name, STATSEG_NAME_LEN);
+  }
+  bounds = (uint32_t *)(copy + seg->bounds_off - sizeof(*seg));
+  for (i = 0; i < LAT_BUCKETS; i++)
+    bounds[i] = stats_lat_bound(i);
+  statseg_update();
+
+#ifdef USE_PTHREAD
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, stack_size);
+  if ((err = pthread_create(&thread, &attr, statseg_thread, NULL))) {
+    log_msg(LGG_ERR, "Failed to create stats segment thread. err: %d", err);
+    return -1;
+  }
+#endif
+  return 0;
+
+fail:
+  free(copy);
+  copy = NULL;
+  return -1;
+}
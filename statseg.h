@@ -0,0 +1,64 @@
+#ifndef STATSEG_H
+#define STATSEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Layout of the stats segment, a POSIX shared memory object pixelserv-tls
+ * publishes its statistics in once a second, for pixelserv-stat and other
+ * readers on the same host to map and read without asking the server.
+ * The header tells where each table is and how large its entries are, so
+ * a reader finds what it knows about in later versions as well; it must
+ * refuse another magic or a version other than its own.
+ *
+ * seq is odd while the writer is updating. A reader copies what it wants,
+ * then takes seq again, and tries anew if it changed or was odd.
+ */
+
+#define DEFAULT_STATSEG_NAME  "/pixelserv-tls"
+#define STATSEG_MAGIC         0x54535850    /* "PXST" */
+#define STATSEG_VERSION       1
+#define STATSEG_NAME_LEN      8
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t size;                /* of the whole segment */
+  int32_t pid;                  /* of the instance writing it */
+  uint32_t interval;            /* msec between updates */
+  int64_t started;              /* time the instance started, unix secs */
+  int64_t updated;              /* time of the last update, unix secs */
+  uint32_t num_values;          /* counters and gauges */
+  uint32_t values_off;          /* from the start of the segment */
+  uint32_t num_hists;           /* latency histograms */
+  uint32_t hists_off;
+  uint32_t hist_size;           /* of each, buckets included */
+  uint32_t num_buckets;
+  uint32_t bounds_off;          /* highest usec of each bucket */
+} statseg_header_struct;
+
+typedef struct {
+  char name[STATSEG_NAME_LEN];  /* as on the stats pages, NUL padded */
+  int64_t value;
+} statseg_value_struct;
+
+typedef struct {
+  char name[STATSEG_NAME_LEN];  /* phase, and response if total: "hdr", "totgif" */
+  uint64_t count;
+  uint64_t usec;                /* sum of all samples */
+  uint32_t buckets[];           /* num_buckets of them */
+} statseg_hist_struct;
+
+// the server side, in statseg.c
+
+// create the segment under name, replacing one left by an instance before,
+// and with USE_PTHREAD start a thread of stack_size updating it, otherwise
+// main() calls statseg_update(). returns 0 on success
+int statseg_init(const char *name, size_t stack_size);
+
+// bring the segment up to date, once per second at most
+void statseg_update(void);
+
+#endif // STATSEG_H
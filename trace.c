@@ -0,0 +1,157 @@
+#include "util.h" // _GNU_SOURCE
+
+#include "trace.h"
+#include "stats.h"
+#include "logger.h"
+
+/*
+ * Traces of single requests, for the tail latency which histograms only
+ * count. Handlers stamp the marks a request passes into its report, and
+ * the thread accounting for it keeps the trace in two rings of its stats
+ * block: one of the latest requests and one of those over warning_time,
+ * which fast requests do not push out. Each record carries a sequence
+ * number, odd while it is being written, so readers copy records without
+ * locking and drop any which changed meanwhile.
+ */
+
+typedef struct {
+  trace_rec_struct rec;
+  int thread;
+} trace_entry_struct;
+
+extern struct Global *g;
+
+static const char *mark_names[TRACE_MARKS] = {
+  "handshake", "handshaken", "first_byte", "parsed", "written"
+};
+
+void trace_mark(unsigned int *trace, trace_enum m, const struct timespec *base) {
+#ifdef USE_PTHREAD
+  double usec = elapsed_time_msec(*base) * 1000;
+
+  // 0 is for marks not reached
+  trace[m] = (usec >= 1) ? usec : 1;
+#endif
+}
+
+#ifdef USE_PTHREAD
+static void rec_write(trace_rec_struct *rec, const trace_rec_struct *from) {
+  uint32_t seq = rec->seq;
+
+  __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->id = from->id;
+  rec->ended = from->ended;
+  rec->total = from->total;
+  memcpy(rec->mark, from->mark, sizeof(rec->mark));
+  rec->status = from->status;
+  rec->tls = from->tls;
+  rec->from_accept = from->from_accept;
+  __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+}
+#endif
+
+/* copy rec into to unless being written. returns 0 if copied */
+static int rec_read(const trace_rec_struct *rec, trace_rec_struct *to) {
+  uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+  if (!seq || (seq & 1))
+    return -1;
+  *to = *rec;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) ? 0 : -1;
+}
+
+void trace_record(trace_struct *t, const response_struct *r) {
+#ifdef USE_PTHREAD
+  const int warning_time = GLOBAL(g, warning_time);
+  trace_rec_struct rec;
+  struct timespec now;
+  double total;
+  int m;
+
+  // as for admission, the handshake counts towards the first request.
+  // that of a plain connection is timed from its start, marked from the
+  // accept
+  total = r->run_time + r->phase_time[PHASE_HANDSHAKE];
+  for (m = 0; m < TRACE_MARKS; m++)
+    if (r->trace[m] > total * 1000)
+      total = r->trace[m] / 1000.0;
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec.id = t->num;
+  rec.ended = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  rec.total = (total > 0) ? total * 1000 : 0;
+  memcpy(rec.mark, r->trace, sizeof(rec.mark));
+  rec.status = r->status;
+  rec.tls = (r->ssl != SSL_NOT_TLS);
+  rec.from_accept = (r->trace_accept != 0);
+
+  rec_write(&t->recent[t->num++ % TRACE_RECENT], &rec);
+  if (warning_time > 0 && total > warning_time) {
+    rec_write(&t->slow[t->num_slow++ % TRACE_SLOW], &rec);
+    log_msg(LGG_DEBUG, "Elapsed time %f msec exceeded warning_time=%d msec, status=%d",
+        total, warning_time, r->status);
+  }
+#endif
+}
+
+static int entry_cmp(const void *a, const void *b) {
+  const trace_entry_struct *x = a, *y = b;
+
+  if (x->rec.ended != y->rec.ended)
+    return (x->rec.ended > y->rec.ended) ? -1 : 1;
+  if (x->thread != y->thread)
+    return x->thread - y->thread;
+  return (x->rec.id > y->rec.id) - (x->rec.id < y->rec.id);
+}
+
+char *trace_dump(void) {
+  const int warning_time = GLOBAL(g, warning_time);
+  strbuf_struct sb = {0};
+  trace_entry_struct *e;
+  stats_block_struct *b;
+  int i, n, m, thread, rv;
+
+  for (n = 0, b = stats_blocks(); b; b = b->next)
+    n += TRACE_RECENT + TRACE_SLOW;
+  if (!(e = malloc((n + 1) * sizeof(*e))))
+    return NULL;
+  for (n = 0, thread = 0, b = stats_blocks(); b; b = b->next, thread++) {
+    for (i = 0; i < TRACE_RECENT; i++)
+      if (!rec_read(&b->trace.recent[i], &e[n].rec))
+        e[n++].thread = thread;
+    for (i = 0; i < TRACE_SLOW; i++)
+      if (!rec_read(&b->trace.slow[i], &e[n].rec))
+        e[n++].thread = thread;
+  }
+  qsort(e, n, sizeof(*e), entry_cmp);
+
+  rv = strbuf_printf(&sb, "# requests traced, newest first. marks in usec from the accept"
+      " (\"acc\", first request of a connection) or the start of the request (\"req\"), - if not reached");
+  if (warning_time > 0)
+    rv |= strbuf_printf(&sb, "; * over warning_time of %d msec", warning_time);
+  rv |= strbuf_printf(&sb, "\n# ended thread id response tls from total");
+  for (m = 0; m < TRACE_MARKS; m++)
+    rv |= strbuf_printf(&sb, " %s", mark_names[m]);
+  rv |= strbuf_printf(&sb, "\n");
+  for (i = 0; i < n; i++) {
+    // a slow request is in both rings while the recent one still has it
+    if (i && !entry_cmp(&e[i - 1], &e[i]))
+      continue;
+    rv |= strbuf_printf(&sb, "%lld.%06lld %d %u %s %s %s %u%s",
+        (long long)(e[i].rec.ended / 1000000), (long long)(e[i].rec.ended % 1000000),
+        e[i].thread, e[i].rec.id, stats_response_name(e[i].rec.status),
+        (e[i].rec.tls) ? "yes" : "no", (e[i].rec.from_accept) ? "acc" : "req", e[i].rec.total,
+        (warning_time > 0 && e[i].rec.total > warning_time * 1000U) ? "*" : "");
+    for (m = 0; m < TRACE_MARKS; m++)
+      rv |= (e[i].rec.mark[m]) ? strbuf_printf(&sb, " %u", e[i].rec.mark[m])
+                               : strbuf_printf(&sb, " -");
+    rv |= strbuf_printf(&sb, "\n");
+  }
+  free(e);
+  if (rv < 0) {
+    free(sb.buf);
+    return NULL;
+  }
+  return sb.buf;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "socket_handler.h"
+
+#define TRACE_RECENT  64        /* latest requests kept by each thread */
+#define TRACE_SLOW    32        /* latest over warning_time, kept apart */
+
+typedef struct {
+  uint32_t seq;                 /* odd while being written, 0 if never */
+  uint32_t id;                  /* requests traced by the thread before */
+  int64_t ended;                /* unix time in usec */
+  uint32_t total;               /* usec, handshake included */
+  uint32_t mark[TRACE_MARKS];   /* as in response_struct */
+  uint8_t status;               /* response_enum */
+  uint8_t tls;
+  uint8_t from_accept;
+} trace_rec_struct;
+
+// trace rings of one thread, part of its stats block. written by it alone
+typedef struct {
+  trace_rec_struct recent[TRACE_RECENT];
+  trace_rec_struct slow[TRACE_SLOW];
+  uint32_t num;                 /* requests traced */
+  uint32_t num_slow;
+} trace_struct;
+
+// stamp mark m of trace as reached now, the request having started at base
+void trace_mark(unsigned int *trace, trace_enum m, const struct timespec *base);
+
+// keep the trace of a request reported by a handler in the rings of the
+// calling thread. not kept without USE_PTHREAD
+void trace_record(trace_struct *t, const response_struct *r);
+
+// the traces of all threads, newest first, as text. to be freed
+char *trace_dump(void);
+
+#endif // TRACE_H
@@ -0,0 +1,175 @@
+#include "util.h" // _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_supported(void) {
+  static int supported = -1;
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t len = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  int fd;
+
+  if (supported >= 0)
+    return supported;
+  supported = 0;
+  memset(&p, 0, sizeof(p));
+  if ((fd = sys_io_uring_setup(4, &p)) < 0)
+    return 0;
+  /* IORING_OP_SOCKET came with multishot accept in 5.19 */
+  if ((p.features & IORING_FEAT_EXT_ARG) && (probe = calloc(1, len))) {
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0
+        && probe->last_op >= IORING_OP_SOCKET
+        && (probe->ops[IORING_OP_SOCKET].flags & IO_URING_OP_SUPPORTED))
+      supported = 1;
+    free(probe);
+  }
+  close(fd);
+  return supported;
+}
+
+int uring_init(uring_struct *r, unsigned entries) {
+  struct io_uring_params p;
+  unsigned i;
+
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = sys_io_uring_setup(entries, &p)) < 0)
+    return -1;
+  r->features = p.features;
+
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_sz > r->sq_ring_sz)
+      r->sq_ring_sz = r->cq_ring_sz;
+    r->cq_ring_sz = r->sq_ring_sz;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else {
+    r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      goto err;
+    }
+  }
+  r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto err;
+  }
+
+  r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+  /* entries are always used in ring order */
+  for (i = 0; i < r->sq_entries; i++)
+    r->sq_array[i] = i;
+  r->sqe_head = r->sqe_tail = *r->sq_tail;
+  return 0;
+
+err:
+  uring_exit(r);
+  return -1;
+}
+
+void uring_exit(uring_struct *r) {
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_sz);
+  if (r->cq_ring && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_sz);
+  if (r->sq_ring && r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_ring_sz);
+  if (r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+/* publish queued entries and tell the kernel about them */
+static int uring_enter(uring_struct *r, unsigned min_complete, unsigned flags,
+                       void *arg, size_t argsz) {
+  unsigned to_submit = r->sqe_tail - r->sqe_head;
+  int rv;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  rv = sys_io_uring_enter(r->fd, to_submit, min_complete, flags, arg, argsz);
+  if (rv > 0)
+    r->sqe_head += rv;
+  return rv;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_struct *r) {
+  struct io_uring_sqe *sqe;
+
+  if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    uring_enter(r, 0, 0, NULL, 0);
+    if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+      return NULL;
+  }
+  sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+  r->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit_and_wait(uring_struct *r, int timeout_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    arg.ts = (unsigned long)&ts;
+  }
+  if (uring_enter(r, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+    return -1;
+  return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_struct *r) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_struct *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // HAVE_IO_URING
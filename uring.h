@@ -0,0 +1,59 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * Minimal io_uring plumbing on top of the raw syscalls, just enough for the
+ * event workers. Built only where the kernel headers know multishot accept;
+ * whether the running kernel supports it is checked at runtime.
+ */
+
+#if defined(USE_PTHREAD) && defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#   define HAVE_IO_URING
+#  endif
+# endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+typedef struct {
+  int fd;
+  unsigned features;
+  /* submission queue */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  unsigned sqe_head, sqe_tail;        /* our view: submitted / queued */
+  struct io_uring_sqe *sqes;
+  /* completion queue */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* mappings */
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} uring_struct;
+
+// 1 if the running kernel has what the event workers need (5.19+)
+int uring_supported(void);
+
+// set up a ring with room for entries submissions. returns 0 on success,
+// -1 with errno set
+int uring_init(uring_struct *r, unsigned entries);
+void uring_exit(uring_struct *r);
+
+// next free, zeroed submission entry; submits queued entries if the ring is
+// full. returns NULL if still no room
+struct io_uring_sqe *uring_get_sqe(uring_struct *r);
+
+// submit queued entries and wait up to timeout_ms (-1: forever) for at
+// least one completion. returns 0, or -1 with errno set (ETIME on timeout)
+int uring_submit_and_wait(uring_struct *r, int timeout_ms);
+
+// next completion or NULL; uring_cqe_seen() hands it back to the kernel
+struct io_uring_cqe *uring_peek_cqe(uring_struct *r);
+void uring_cqe_seen(uring_struct *r);
+
+#endif // HAVE_IO_URING
+
+#endif // URING_H
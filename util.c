@@ -1,11 +1,21 @@
 #include "util.h"
 #include "logger.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "series.h"
+#include "hitters.h"
+#include "certs.h"
+#include <stdarg.h>
+#ifndef USE_PTHREAD
+#include <sys/mman.h>
+#endif
 #if defined(__GLIBC__) && defined(BACKTRACE)
 #include <execinfo.h>
 #endif
 
 // stats data
-// note that child processes inherit a snapshot copy
+// note that child processes inherit a snapshot copy; pre-forked workers
+// refresh theirs from the segment main() publishes to
 // public data (should probably change to a struct)
 volatile sig_atomic_t count = 0;
 volatile sig_atomic_t avg = 0;
@@ -28,6 +38,9 @@ volatile sig_atomic_t swf = 0;
 volatile sig_atomic_t ico = 0;
 volatile sig_atomic_t sta = 0;
 volatile sig_atomic_t stt = 0;
+volatile sig_atomic_t stm = 0;
+volatile sig_atomic_t sse = 0;
+volatile sig_atomic_t trc = 0;
 volatile sig_atomic_t noc = 0;
 volatile sig_atomic_t rdr = 0;
 volatile sig_atomic_t pst = 0;
@@ -45,11 +58,60 @@ volatile sig_atomic_t kmx = 0;
 float kvg = 0.0;
 volatile sig_atomic_t krq = 0;
 volatile sig_atomic_t clt = 0;
+volatile sig_atomic_t pln = 0;
+volatile sig_atomic_t plb = 0;
+volatile sig_atomic_t plx = 0;
+volatile sig_atomic_t abw = 0;
+volatile sig_atomic_t abn = 0;
+volatile sig_atomic_t abx = 0;
+volatile sig_atomic_t shi = 0;
+volatile sig_atomic_t sht = 0;
+volatile sig_atomic_t shh = 0;
+volatile sig_atomic_t hcc = 0;
+volatile sig_atomic_t hcq = 0;
+volatile sig_atomic_t hrj = 0;
+volatile sig_atomic_t tcc = 0;
+volatile sig_atomic_t tcq = 0;
+volatile sig_atomic_t trj = 0;
+volatile sig_atomic_t rlc = 0;
+volatile sig_atomic_t rln = 0;
+volatile sig_atomic_t rlr = 0;
+volatile sig_atomic_t dlh = 0;
+volatile sig_atomic_t dlr = 0;
+volatile sig_atomic_t dlb = 0;
+volatile sig_atomic_t ihc = 0;
+volatile sig_atomic_t ihm = 0;
+volatile sig_atomic_t itc = 0;
+volatile sig_atomic_t itm = 0;
 
 // private data
 static struct timespec startup_time = {0, 0};
 static clockid_t clock_source = CLOCK_MONOTONIC;
 
+#ifndef USE_PTHREAD
+// counters main() publishes for pre-forked worker processes
+#define STATS_COUNTERS(X) \
+  X(count) X(avg) X(rmx) X(tav) X(tmx) X(err) X(tmo) X(cls) X(nou) X(pth) \
+  X(nfe) X(ufe) X(gif) X(bad) X(txt) X(jpg) X(png) X(swf) X(ico) X(sta) \
+  X(stt) X(stm) X(sse) X(trc) X(noc) X(rdr) X(pst) X(hed) X(opt) X(cly) \
+  X(slh) X(slm) X(sle) X(slc) X(slu) X(kcc) X(kmx) X(krq) X(clt) X(pln) \
+  X(plb) X(plx) X(abw) X(abn) X(abx) X(shi) X(sht) X(shh) X(hcc) X(hcq) \
+  X(hrj) X(tcc) X(tcq) X(trj) X(rlc) X(rln) X(rlr) X(dlh) X(dlr) X(dlb)
+
+typedef struct {
+#define X(c) int c;
+  STATS_COUNTERS(X)
+#undef X
+  float kvg;
+  int verb;
+  lat_sample_struct lat;
+} stats_shm_struct;
+
+static stats_shm_struct *stats_shm = NULL;
+static int stats_shm_reader = 0;
+static time_t stats_shm_published = 0;
+#endif
+
 void get_time(struct timespec *time) {
   if (clock_gettime(clock_source, time) < 0) {
     if (errno == EINVAL &&
@@ -112,31 +174,298 @@ char* get_version(int argc, char* argv[]) {
   return retbuf;
 }
 
+// bring the globals up to date with the counters of all threads
+static void stats_refresh(void) {
+#ifndef USE_PTHREAD
+    if (stats_shm_reader)
+      stats_shm_load();
+    else
+#endif
+    stats_collect();
+}
+
+// the latency histograms of all threads, or as main() published them, in
+// a buffer of the caller's: renderers may run at the same time. to be freed
+static lat_sample_struct *lat_refresh(void) {
+    lat_sample_struct *s = malloc(sizeof(*s));
+
+    if (!s)
+      return NULL;
+#ifndef USE_PTHREAD
+    if (stats_shm_reader) {
+      memcpy(s, &stats_shm->lat, sizeof(*s));
+      return s;
+    }
+#endif
+    stats_lat_sample(s);
+    return s;
+}
+
 char* get_stats(const int sta_offset, const int stt_offset) {
-    char* retbuf = NULL, *uptimeStr = NULL;
+    char* retbuf = NULL, *uptimeStr = NULL, *topStr = NULL, *latStr = NULL, *seriesStr = NULL, *hitStr = NULL;
+    lat_sample_struct *lat;
     struct timespec current_time;
     long uptime;
+    int rv;
 
-	const char* sta_fmt =  "<br><table><tr><td>uts</td><td>%s</td><td>process uptime</td></tr><tr><td>log</td><td>%d</td><td>critical (0) error (1) warning (2) notice (3) info (4) debug (5)</td></tr><tr><td>kcc</td><td>%d</td><td>number of active service threads</td></tr><tr><td>kmx</td><td>%d</td><td>maximum number of service threads</td></tr><tr><td>kvg</td><td>%.2f</td><td>average number of requests per service thread</td></tr><tr><td>krq</td><td>%d</td><td>max number of requests by one service thread</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>req</td><td>%d</td><td>total # of requests (HTTP, HTTPS, success, failure etc)</td></tr><tr><td>avg</td><td>%d bytes</td><td>average size of requests</td></tr><tr><td>rmx</td><td>%d bytes</td><td>largest size of request(s)</td></tr><tr><td>tav</td><td>%d ms</td><td>average processing time (per request)</td></tr><tr><td>tmx</td><td>%d ms</td><td>longest processing time (per request)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>slh</td><td>%d</td><td># of accepted HTTPS requests</td></tr><tr><td>slm</td><td>%d</td><td># of rejected HTTPS requests (missing certificate)</td></tr><tr><td>sle</td><td>%d</td><td># of rejected HTTPS requests (certificate available but bad)</td></tr><tr><td>slc</td><td>%d</td><td># of dropped HTTPS requests (client disconnect without sending any request)</td></tr><tr><td>slu</td><td>%d</td><td># of dropped HTTPS requests (unknown error)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>nfe</td><td>%d</td><td># of GET requests for server-side scripting</td></tr><tr><td>gif</td><td>%d</td><td># of GET requests for GIF</td></tr><tr><td>ico</td><td>%d</td><td># of GET requests for ICO</td></tr><tr><td>txt</td><td>%d</td><td># of GET requests for Javascripts</td></tr><tr><td>jpg</td><td>%d</td><td># of GET requests for JPG</td></tr><tr><td>png</td><td>%d</td><td># of GET requests for PNG</td></tr><tr><td>swf</td><td>%d</td><td># of GET requests for SWF</td></tr><tr><td>sta</td><td>%d</td><td># of GET requests for HTML stats</td></tr><tr><td>stt</td><td>%d</td><td># of GET requests for plain text stats</td></tr><tr><td>ufe</td><td>%d</td><td># of GET requests /w unknown file extension</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>opt</td><td>%d</td><td># of OPTIONS requests</td></tr><tr><td>pst</td><td>%d</td><td># of POST requests</td></tr><tr><td>hed</td><td>%d</td><td># of HEAD requests (HTTP 501 response)</td></tr><tr><td>rdr</td><td>%d</td><td># of GET requests resulted in REDIRECT response</td></tr><tr><td>nou</td><td>%d</td><td># of GET requests /w empty URL</td></tr><tr><td>pth</td><td>%d</td><td># of GET requests /w malformed URL</td></tr><tr><td>204</td><td>%d</td><td># of GET requests (HTTP 204 response)</td></tr><tr><td>bad</td><td>%d</td><td># of unknown HTTP requests (HTTP 501 response)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>tmo</td><td>%d</td><td># of timeout requests (client connect w/o sending a request in 'select_timeout' secs)</td></tr><tr><td>cls</td><td>%d</td><td># of dropped requests (client disconnect without sending any  request)</td></tr><tr><td>cly</td><td>%d</td><td># of dropped requests (client disconnect before response sent)</td></tr><tr><td>clt</td><td>%d</td><td># of dropped requests (reached maximum service threads)</td></tr><tr><td>err</td><td>%d</td><td># of dropped requests (unknown reason)</td></tr></table>";
+	const char* sta_fmt =  "<br><table><tr><td>uts</td><td>%s</td><td>process uptime</td></tr><tr><td>log</td><td>%d</td><td>critical (0) error (1) warning (2) notice (3) info (4) debug (5)</td></tr><tr><td>kcc</td><td>%d</td><td>number of active service threads</td></tr><tr><td>kmx</td><td>%d</td><td>maximum number of service threads</td></tr><tr><td>kvg</td><td>%.2f</td><td>average number of requests per service thread</td></tr><tr><td>krq</td><td>%d</td><td>max number of requests by one service thread</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>req</td><td>%d</td><td>total # of requests (HTTP, HTTPS, success, failure etc)</td></tr><tr><td>avg</td><td>%d bytes</td><td>average size of requests</td></tr><tr><td>rmx</td><td>%d bytes</td><td>largest size of request(s)</td></tr><tr><td>tav</td><td>%d ms</td><td>average processing time (per request)</td></tr><tr><td>tmx</td><td>%d ms</td><td>longest processing time (per request)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>slh</td><td>%d</td><td># of accepted HTTPS requests</td></tr><tr><td>slm</td><td>%d</td><td># of rejected HTTPS requests (missing certificate)</td></tr><tr><td>sle</td><td>%d</td><td># of rejected HTTPS requests (certificate available but bad)</td></tr><tr><td>slc</td><td>%d</td><td># of dropped HTTPS requests (client disconnect without sending any request)</td></tr><tr><td>slu</td><td>%d</td><td># of dropped HTTPS requests (unknown error)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>nfe</td><td>%d</td><td># of GET requests for server-side scripting</td></tr><tr><td>gif</td><td>%d</td><td># of GET requests for GIF</td></tr><tr><td>ico</td><td>%d</td><td># of GET requests for ICO</td></tr><tr><td>txt</td><td>%d</td><td># of GET requests for Javascripts</td></tr><tr><td>jpg</td><td>%d</td><td># of GET requests for JPG</td></tr><tr><td>png</td><td>%d</td><td># of GET requests for PNG</td></tr><tr><td>swf</td><td>%d</td><td># of GET requests for SWF</td></tr><tr><td>sta</td><td>%d</td><td># of GET requests for HTML stats</td></tr><tr><td>stt</td><td>%d</td><td># of GET requests for plain text stats</td></tr><tr><td>stm</td><td>%d</td><td># of GET requests for OpenMetrics stats</td></tr><tr><td>sse</td><td>%d</td><td># of GET requests for the stats feed (server-sent events)</td></tr><tr><td>trc</td><td>%d</td><td># of GET requests for the request trace</td></tr><tr><td>ufe</td><td>%d</td><td># of GET requests /w unknown file extension</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>opt</td><td>%d</td><td># of OPTIONS requests</td></tr><tr><td>pst</td><td>%d</td><td># of POST requests</td></tr><tr><td>hed</td><td>%d</td><td># of HEAD requests (HTTP 501 response)</td></tr><tr><td>rdr</td><td>%d</td><td># of GET requests resulted in REDIRECT response</td></tr><tr><td>nou</td><td>%d</td><td># of GET requests /w empty URL</td></tr><tr><td>pth</td><td>%d</td><td># of GET requests /w malformed URL</td></tr><tr><td>204</td><td>%d</td><td># of GET requests (HTTP 204 response)</td></tr><tr><td>bad</td><td>%d</td><td># of unknown HTTP requests (HTTP 501 response)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>tmo</td><td>%d</td><td># of timeout requests (client connect w/o sending a request in 'select_timeout' secs)</td></tr><tr><td>dlh</td><td>%d</td><td># of connections killed (TLS handshake not complete in 'select_timeout' secs)</td></tr><tr><td>dlr</td><td>%d</td><td># of connections killed (request headers not complete in 'select_timeout' secs)</td></tr><tr><td>dlb</td><td>%d</td><td># of connections killed (POST content not complete in time)</td></tr><tr><td>cls</td><td>%d</td><td># of dropped requests (client disconnect without sending any  request)</td></tr><tr><td>cly</td><td>%d</td><td># of dropped requests (client disconnect before response sent)</td></tr><tr><td>clt</td><td>%d</td><td># of dropped requests (reached maximum service threads)</td></tr><tr><td>shi</td><td>%d</td><td># of idle keep-alive connections closed under load</td></tr><tr><td>sht</td><td>%d</td><td># of new HTTPS connections reset under load</td></tr><tr><td>shh</td><td>%d</td><td># of new HTTP connections answered 503 (thread pool queue full)</td></tr><tr><td>err</td><td>%d</td><td># of dropped requests (unknown reason)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>pln</td><td>%d</td><td>number of threads in service thread pool</td></tr><tr><td>plb</td><td>%d</td><td>number of busy threads in service thread pool</td></tr><tr><td>plx</td><td>%d</td><td>maximum number of threads in service thread pool</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>hcc</td><td>%d</td><td>number of HTTP connections in service</td></tr><tr><td>hcq</td><td>%d</td><td>maximum number of HTTP connections in service (quota)</td></tr><tr><td>hrj</td><td>%d</td><td># of new HTTP connections answered 503 (quota reached)</td></tr><tr><td>tcc</td><td>%d</td><td>number of HTTPS connections in service</td></tr><tr><td>tcq</td><td>%d</td><td>maximum number of HTTPS connections in service (quota)</td></tr><tr><td>trj</td><td>%d</td><td># of new HTTPS connections reset (quota reached)</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>abg</td><td>%.2f</td><td>average number of connections accepted per wakeup</td></tr><tr><td>abx</td><td>%d</td><td>maximum number of connections accepted per wakeup</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>ihc</td><td>%d</td><td>number of idle HTTP keep-alive connections (event mode)</td></tr><tr><td>ihb</td><td>%d bytes</td><td>memory held per idle HTTP connection, excluding socket buffers</td></tr><tr><td>itc</td><td>%d</td><td>number of idle HTTPS keep-alive connections (event mode)</td></tr><tr><td>itb</td><td>%d bytes</td><td>memory held per idle HTTPS connection incl. TLS state, excluding socket buffers</td></tr><tr><th colspan=\"3\"></th></tr><tr><td>rlc</td><td>%d</td><td># of new connections refused (client over connection rate limit)</td></tr><tr><td>rln</td><td>%d</td><td># of new connections refused (client over open connection limit)</td></tr><tr><td>rlr</td><td>%d</td><td># of requests answered 429 (client over request rate limit)</td></tr>%s%s%s%s</table>";
 
-    const char* stt_fmt = "%d uts, %d log, %d kcc, %d kmx, %.2f kvg, %d krq, %d req, %d avg, %d rmx, %d tav, %d tmx, %d slh, %d slm, %d sle, %d slc, %d slu, %d nfe, %d gif, %d ico, %d txt, %d jpg, %d png, %d swf, %d sta, %d stt, %d ufe, %d opt, %d pst, %d hed, %d rdr, %d nou, %d pth, %d 204, %d bad, %d tmo, %d cls, %d cly, %d clt, %d err";
+    // fields keep their places for scripts taking them by position: new
+    // ones go after err
+    const char* stt_fmt = "%d uts, %d log, %d kcc, %d kmx, %.2f kvg, %d krq, %d req, %d avg, %d rmx, %d tav, %d tmx, %d slh, %d slm, %d sle, %d slc, %d slu, %d nfe, %d gif, %d ico, %d txt, %d jpg, %d png, %d swf, %d sta, %d stt, %d ufe, %d opt, %d pst, %d hed, %d rdr, %d nou, %d pth, %d 204, %d bad, %d tmo, %d cls, %d cly, %d clt, %d err, %d stm, %d sse, %d trc, %d dlh, %d dlr, %d dlb, %d shi, %d sht, %d shh, %d pln, %d plb, %d plx, %d hcc, %d hcq, %d hrj, %d tcc, %d tcq, %d trj, %.2f abg, %d abx, %d ihc, %d ihb, %d itc, %d itb, %d rlc, %d rln, %d rlr%s%s%s%s";
+    stats_refresh();
     get_time(&current_time);
     uptime = difftime(current_time.tv_sec, startup_time.tv_sec);
 
+    topStr = ratelimit_top(sta_offset);
+    if ((lat = lat_refresh())) {
+      latStr = stats_latency(lat, sta_offset);
+      free(lat);
+    }
+    seriesStr = series_stats(sta_offset);
+    hitStr = hitters_top(sta_offset);
+
     asprintf(&uptimeStr, "%dd %02d:%02d", (int)uptime/86400, (int)(uptime%86400)/3600, (int)((uptime%86400)%3600)/60);
 
-    if (asprintf(&retbuf, (sta_offset) ? sta_fmt : stt_fmt,
-        (sta_offset) ? (long)uptimeStr : (long)uptime, log_get_verb(), kcc, kmx, kvg, krq, count, avg, rmx, tav, tmx, slh, slm, sle, slc, slu, nfe, gif, ico, txt, jpg, png, swf, sta + sta_offset, stt + stt_offset, ufe, opt, pst, hed, rdr, nou, pth, noc, bad, tmo, cls, cly, clt, err
-        ) < 1)
+    if (sta_offset)
+      rv = asprintf(&retbuf, sta_fmt,
+        uptimeStr, log_get_verb(), kcc, kmx, kvg, krq, count, avg, rmx, tav, tmx, slh, slm, sle, slc, slu, nfe, gif, ico, txt, jpg, png, swf, sta + sta_offset, stt + stt_offset, stm, sse, trc, ufe, opt, pst, hed, rdr, nou, pth, noc, bad, tmo, dlh, dlr, dlb, cls, cly, clt, shi, sht, shh, err, pln, plb, plx, hcc, hcq, hrj, tcc, tcq, trj, (abw) ? (float)abn / abw : 0.0, abx, ihc, (ihc) ? ihm / ihc : 0, itc, (itc) ? itm / itc : 0, rlc, rln, rlr, (latStr) ? latStr : "", (seriesStr) ? seriesStr : "", (hitStr) ? hitStr : "", (topStr) ? topStr : "");
+    else
+      rv = asprintf(&retbuf, stt_fmt,
+        (int)uptime, log_get_verb(), kcc, kmx, kvg, krq, count, avg, rmx, tav, tmx, slh, slm, sle, slc, slu, nfe, gif, ico, txt, jpg, png, swf, sta + sta_offset, stt + stt_offset, ufe, opt, pst, hed, rdr, nou, pth, noc, bad, tmo, cls, cly, clt, err, stm, sse, trc, dlh, dlr, dlb, shi, sht, shh, pln, plb, plx, hcc, hcq, hrj, tcc, tcq, trj, (abw) ? (float)abn / abw : 0.0, abx, ihc, (ihc) ? ihm / ihc : 0, itc, (itc) ? itm / itc : 0, rlc, rln, rlr, (latStr) ? latStr : "", (seriesStr) ? seriesStr : "", (hitStr) ? hitStr : "", (topStr) ? topStr : "");
+    if (rv < 1)
         retbuf = " <asprintf error>";
 
     free(uptimeStr);
+    free(topStr);
+    free(latStr);
+    free(seriesStr);
+    free(hitStr);
     return retbuf;
 }
 
-// Use SMA for the first 500 samples approximated by # of requets. Use EMA afterwards
+int strbuf_printf(strbuf_struct *sb, const char *fmt, ...) {
+  va_list ap;
+  char *tmp;
+  int n, size, room;
+
+  for (;;) {
+    room = sb->size - sb->len;
+    va_start(ap, fmt);
+    n = vsnprintf((room > 0) ? sb->buf + sb->len : NULL, (room > 0) ? room : 0, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return -1;
+    if (n < room)
+      break;
+    size = (sb->size) ? sb->size * 2 : 4096;
+    while (size <= sb->len + n)
+      size *= 2;
+    if (!(tmp = realloc(sb->buf, size)))
+      return -1;
+    sb->buf = tmp;
+    sb->size = size;
+  }
+  sb->len += n;
+  return 0;
+}
+
+int get_metrics(strbuf_struct *sb, const int stm_offset) {
+    struct timespec current_time;
+    lat_sample_struct *lat;
+    int i, rv, slots, entries = sslctx_cache_entries(&slots);
+    const char *family = "";
+
+    stats_refresh();
+    get_time(&current_time);
+    // counters get _total appended to their samples
+    const struct {
+      const char *name, *type, *help, *label;
+      double value;
+    } m[] = {
+      { "uptime_seconds", "gauge", "Process uptime", NULL, difftime(current_time.tv_sec, startup_time.tv_sec) },
+      { "log_level", "gauge", "Log level: critical (0) error (1) warning (2) notice (3) info (4) debug (5)", NULL, log_get_verb() },
+      { "connections", "gauge", "Connections in service", "proto=\"http\"", hcc },
+      { "connections", "gauge", "Connections in service", "proto=\"https\"", tcc },
+      { "connections_max", "gauge", "Most connections in service at once", NULL, kmx },
+      { "connection_quota", "gauge", "Connections allowed in service", "proto=\"http\"", hcq },
+      { "connection_quota", "gauge", "Connections allowed in service", "proto=\"https\"", tcq },
+      { "connection_requests_avg", "gauge", "Average number of requests per connection", NULL, kvg },
+      { "connection_requests_max", "gauge", "Most requests on one connection", NULL, krq },
+      { "requests", "counter", "Requests (HTTP, HTTPS, success, failure etc)", NULL, count },
+      { "request_bytes_avg", "gauge", "Average size of requests", NULL, avg },
+      { "request_bytes_max", "gauge", "Largest request", NULL, rmx },
+      { "request_seconds_avg", "gauge", "Average processing time per request", NULL, tav / 1000.0 },
+      { "request_seconds_max", "gauge", "Longest processing time of a request", NULL, tmx / 1000.0 },
+#define RESPONSE(code, v) { "responses", "counter", "Requests by response, names as on the stats pages", "response=\"" code "\"", v }
+      RESPONSE("nfe", nfe), RESPONSE("gif", gif), RESPONSE("ico", ico),
+      RESPONSE("txt", txt), RESPONSE("jpg", jpg), RESPONSE("png", png),
+      RESPONSE("swf", swf), RESPONSE("sta", sta), RESPONSE("stt", stt),
+      RESPONSE("stm", stm + stm_offset), RESPONSE("sse", sse), RESPONSE("trc", trc),
+      RESPONSE("ufe", ufe), RESPONSE("opt", opt), RESPONSE("pst", pst),
+      RESPONSE("hed", hed), RESPONSE("rdr", rdr), RESPONSE("nou", nou),
+      RESPONSE("pth", pth), RESPONSE("204", noc), RESPONSE("bad", bad),
+      RESPONSE("rlr", rlr), RESPONSE("tmo", tmo), RESPONSE("cls", cls),
+      RESPONSE("cly", cly), RESPONSE("err", err),
+#undef RESPONSE
+      { "tls_requests", "counter", "HTTPS requests by outcome", "result=\"accepted\"", slh },
+      { "tls_requests", "counter", "HTTPS requests by outcome", "result=\"missing_cert\"", slm },
+      { "tls_requests", "counter", "HTTPS requests by outcome", "result=\"bad_cert\"", sle },
+      { "tls_requests", "counter", "HTTPS requests by outcome", "result=\"client_closed\"", slc },
+      { "tls_requests", "counter", "HTTPS requests by outcome", "result=\"unknown_error\"", slu },
+      { "deadline_kills", "counter", "Connections killed at a deadline", "phase=\"handshake\"", dlh },
+      { "deadline_kills", "counter", "Connections killed at a deadline", "phase=\"header\"", dlr },
+      { "deadline_kills", "counter", "Connections killed at a deadline", "phase=\"body\"", dlb },
+      { "dropped", "counter", "Connections dropped for lack of service threads or quota", NULL, clt },
+      { "shed", "counter", "Connections shed under load", "kind=\"idle\"", shi },
+      { "shed", "counter", "Connections shed under load", "kind=\"tls\"", sht },
+      { "shed", "counter", "Connections shed under load", "kind=\"queue\"", shh },
+      { "quota_rejects", "counter", "New connections refused at the quota", "proto=\"http\"", hrj },
+      { "quota_rejects", "counter", "New connections refused at the quota", "proto=\"https\"", trj },
+      { "ratelimit_refused", "counter", "Connections and requests refused over a client limit", "limit=\"connection_rate\"", rlc },
+      { "ratelimit_refused", "counter", "Connections and requests refused over a client limit", "limit=\"open_connections\"", rln },
+      { "ratelimit_refused", "counter", "Connections and requests refused over a client limit", "limit=\"request_rate\"", rlr },
+      { "pool_threads", "gauge", "Threads in the service thread pool", NULL, pln },
+      { "pool_threads_busy", "gauge", "Busy threads in the service thread pool", NULL, plb },
+      { "pool_threads_max", "gauge", "Most threads in the service thread pool", NULL, plx },
+      { "accept_wakeups", "counter", "Listener wakeups accepting connections", NULL, abw },
+      { "accepted", "counter", "Connections accepted", NULL, abn },
+      { "accept_batch_max", "gauge", "Most connections accepted in one wakeup", NULL, abx },
+      { "idle_connections", "gauge", "Idle keep-alive connections (event mode)", "proto=\"http\"", ihc },
+      { "idle_connections", "gauge", "Idle keep-alive connections (event mode)", "proto=\"https\"", itc },
+      { "idle_connection_bytes", "gauge", "Memory held by idle connections, excluding socket buffers", "proto=\"http\"", ihm },
+      { "idle_connection_bytes", "gauge", "Memory held by idle connections, excluding socket buffers", "proto=\"https\"", itm },
+      { "cert_cache_entries", "gauge", "Certificate contexts cached", NULL, entries },
+      { "cert_cache_slots", "gauge", "Certificate contexts the cache can hold", NULL, slots },
+    };
+
+    rv = 0;
+    for (i = 0; i < sizeof(m) / sizeof(m[0]); i++) {
+      if (strcmp(family, m[i].name)) {
+        family = m[i].name;
+        rv |= strbuf_printf(sb, "# TYPE pixelserv_%s %s\n# HELP pixelserv_%s %s\n",
+            family, m[i].type, family, m[i].help);
+      }
+      rv |= strbuf_printf(sb, "pixelserv_%s%s%s%s%s %.10g\n", m[i].name,
+          (m[i].type[0] == 'c') ? "_total" : "", (m[i].label) ? "{" : "",
+          (m[i].label) ? m[i].label : "", (m[i].label) ? "}" : "", m[i].value);
+    }
+    if ((lat = lat_refresh())) {
+      rv |= stats_latency_metrics(sb, lat);
+      free(lat);
+    } else
+      rv = -1;
+    rv |= strbuf_printf(sb, "# EOF\n");
+    return rv;
+}
+
+// the values of the stats feed in the order of the plain text stats. S(c)
+// is counter c of stats_sum_struct, the others are kept shared
+#define FEED_VALUES_LIST(X, S) \
+  X("log", log_get_verb()) X("kcc", kcc) X("kmx", kmx) X("krq", S(krq)) \
+  X("req", S(count)) X("avg", S(avg)) X("rmx", S(rmx)) X("tav", S(tav)) \
+  X("tmx", S(tmx)) X("slh", S(slh)) X("slm", S(slm)) X("sle", S(sle)) \
+  X("slc", S(slc)) X("slu", S(slu)) X("nfe", S(nfe)) X("gif", S(gif)) \
+  X("ico", S(ico)) X("txt", S(txt)) X("jpg", S(jpg)) X("png", S(png)) \
+  X("swf", S(swf)) X("sta", S(sta)) X("stt", S(stt)) X("ufe", S(ufe)) \
+  X("opt", S(opt)) X("pst", S(pst)) X("hed", S(hed)) X("rdr", S(rdr)) \
+  X("nou", S(nou)) X("pth", S(pth)) X("204", S(noc)) X("bad", S(bad)) \
+  X("tmo", S(tmo)) X("cls", S(cls)) X("cly", S(cly)) X("clt", S(clt)) \
+  X("err", S(err)) X("stm", S(stm)) X("sse", S(sse)) X("trc", S(trc)) \
+  X("dlh", S(dlh)) X("dlr", S(dlr)) X("dlb", S(dlb)) X("shi", S(shi)) \
+  X("sht", S(sht)) X("shh", S(shh)) X("pln", pln) X("plb", plb) \
+  X("plx", plx) X("hcc", hcc) X("hcq", hcq) X("hrj", S(hrj)) \
+  X("tcc", tcc) X("tcq", tcq) X("trj", S(trj)) X("abx", S(abx)) \
+  X("ihc", ihc) X("itc", itc) X("rlc", S(rlc)) X("rln", S(rln)) \
+  X("rlr", S(rlr))
+
+#define FEED_NAME(name, value) name,
+#define FEED_VALUE(name, value) value,
+#define FEED_GLOBAL(c) c
+#define FEED_SUM(c) s.c
+
+static const char *feed_names[] = { FEED_VALUES_LIST(FEED_NAME, FEED_GLOBAL) };
+
+static int feed_copy(const int *f, const char **names, int *values) {
+    int i;
+
+    for (i = 0; i < sizeof(feed_names) / sizeof(feed_names[0]) && i < FEED_VALUES; i++) {
+      names[i] = feed_names[i];
+      values[i] = f[i];
+    }
+    return i;
+}
+
+int get_feed(const char **names, int *values) {
+    stats_refresh();
+    const int f[] = { FEED_VALUES_LIST(FEED_VALUE, FEED_GLOBAL) };
+
+    return feed_copy(f, names, values);
+}
+
+int get_feed_sample(const char **names, int *values) {
+    stats_sum_struct s;
+
+    stats_sum(&s);
+    const int f[] = { FEED_VALUES_LIST(FEED_VALUE, FEED_SUM) };
+
+    return feed_copy(f, names, values);
+}
+
+#ifndef USE_PTHREAD
+int stats_shm_init(void) {
+  stats_shm = mmap(NULL, sizeof(stats_shm_struct), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats_shm == MAP_FAILED) {
+    stats_shm = NULL;
+    return -1;
+  }
+  stats_shm_publish();
+  return 0;
+}
+
+void stats_shm_publish(void) {
+  struct timespec now;
+
+  if (!stats_shm)
+    return;
+  get_time(&now);
+  if (now.tv_sec == stats_shm_published)
+    return;
+  stats_shm_published = now.tv_sec;
+  stats_collect();
+#define X(c) stats_shm->c = c;
+  STATS_COUNTERS(X)
+#undef X
+  stats_shm->kvg = kvg;
+  stats_shm->verb = log_get_verb();
+  stats_lat_sample(&stats_shm->lat);
+}
+
+void stats_shm_publish_conns(void) {
+  if (!stats_shm)
+    return;
+  stats_shm->kcc = kcc;
+  stats_shm->kmx = kmx;
+  stats_shm->hcc = hcc;
+  stats_shm->tcc = tcc;
+}
+
+void stats_shm_load(void) {
+  if (!stats_shm)
+    return;
+  stats_shm_reader = 1;
+#define X(c) c = stats_shm->c;
+  STATS_COUNTERS(X)
+#undef X
+  kvg = stats_shm->kvg;
+  log_set_verb(stats_shm->verb);
+}
+#endif
+
+// Use SMA for the first 500 samples. Use EMA afterwards
 float ema(float curr, int new, int *cnt) {
-    if (count < 500) {
+    if (*cnt < 500) {
       curr *= *cnt;
       curr = (curr + new) / ++(*cnt);
     } else
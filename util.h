@@ -22,6 +22,7 @@
 #define VERSION "v2.0.1-rc2"
 
 #define BACKLOG SOMAXCONN       // how many pending connections queue will hold
+#define ACCEPT_BUDGET 32        // max connections accepted per listener wakeup
 #define DEFAULT_IP "*"          // default IP address ALL - use this in messages only
 #define DEFAULT_PORT "80"       // the default port users will be connecting to
 #define DEFAULT_TIMEOUT 10     // default timeout for select() calls, in seconds
@@ -33,6 +34,7 @@
 #define SECOND_PORT "443"
 #define MAX_PORTS 10
 #define MAX_TLS_PORTS 9         // PLEASE ENSURE MAX_TLS_PORTS < MAX_PORTS
+#define CACHE_LINE 64           // keeps data written by different threads apart
 
 #ifdef DROP_ROOT
 # define DEFAULT_USER "nobody"  // nobody used by dnsmasq
@@ -40,6 +42,9 @@
 
 # define DEFAULT_STATS_URL "/servstats"
 # define DEFAULT_STATS_TEXT_URL "/servstats.txt"
+# define DEFAULT_METRICS_URL "/servmetrics"
+# define DEFAULT_FEED_URL "/servfeed"
+# define DEFAULT_TRACE_URL "/servstats/trace"
 
 /* taken from glibc unistd.h and fixes musl */
 #ifndef TEMP_FAILURE_RETRY
@@ -81,6 +86,9 @@ extern volatile sig_atomic_t swf;
 extern volatile sig_atomic_t ico;
 extern volatile sig_atomic_t sta; // so meta!
 extern volatile sig_atomic_t stt;
+extern volatile sig_atomic_t stm; // metrics requests
+extern volatile sig_atomic_t sse; // stats feeds opened
+extern volatile sig_atomic_t trc; // request traces served
 extern volatile sig_atomic_t noc;
 extern volatile sig_atomic_t rdr;
 extern volatile sig_atomic_t pst;
@@ -99,6 +107,31 @@ extern volatile sig_atomic_t kct;
 extern float kvg;
 extern volatile sig_atomic_t krq;
 extern volatile sig_atomic_t clt;
+extern volatile sig_atomic_t pln;
+extern volatile sig_atomic_t plb;
+extern volatile sig_atomic_t plx;
+extern volatile sig_atomic_t abw;
+extern volatile sig_atomic_t abn;
+extern volatile sig_atomic_t abx;
+extern volatile sig_atomic_t shi;
+extern volatile sig_atomic_t sht;
+extern volatile sig_atomic_t shh;
+extern volatile sig_atomic_t hcc;
+extern volatile sig_atomic_t hcq;
+extern volatile sig_atomic_t hrj;
+extern volatile sig_atomic_t tcc;
+extern volatile sig_atomic_t tcq;
+extern volatile sig_atomic_t trj;
+extern volatile sig_atomic_t rlc;
+extern volatile sig_atomic_t rln;
+extern volatile sig_atomic_t rlr;
+extern volatile sig_atomic_t dlh;
+extern volatile sig_atomic_t dlr;
+extern volatile sig_atomic_t dlb;
+extern volatile sig_atomic_t ihc;
+extern volatile sig_atomic_t ihm;
+extern volatile sig_atomic_t itc;
+extern volatile sig_atomic_t itm;
 
 struct Global {
     int argc;
@@ -108,11 +141,12 @@ struct Global {
     const int pipefd;
     const char* const stats_url;
     const char* const stats_text_url;
+    const char* const metrics_url;
+    const char* const feed_url;
+    const char* const trace_url;
     const int do_204;
     const int do_redirect;
-#ifdef DEBUG
     const int warning_time;
-#endif
 };
 
 #define GLOBAL(p,e) ((struct Global *)p)->e
@@ -138,6 +172,45 @@ char* get_version(int argc, char* argv[]);
 // - Similarly, stt_offset is for an in-progress status.txt response.
 char* get_stats(const int sta_offset, const int stt_offset);
 
+// growable output buffer, kept around to be written again
+typedef struct {
+  char *buf;
+  int size;
+  int len;
+} strbuf_struct;
+
+// append to sb->buf at sb->len, growing it as needed. returns -1 if out of
+// memory, with sb->buf left as it was
+int strbuf_printf(strbuf_struct *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// every counter of get_stats() and the latency histograms in OpenMetrics
+// text format, appended to sb. stm_offset counts an in-progress metrics
+// response. returns -1 if out of memory
+int get_metrics(strbuf_struct *sb, const int stm_offset);
+
+// the integer counters of get_stats() for the stats feed: their short names
+// into names[] and current values into values[], FEED_VALUES at most.
+// returns how many
+#define FEED_VALUES 64
+int get_feed(const char **names, int *values);
+// the same added up from the counters of the threads without touching the
+// globals, for the stats segment
+int get_feed_sample(const char **names, int *values);
+
+#ifndef USE_PTHREAD
+// stats shared with pre-forked worker processes: main() sets up the segment
+// before forking and publishes its counters and latency histograms once a
+// second at most, the connections in service after each update, as
+// admission needs them current. workers load the counters (and the log
+// level) before serving, the histograms only to render them. the first
+// load makes get_stats() reload on every call
+int stats_shm_init(void);
+void stats_shm_publish(void);
+void stats_shm_publish_conns(void);
+void stats_shm_load(void);
+#endif
+
 float ema(float curr, int new, int *cnt);
 
 double elapsed_time_msec(const struct timespec start_time);